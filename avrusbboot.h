@@ -0,0 +1,37 @@
+/*
+  avrusbboot.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Public header of libavrusbboot. Typical use:
+
+    CFlashjob job;            options and files as on the command line
+    CFlasher flasher;
+    if (flasher.open() < 0 || flasher.flash(&job, progress, pUser) < 0)
+      report(flasher.getErrormessage());
+
+  The flasher keeps the device handle and the parsed image, so further
+  jobs only reparse when the inputs change. No function terminates the
+  process, errors are the negative ERROR_* codes from cerror.h.
+
+  CScheduler flashes all attached bootloaders at once, CStation runs a
+  production station loop. Compiled as C++20 the coroutine API
+  CAsyncbootloader is available too.
+*/
+
+#ifndef _H_AVRUSBBOOT_
+#define _H_AVRUSBBOOT_
+
+#include "cerror.h"
+#include "cpage.h"
+#include "cflashmem.h"
+#include "cflashpatch.h"
+#include "cbootloader.h"
+#include "cemulator.h"
+#include "cflashjob.h"
+#include "cflasher.h"
+#include "cscheduler.h"
+#include "cstation.h"
+#if __cplusplus >= 202002L
+#include "casyncbootloader.h"
+#endif
+
+#endif
@@ -0,0 +1,333 @@
+/*
+  casyncbootloader.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Non blocking bootloader API (C++20 coroutines): every request is an
+  asynchronous libusb control transfer, the awaiting task is resumed from
+  the transfer callback. One thread running libusb's event handling can
+  supervise any number of devices.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "casyncbootloader.h"
+#include "ccompressor.h"
+
+#define ASYNCBOOTLOADER_TIMEOUT 5000
+
+/* One control transfer on a slot of the transfer pool. co_await submits
+   it and suspends the task until libusb reports completion; the result is
+   the number of data bytes transferred or ERROR_TRANSFER. IN data is
+   copied to pData. */
+class CAsyncbootloader::CTransferawaiter {
+ public:
+  CTransferawaiter(libusb_device_handle* handle, CTransferpool* pTransferpool,
+      unsigned char bmRequestType, unsigned char bRequest, unsigned int wValue,
+      unsigned int wIndex, unsigned char* pData, unsigned int nLength) {
+    m_pTransferpool = pTransferpool;
+    m_pData = pData;
+    m_bIn = (bmRequestType & LIBUSB_ENDPOINT_IN) != 0;
+    m_bFailed = false;
+    if ((m_pSlot = pTransferpool->acquire(nLength)) == NULL) {
+      m_bFailed = true;
+      return;
+    }
+    m_pTransfer = m_pSlot->pTransfer;
+    libusb_fill_control_setup(m_pSlot->pBuffer, bmRequestType, bRequest, wValue, wIndex, nLength);
+    if (!m_bIn && nLength > 0)
+      memcpy(m_pSlot->pBuffer + LIBUSB_CONTROL_SETUP_SIZE, pData, nLength);
+    libusb_fill_control_transfer(m_pTransfer, handle, m_pSlot->pBuffer, callback, NULL,
+        ASYNCBOOTLOADER_TIMEOUT);
+  }
+
+  CTransferawaiter(const CTransferawaiter&) = delete;
+  ~CTransferawaiter() {
+    if (m_pSlot != NULL) m_pTransferpool->release(m_pSlot);
+  }
+
+  bool await_ready() { return m_bFailed; }
+
+  /* false resumes the task at once if the transfer cannot be submitted */
+  bool await_suspend(std::coroutine_handle<> caller) {
+    m_caller = caller;
+    m_pTransfer->user_data = this;
+    if (libusb_submit_transfer(m_pTransfer) < 0) {
+      m_bFailed = true;
+      return false;
+    }
+    return true;
+  }
+
+  int await_resume() {
+    if (m_bFailed || m_pTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+      return ERROR_TRANSFER;
+    if (m_bIn && m_pTransfer->actual_length > 0)
+      memcpy(m_pData, libusb_control_transfer_get_data(m_pTransfer), m_pTransfer->actual_length);
+    return m_pTransfer->actual_length;
+  }
+
+ protected:
+  static void LIBUSB_CALL callback(libusb_transfer* pTransfer) {
+    ((CTransferawaiter*) pTransfer->user_data)->m_caller.resume();
+  }
+
+  CTransferpool* m_pTransferpool;
+  CTransferpool::SSlot* m_pSlot;
+  libusb_transfer* m_pTransfer;
+  unsigned char* m_pData;
+  bool m_bIn;
+  bool m_bFailed;
+  std::coroutine_handle<> m_caller;
+};
+
+/* takes over a handle opened with CBootloader::openDevice */
+CAsyncbootloader::CAsyncbootloader(libusb_device_handle* handle) {
+  m_pHandle = handle;
+  m_pTransferpool = new CTransferpool(handle);
+  memset(&m_info, 0, sizeof(m_info));
+  m_bInfovalid = false;
+  m_nBatchlimit = USBBOOT_MAXBATCH;
+  m_bCompress = true;
+  m_bCopy = true;
+  m_nRetries = USBBOOT_RETRIES;
+}
+
+CAsyncbootloader::~CAsyncbootloader() {
+  delete m_pTransferpool;
+  libusb_close(m_pHandle);
+}
+
+/* the same switches as CBootloader's, see there */
+void CAsyncbootloader::setBatchlimit(unsigned int nLimit) {
+  m_nBatchlimit = nLimit > 0 ? nLimit : 1;
+}
+
+void CAsyncbootloader::setCompressenabled(bool bEnabled) {
+  m_bCompress = bEnabled;
+}
+
+void CAsyncbootloader::setCopyenabled(bool bEnabled) {
+  m_bCopy = bEnabled;
+}
+
+void CAsyncbootloader::setRetries(unsigned int nLimit) {
+  m_nRetries = nLimit;
+}
+
+CTransferpool* CAsyncbootloader::getTransferpool() {
+  return m_pTransferpool;
+}
+
+CAsyncbootloader::CTransferawaiter CAsyncbootloader::controlTransfer(
+    unsigned char bmRequestType, unsigned char bRequest, unsigned int wValue,
+    unsigned int wIndex, unsigned char* pData, unsigned int nLength) {
+  return CTransferawaiter(m_pHandle, m_pTransferpool, bmRequestType, bRequest, wValue,
+      wIndex, pData, nLength);
+}
+
+/* page size reported by the bootloader, 0 on error */
+CTask<unsigned int> CAsyncbootloader::getPagesize() {
+  unsigned char buffer[8];
+
+  int nBytes = co_await controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_PAGESIZE,
+      0, 0, buffer, sizeof(buffer));
+  if (nBytes != 2) {
+    setError(ERROR_TRANSFER, "Wrong response size in getPageSize: %d !", nBytes);
+    co_return 0;
+  }
+  co_return (buffer[0] << 8) | buffer[1];
+}
+
+CTask<int> CAsyncbootloader::startApplication() {
+  unsigned char buffer[8];
+
+  int nBytes = co_await controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_LEAVE_BOOT,
+      0, 0, buffer, sizeof(buffer));
+  if (nBytes != 0)
+    co_return setError(ERROR_TRANSFER, "Wrong response size in startApplication: %d !", nBytes);
+  co_return ERROR_NONE;
+}
+
+/* device description as CBootloader::getInfo asks it: GET_INFO, for
+   legacy bootloaders page size and batch size */
+CTask<int> CAsyncbootloader::readInfo() {
+  unsigned char buffer[USBBOOT_INFOSIZE];
+
+  int nBytes = co_await controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_INFO,
+      0, 0, buffer, sizeof(buffer));
+  int nParsed = CBootloader::parseInfo(buffer, nBytes, m_info);
+  if (nParsed < 0)
+    co_return setError(ERROR_TRANSFER, "Bootloader reports page size 0 !");
+  if (nParsed == 0) {
+    m_info.pagesize = co_await getPagesize();
+    if (m_info.pagesize == 0) co_return m_nError;
+    nBytes = co_await controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_BATCHSIZE,
+        0, 0, buffer, sizeof(buffer));
+    m_info.batchsize = 1;
+    if (nBytes >= 1 && buffer[0] > 1) {
+      m_info.batchsize = buffer[0];
+      m_info.features |= USBBOOT_FEATURE_BATCH;
+    }
+  }
+  m_bInfovalid = true;
+  co_return ERROR_NONE;
+}
+
+/* NULL before readInfo() succeeded */
+const SBootinfo* CAsyncbootloader::getInfo() {
+  return m_bInfovalid ? &m_info : NULL;
+}
+
+/* pages per writePages() request: the bootloader's batch size as far as
+   it fits a control transfer, 1 for single page writes */
+unsigned int CAsyncbootloader::getBatchsize() {
+  if (!m_bInfovalid) return 1;
+  unsigned int nPages = std::min(m_info.batchsize, USBBOOT_CONTROLPAGES(m_info.pagesize));
+  nPages = std::min(nPages, m_nBatchlimit);
+  return nPages > 0 ? nPages : 1;
+}
+
+bool CAsyncbootloader::canCopy() {
+  return m_bCopy && m_bInfovalid && (m_info.features & USBBOOT_FEATURE_COPY);
+}
+
+/* as CBootloader::checkRange, after readInfo() */
+int CAsyncbootloader::checkRange(unsigned int nAddress, unsigned int nLength) {
+  if (m_info.version == 0 && (nAddress > 0xffff || nLength > 0x10000 - nAddress))
+    return setError(ERROR_RANGE, "Page 0x%x beyond the 64 kB a legacy bootloader addresses!",
+        nAddress);
+  unsigned int nEnd = m_info.bootstart ? m_info.bootstart : m_info.flashsize;
+  if (nEnd != 0 && (nAddress >= nEnd || nLength > nEnd - nAddress))
+    return setError(ERROR_RANGE, "Page 0x%x beyond application flash (ends at 0x%x)!",
+        nAddress, nEnd);
+  return ERROR_NONE;
+}
+
+/* OUT request at a flash address, sent again up to setRetries() times
+   if it fails. The event loop has no timer, so the retries follow at
+   once; they cover a lost or stalled transfer, not a device that needs
+   time. All of these requests program the same flash when repeated. */
+CTask<int> CAsyncbootloader::sendRequest(unsigned char bRequest, unsigned int nAddress,
+    unsigned char* pData, unsigned int nLength) {
+  int nBytes = 0;
+  for (unsigned int nAttempt = 0; nAttempt <= m_nRetries; nAttempt++) {
+    nBytes = co_await controlTransfer(USBBOOT_REQUEST_OUT, bRequest, nAddress & 0xffff,
+        nAddress >> 16, pData, nLength);
+    if (nBytes == (int) nLength) co_return ERROR_NONE;
+  }
+  co_return setError(ERROR_TRANSFER, "Wrong byte count in request %u: %d !",
+      (unsigned int) bRequest, nBytes);
+}
+
+/* same request as CBootloader::writePage, retried like the others; the
+   range is checked once readInfo() has run */
+CTask<int> CAsyncbootloader::writePage(CPage* page) {
+  unsigned char bRequest = USBBOOT_FUNC_WRITE_PAGE;
+  unsigned int nLength = page->getPagesize();
+  int nResult = m_bInfovalid ? checkRange(page->getPageaddress(), nLength) : ERROR_NONE;
+  if (nResult < 0) co_return nResult;
+
+  if ((m_info.features & USBBOOT_FEATURE_PARTIAL) && page->getDatalength() < nLength) {
+    bRequest = USBBOOT_FUNC_WRITE_PARTIAL;
+    nLength = page->getDatalength();
+  }
+  co_return co_await sendRequest(bRequest, page->getPageaddress(),
+      (unsigned char*) page->getData(), nLength);
+}
+
+/* nCount consecutive pages (at most getBatchsize()) in one request, the
+   same ones CBootloader::writePages sends on the control endpoint:
+   compressed if that makes them smaller, else as a batch, else a single
+   page, without its erased tail if the bootloader fills it */
+CTask<int> CAsyncbootloader::writePages(CPage** pages, unsigned int nCount) {
+  unsigned int nPagesize = pages[0]->getPagesize();
+  unsigned int nAddress = pages[0]->getPageaddress();
+  bool bPartial = (m_info.features & USBBOOT_FEATURE_PARTIAL) != 0;
+  unsigned int nLength = 0;
+
+  if (m_bCompress && (m_info.features & USBBOOT_FEATURE_COMPRESS)) {
+    m_vPayload.resize(USBBOOT_BATCHHEADER + nCount * COMPRESS_BOUND(nPagesize));
+    nLength = CBootloader::codeCompressed(pages, nCount, &m_vPayload[0]);
+    if (nLength > 0)
+      co_return co_await sendRequest(USBBOOT_FUNC_WRITE_COMPRESSED, nAddress,
+          &m_vPayload[0], nLength);
+  }
+  if (nCount > 1 && (m_info.features & USBBOOT_FEATURE_BATCH)) {
+    m_vPayload.resize(USBBOOT_BATCHHEADER + nCount * nPagesize);
+    nLength = CBootloader::codeBatch(pages, nCount, bPartial, &m_vPayload[0]);
+    co_return co_await sendRequest(USBBOOT_FUNC_WRITE_BATCH, nAddress, &m_vPayload[0],
+        nLength);
+  }
+  for (unsigned int n = 0; n < nCount; n++) {
+    int nResult = co_await writePage(pages[n]);
+    if (nResult < 0) co_return nResult;
+  }
+  co_return ERROR_NONE;
+}
+
+/* same request as CBootloader::copyPages */
+CTask<int> CAsyncbootloader::copyPages(unsigned int nAddress, unsigned int nSource,
+    unsigned int nCount) {
+  unsigned char payload[USBBOOT_COPYSIZE];
+  for (int n = 0; n < 4; n++)
+    payload[n] = (nSource >> (8 * n)) & 0xff;
+  payload[4] = nCount;
+  co_return co_await sendRequest(USBBOOT_FUNC_COPY_PAGES, nAddress, payload,
+      sizeof(payload));
+}
+
+/* write all pages: every page is checked against the device's flash
+   before the first write, then runs of consecutive pages go out
+   getBatchsize() at a time (see writePages). Copies and bulk streams
+   are left to CScheduler and CFlashjob. Stops at the first failed
+   request. */
+CTask<int> CAsyncbootloader::flashImage(CFlashpatch* pFlashpatch,
+    TProgresscallback pfnProgress, void* pUser) {
+  int nResult = co_await readInfo();
+  if (nResult < 0) co_return nResult;
+  CPage* pPage;
+  for (pPage = pFlashpatch->getFirstpage(); pPage != NULL;
+       pPage = pFlashpatch->getNextpage(pPage))
+    if (checkRange(pPage->getPageaddress(), pPage->getPagesize()) < 0)
+      co_return m_nError;
+
+  unsigned int nPages = pFlashpatch->getPagecount();
+  unsigned int nBatch = getBatchsize();
+  unsigned int nPage = 0;
+  std::vector<CPage*> run;
+  pPage = pFlashpatch->getFirstpage();
+  while (pPage != NULL) {
+    run.clear();
+    do {
+      if (pfnProgress != NULL) pfnProgress(pUser, nPage, nPages, pPage);
+      run.push_back(pPage);
+      nPage++;
+      pPage = pFlashpatch->getNextpage(pPage);
+    } while (pPage != NULL && run.size() < nBatch
+             && pPage->getPageaddress() == run.back()->getPageaddress()
+                + run.back()->getPagesize());
+    nResult = co_await writePages(&run[0], run.size());
+    if (nResult < 0) co_return nResult;
+  }
+  co_return ERROR_NONE;
+}
+
+/* simple event loop: start the tasks and handle libusb events until all
+   of them are done. Applications with their own loop start the tasks
+   themselves and poll libusb's file descriptors. */
+int CAsyncbootloader::run(libusb_context* ctx, std::vector<CTask<int>*>& tasks) {
+  for (size_t n = 0; n < tasks.size(); n++)
+    tasks[n]->start();
+
+  for (;;) {
+    bool bDone = true;
+    for (size_t n = 0; n < tasks.size() && bDone; n++)
+      bDone = tasks[n]->isDone();
+    if (bDone) return ERROR_NONE;
+
+    int nResult = libusb_handle_events_completed(ctx, NULL);
+    if (nResult < 0 && nResult != LIBUSB_ERROR_INTERRUPTED)
+      return ERROR_TRANSFER;
+  }
+}
@@ -0,0 +1,66 @@
+/*
+  casyncbootloader.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Non blocking bootloader API (C++20 coroutines): every request is an
+  asynchronous libusb control transfer, the awaiting task is resumed from
+  the transfer callback. One thread running libusb's event handling can
+  supervise any number of devices.
+*/
+
+#ifndef _H_CASYNCBOOTLOADER_
+#define _H_CASYNCBOOTLOADER_
+
+#include <vector>
+
+#include "libusb.h"
+#include "ctask.h"
+#include "cpage.h"
+#include "cflashpatch.h"
+#include "cflashjob.h"
+#include "cbootloader.h"
+#include "cerror.h"
+#include "ctransferpool.h"
+
+class CAsyncbootloader : public CErrorstate {
+ public:
+  CAsyncbootloader(libusb_device_handle* handle);
+  ~CAsyncbootloader();
+  CTask<unsigned int> getPagesize();
+  CTask<int> readInfo();
+  const SBootinfo* getInfo();
+  unsigned int getBatchsize();
+  bool canCopy();
+  int checkRange(unsigned int nAddress, unsigned int nLength);
+  CTask<int> writePage(CPage* page);
+  CTask<int> writePages(CPage** pages, unsigned int nCount);
+  CTask<int> copyPages(unsigned int nAddress, unsigned int nSource, unsigned int nCount);
+  CTask<int> startApplication();
+  CTask<int> flashImage(CFlashpatch* pFlashpatch, TProgresscallback pfnProgress,
+                        void* pUser);
+  void setBatchlimit(unsigned int nLimit);
+  void setCompressenabled(bool bEnabled);
+  void setCopyenabled(bool bEnabled);
+  void setRetries(unsigned int nLimit);
+  CTransferpool* getTransferpool();
+  static int run(libusb_context* ctx, std::vector<CTask<int>*>& tasks);
+
+ protected:
+  class CTransferawaiter;
+  CTransferawaiter controlTransfer(unsigned char bmRequestType, unsigned char bRequest,
+                                   unsigned int wValue, unsigned int wIndex,
+                                   unsigned char* pData, unsigned int nLength);
+  CTask<int> sendRequest(unsigned char bRequest, unsigned int nAddress,
+                         unsigned char* pData, unsigned int nLength);
+
+  libusb_device_handle* m_pHandle;
+  CTransferpool* m_pTransferpool;
+  SBootinfo m_info;
+  bool m_bInfovalid;
+  unsigned int m_nBatchlimit;
+  bool m_bCompress;
+  bool m_bCopy;
+  unsigned int m_nRetries;
+  std::vector<unsigned char> m_vPayload;   /* coded batch, reused */
+};
+
+#endif
@@ -9,21 +9,28 @@
  Parts are taken from the PowerSwitch project by Objective Development Software GmbH
  */
 
-#include "cbootloader.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#endif
 
-static libusb_context *ctx;
+#include <algorithm>
 
-static int usbGetStringAscii(libusb_device_handle *dev, int index, int langid,
-        char *buf, int buflen) {
-    unsigned char buffer[256];
-    int rval, i;
+#include "cbootloader.h"
+#include "cemulator.h"
+#include "ccompressor.h"
 
-    if ((rval = libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN,
-            LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) + index,
-            langid, buffer, sizeof(buffer), 1000)) < 0)
-        return rval;
-    if (buffer[1] != LIBUSB_DT_STRING)
+/* string descriptor of rval bytes in buffer to ASCII */
+static int stringAscii(const unsigned char *buffer, int rval, char *buf,
+        int buflen) {
+    int i;
+
+    if (rval < 2 || buffer[1] != LIBUSB_DT_STRING) {
+        buf[0] = 0;
         return 0;
+    }
     if ((unsigned char) buffer[0] < rval)
         rval = (unsigned char) buffer[0];
     rval /= 2;
@@ -39,91 +46,252 @@ static int usbGetStringAscii(libusb_device_handle *dev, int index, int langid,
     return i - 1;
 }
 
-/* This project uses the free shared default VID/PID. If you want to see an
- * example device lookup where an individually reserved PID is used, see our
- * RemoteSensor reference implementation.
+static int usbGetStringAscii(libusb_device_handle *dev, int index, int langid,
+        char *buf, int buflen) {
+    unsigned char buffer[256];
+    int rval;
+
+    if ((rval = libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN,
+            LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) + index,
+            langid, buffer, sizeof(buffer), 1000)) < 0)
+        return rval;
+    return stringAscii(buffer, rval, buf, buflen);
+}
+
+/* bus and port path of the device, as in "1-2.3" */
+std::string CBootloader::getPath(libusb_device *dev) {
+    uint8_t ports[8];
+    char buffer[8];
+
+    snprintf(buffer, sizeof(buffer), "%d", libusb_get_bus_number(dev));
+    std::string path = buffer;
+    int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for (int n = 0; n < count; n++) {
+        snprintf(buffer, sizeof(buffer), "%c%d", n == 0 ? '-' : '.', ports[n]);
+        path += buffer;
+    }
+    return path;
+}
+
+/* a selector of digits, '-' and '.' is a bus and port path, anything
+ * else a serial number
  */
-static libusb_device_handle *findDevice(void) {
-    unsigned int i;
-    struct libusb_device *dev = 0;
+static bool isPath(const std::string &selector) {
+    return selector.find('-') != std::string::npos
+            && selector.find_first_not_of("0123456789-.") == std::string::npos;
+}
+
+/* string descriptor index checked in step 0 (manufacturer), 1 (product)
+ * or 2 (serial number)
+ */
+static uint8_t getStringindex(const struct libusb_device_descriptor &descriptor,
+        int step) {
+    return step == 0 ? descriptor.iManufacturer
+            : step == 1 ? descriptor.iProduct : descriptor.iSerialNumber;
+}
+
+/* This project uses the free shared default VID/PID, so manufacturer and
+ * product strings tell the bootloader from other V-USB gadgets; the serial
+ * number has to match a serial number selector.
+ */
+static bool matchString(int step, const char *string, const std::string &serial) {
+    if (step == 0)
+        return strcmp(string, "www.fischl.de") == 0;
+    if (step == 1)
+        return strcmp(string, "AVRUSBBoot") == 0;
+    return serial == string;
+}
+
+/* Open dev if it is an AVRUSBBoot bootloader matching selector (a bus
+ * and port path or a serial number, empty for any), NULL otherwise (see
+ * matchString). mismatch tells a device that answered and is not the one
+ * from one that could not be opened or asked, which may work next time.
+ */
+libusb_device_handle *CBootloader::openDevice(libusb_device *dev,
+        const std::string &selector, bool *mismatch) {
     struct libusb_device_descriptor descriptor;
     libusb_device_handle *handle = 0;
-    libusb_error err;
+    char string[256];
+
+    if (mismatch != NULL)
+        *mismatch = false;
+    if (libusb_get_device_descriptor(dev, &descriptor) < 0)
+        return 0;
+    bool path = isPath(selector);
+    if (descriptor.idVendor != USBDEV_SHARED_VENDOR
+            || descriptor.idProduct != USBDEV_SHARED_PRODUCT
+            || (path && getPath(dev) != selector)) {
+        if (mismatch != NULL)
+            *mismatch = true;
+        return 0;
+    }
+
+    int err = libusb_open(dev, &handle); /* we need to open the device in order to query strings */
+    if (err < 0 || !handle) {
+        fprintf(stderr, "Warning: cannot open USB device: %s\n",
+                libusb_strerror((libusb_error) err));
+        return 0;
+    }
+
+    int steps = selector.empty() || path ? 2 : 3;
+    for (int step = 0; step < steps; step++) {
+        if (usbGetStringAscii(handle, getStringindex(descriptor, step), 0x0409,
+                string, sizeof(string)) < 0) {
+            fprintf(stderr, "warning: cannot query %s for device: %s\n",
+                    step == 0 ? "manufacturer" : step == 1 ? "product"
+                    : "serial number", libusb_strerror(LIBUSB_ERROR_NOT_FOUND));
+            break;
+        }
+        if (!matchString(step, string, selector)) {
+            if (mismatch != NULL)
+                *mismatch = true;
+            break;
+        }
+        if (step == steps - 1)
+            return handle;
+    }
+    libusb_close(handle);
+    return 0;
+}
+
+/* one candidate of findDevice(), asked for its strings one at a time */
+struct SProbe {
+    libusb_device *dev;
+    libusb_device_handle *handle;
+    struct libusb_transfer *transfer;
+    struct libusb_device_descriptor descriptor;
+    int step;       /* 0 manufacturer, 1 product, 2 serial number */
+    bool pending;
+    int done;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 255];
+};
+
+static void LIBUSB_CALL probeDone(struct libusb_transfer *transfer) {
+    ((SProbe *) transfer->user_data)->done = 1;
+}
+
+/* ask for the next string descriptor of the candidate */
+static bool submitProbe(SProbe &probe) {
+    uint8_t index = getStringindex(probe.descriptor, probe.step);
+    if (index == 0)
+        return false;
+
+    libusb_fill_control_setup(probe.buffer, LIBUSB_ENDPOINT_IN,
+            LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) + index,
+            0x0409, sizeof(probe.buffer) - LIBUSB_CONTROL_SETUP_SIZE);
+    libusb_fill_control_transfer(probe.transfer, probe.handle, probe.buffer,
+            probeDone, &probe, USBBOOT_PROBETIMEOUT);
+    probe.done = 0;
+    probe.pending = libusb_submit_transfer(probe.transfer) == 0;
+    return probe.pending;
+}
+
+/* Find the bootloader among the devices with the shared VID/PID. Other
+ * V-USB gadgets use them too, so all candidates are asked for their
+ * strings at once, each with a short timeout; the first to answer
+ * www.fischl.de/AVRUSBBoot is taken. With several bootloaders attached
+ * and no selector, which one that is depends on their response times and
+ * may change from run to run. A selector limits the search to a bus and
+ * port path ("1-2.3", nothing else is opened) or a serial number.
+ */
+static libusb_device_handle *findDevice(const std::string &selector) {
     struct libusb_device **devList;
+    std::vector<SProbe> probes;
+    libusb_device_handle *handle = 0;
+    bool path = isPath(selector);
     ssize_t size;
-    int retVal;
-    unsigned char buffer[122];
-    uint8_t busId, portId;
-    uint8_t path[8];
 
     fprintf(stdout, "retrieving device list...\r\n");
     size = libusb_get_device_list(NULL, &devList);
     fprintf(stdout, "USB devices found: %d\r\n", (int) size);
 
-    for (i = 0; i < size; i++) {
-        dev = *devList;
-        if (dev == 0) {
-            fprintf(stderr, "no device found. is nullpointer\r\n");
-            break;
-        }
+    /* probes are not moved once their transfers point at them */
+    probes.reserve(size > 0 ? size : 0);
+    for (ssize_t i = 0; i < size; i++) {
+        SProbe probe;
+        probe.dev = devList[i];
+        if (libusb_get_device_descriptor(probe.dev, &probe.descriptor) < 0)
+            continue;
+        fprintf(stdout, "%04x:%04x (bus %d, device %d) path %s\r\n",
+                probe.descriptor.idVendor, probe.descriptor.idProduct,
+                libusb_get_bus_number(probe.dev),
+                libusb_get_device_address(probe.dev),
+                CBootloader::getPath(probe.dev).c_str());
+        if (probe.descriptor.idVendor != USBDEV_SHARED_VENDOR
+                || probe.descriptor.idProduct != USBDEV_SHARED_PRODUCT
+                || (path && CBootloader::getPath(probe.dev) != selector))
+            continue;
 
-        retVal = libusb_get_device_descriptor(dev, &descriptor);
-        if(retVal < 0) {
-        	return 0;
+        int err = libusb_open(probe.dev, &probe.handle);
+        if (err < 0) {
+            fprintf(stderr, "Warning: cannot open USB device: %s\n",
+                    libusb_strerror((libusb_error) err));
+            continue;
+        }
+        if ((probe.transfer = libusb_alloc_transfer(0)) == NULL) {
+            libusb_close(probe.handle);
+            continue;
         }
-        busId = libusb_get_bus_number(dev);
-        portId = libusb_get_port_number(dev);
-        fprintf(stdout, "%04x:%04x (bus %d, device %d) path %d\r\n",
-                			descriptor.idVendor, descriptor.idProduct,
-                			busId, libusb_get_device_address(dev), portId);
+        probe.step = 0;
+        probes.push_back(probe);
+        if (!submitProbe(probes.back())) {
+            libusb_free_transfer(probe.transfer);
+            libusb_close(probe.handle);
+            probes.pop_back();
+        }
+    }
+
+    unsigned int pending = probes.size();
+    while (pending > 0 && handle == NULL) {
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+
+        for (size_t n = 0; n < probes.size() && handle == NULL; n++) {
+            SProbe &probe = probes[n];
+            if (!probe.pending || !probe.done)
+                continue;
+            probe.pending = false;
+            pending--;
+            if (probe.transfer->status != LIBUSB_TRANSFER_COMPLETED)
+                continue;
 
-        if (descriptor.idVendor == USBDEV_SHARED_VENDOR
-                && descriptor.idProduct == USBDEV_SHARED_PRODUCT) {
             char string[256];
-            int len;
-            err = (libusb_error) libusb_open(dev, &handle); /* we need to open the device in order to query strings */
-            if (!handle) {
-                fprintf(stderr, "Warning: cannot open USB device: %s\n",
-                        libusb_strerror(err));
+            stringAscii(libusb_control_transfer_get_data(probe.transfer),
+                    probe.transfer->actual_length, string, sizeof(string) - 1);
+            if (!matchString(probe.step, string, selector))
+                continue;
+            if (probe.step == 2 || (probe.step == 1
+                    && (selector.empty() || path))) {
+                handle = probe.handle;
                 continue;
             }
+            probe.step++;
+            if (submitProbe(probe))
+                pending++;
+        }
+    }
 
-            len = usbGetStringAscii(handle, descriptor.iManufacturer, 0x0409,
-                    string, sizeof(string));
-            if (len < 0) {
-                fprintf(stderr,
-                        "warning: cannot query manufacturer for device: %s\n",
-                        libusb_strerror(LIBUSB_ERROR_NOT_FOUND));
-                goto skipDevice;
-            }
-            if (strcmp(string, "www.fischl.de") != 0)
-                goto skipDevice;
-
-            int LIBUSB_CALL libusb_get_string_descriptor_ascii(
-                    libusb_device_handle *dev, uint8_t desc_index,
-                    unsigned char *data, int length);
-
-            len = usbGetStringAscii(handle, descriptor.iProduct, 0x0409, string,
-                    sizeof(string));
-            if (len < 0) {
-                fprintf(stderr,
-                        "warning: cannot query product for device: %s\n",
-                        libusb_strerror(LIBUSB_ERROR_NOT_FOUND));
-                goto skipDevice;
+    /* the others are cancelled and closed */
+    for (size_t n = 0; n < probes.size(); n++)
+        if (probes[n].pending)
+            libusb_cancel_transfer(probes[n].transfer);
+    while (pending > 0) {
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+        for (size_t n = 0; n < probes.size(); n++)
+            if (probes[n].pending && probes[n].done) {
+                probes[n].pending = false;
+                pending--;
             }
-            //  fprintf(stderr, "seen product ->%s<-\n", string);
-            if (strcmp(string, "AVRUSBBoot") == 0)
-                break;
-            skipDevice: libusb_close(handle);
-            handle = NULL;
-        } else {
-            /* do nothing */
-        }
-        if (handle) {
-            break;
-        }
-        devList++;
     }
+    for (size_t n = 0; n < probes.size(); n++) {
+        libusb_free_transfer(probes[n].transfer);
+        if (probes[n].handle != handle)
+            libusb_close(probes[n].handle);
+    }
+    /* devList is not set if the list could not be retrieved */
+    if (size >= 0)
+        libusb_free_device_list(devList, 1);
 
     if (!handle)
         fprintf(stderr, "Could not find USB device www.fischl.de/AVRUSBBoot\n");
@@ -131,71 +299,1116 @@ static libusb_device_handle *findDevice(void) {
 }
 
 CBootloader::CBootloader() {
-	ctx = NULL;
+    find("");
+}
+
+/* the bootloader at a bus and port path (as in "1-2.3") or with a serial
+ * number; "" takes the first one found
+ */
+CBootloader::CBootloader(const std::string &selector) {
+    find(selector);
+}
+
+/* libusb is initialised here and released with this object, other users
+ * of the default context keep their own reference
+ */
+void CBootloader::find(const std::string &selector) {
     fprintf(stdout, "libusb init ...\r\n");
-    libusb_init(NULL);
-    fprintf(stdout, "libusb init complete with context %d\r\n",
-            (unsigned long int) ctx);
-    if ((usbhandle = findDevice()) == NULL) {
-        fprintf(stderr,
-                "Could not find USB device \"AVRUSBBoot\" with vid=0x%x pid=0x%x\n",
-                USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT);
-        exit(1);
-    }
+    init();
+    libusbinit = libusb_init(NULL) == 0;
+    if ((usbhandle = findDevice(selector)) == NULL)
+        setError(ERROR_NODEVICE,
+                "Could not find USB device \"AVRUSBBoot\" with vid=0x%x pid=0x%x%s%s",
+                USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT,
+                selector.empty() ? "" : " matching ", selector.c_str());
+    else
+        transferpool = new CTransferpool(usbhandle);
+}
+
+/* false if the default constructor found no bootloader */
+bool CBootloader::isOpen() {
+    return usbhandle != NULL || emulator != NULL;
+}
+
+/* bootloader on a device opened by the caller (see openDevice), libusb has
+ * to be initialised already
+ */
+CBootloader::CBootloader(libusb_device_handle *handle) {
+    assert(handle);
+    init();
+    usbhandle = handle;
+    transferpool = new CTransferpool(usbhandle);
+}
+
+/* bootloader emulated on the host (see CEmulator), no USB involved */
+CBootloader::CBootloader(CEmulator *emulator) {
+    assert(emulator);
+    init();
+    this->emulator = emulator;
+    transferpool = new CTransferpool(NULL);
+}
+
+void CBootloader::init() {
+    usbhandle = NULL;
+    libusbinit = false;
+    transferpool = NULL;
+    emulator = NULL;
+    infovalid = false;
+    batchlimit = USBBOOT_MAXBATCH;
+    bulkendpoint = -1;
+    bulkinterface = -1;
+    bulkenabled = true;
+    compressenabled = true;
+    copyenabled = true;
+    copiedpages = 0;
+    copysaving = 0;
+    pagebytes = 0;
+    sentbytes = 0;
+    libusbinit = false;
+    retrylimit = USBBOOT_RETRIES;
+    retrydelay = USBBOOT_RETRYDELAY;
+    retries = 0;
+    recoveries = 0;
+    reopens = 0;
+    devicegone = false;
+    reopenbus = 0;
+    batchwindow = USBBOOT_MAXBATCH;
+    inflight = USBBOOT_BULKINFLIGHT;
 }
 
 CBootloader::~CBootloader() {
-    libusb_close(usbhandle);
-    fprintf(stdout, "\r\nlibusb closed\r\n");
+    delete transferpool;
+    if (usbhandle != NULL) {
+        if (bulkinterface >= 0)
+            libusb_release_interface(usbhandle, bulkinterface);
+        libusb_close(usbhandle);
+        fprintf(stdout, "\r\nlibusb closed\r\n");
+    }
+    if (libusbinit)
+        libusb_exit(NULL);
 }
 
-unsigned int CBootloader::getPagesize() {
-    unsigned char buffer[8];
+/* transfers, setup and payload buffers of this device */
+CTransferpool* CBootloader::getTransferpool() {
+    return transferpool;
+}
+
+static void LIBUSB_CALL transferDone(struct libusb_transfer *transfer) {
+    *(int *) transfer->user_data = 1;
+}
+
+/* Handle events until the transfer of slot completes, cancelling it after
+ * the first failure. false if event handling failed USBBOOT_EVENTERRORS
+ * times in a row: libusb still owns the transfer and the slot is
+ * abandoned (see CTransferpool::abandon).
+ */
+static bool waitSlot(CTransferpool *pool, CTransferpool::SSlot *slot) {
+    unsigned int errors = 0;
+    while (!slot->nDone) {
+        int result = libusb_handle_events_completed(NULL, &slot->nDone);
+        if (result >= 0 || result == LIBUSB_ERROR_INTERRUPTED) {
+            errors = 0;
+            continue;
+        }
+        if (errors == 0)
+            libusb_cancel_transfer(slot->pTransfer);
+        if (++errors >= USBBOOT_EVENTERRORS) {
+            pool->abandon(slot);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Additive increase, multiplicative decrease of a window between 1 and
+ * limit, as TCP paces its congestion window.
+ */
+static void adapt(unsigned int &window, unsigned int limit, bool congested) {
+    if (window > limit)
+        window = limit;
+    if (congested)
+        window = window > 1 ? window / 2 : 1;
+    else if (window < limit)
+        window++;
+}
+
+/* Send the control request whose payload is already in the slot's buffer,
+ * like libusb_control_transfer but on a preallocated transfer, so no request
+ * allocates. IN data is left in the buffer. Returns the number of bytes
+ * transferred or a negative libusb error.
+ *
+ * A failed request, or an OUT request the device took only in part, is
+ * repeated up to retrylimit times after an exponential backoff; if the
+ * device went away or stalled, it is opened again first. Probes for
+ * optional requests pass probe = true: a stall is their answer.
+ *
+ * pages is the number of pages the request programs. The timeout is
+ * learned from the earlier round trips of the request (see CLatency) and
+ * doubles with every retry; requests that program pages steer the batch
+ * window: one page more after a request in time, half after a slow one
+ * or a timeout. Stalls and short transfers are errors, not congestion.
+ */
+int CBootloader::submitTransfer(CTransferpool::SSlot *slot,
+        uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+        uint16_t wIndex, uint16_t wLength, unsigned int pages, bool probe) {
+    bool out = (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+    unsigned int timeout = latency.getTimeout(bRequest, pages, USBBOOT_TIMEOUT);
+
+    for (unsigned int attempt = 0;; attempt++) {
+        unsigned long long start = getMicroseconds();
+        int result = submitOnce(slot, bmRequestType, bRequest, wValue, wIndex,
+                wLength, timeout);
+        unsigned long elapsed = (unsigned long) (getMicroseconds() - start);
+        bool done = result >= 0 && (!out || result == wLength);
+        if (pages > 0 && infovalid)
+            adapt(batchwindow, info.batchsize, result == LIBUSB_ERROR_TIMEOUT
+                    || (done && latency.isSlow(bRequest, pages, elapsed)));
+        if (done) {
+            latency.addSample(bRequest, pages, elapsed);
+            if (attempt > 0)
+                recoveries++;
+            return result;
+        }
+        timeout = timeout < USBBOOT_TIMEOUT / 2 ? timeout * 2 : USBBOOT_TIMEOUT;
+        if (result == LIBUSB_ERROR_NO_DEVICE)
+            devicegone = true;
+
+        if (attempt >= retrylimit || (probe && result == LIBUSB_ERROR_PIPE)
+                || slot->bAbandoned)
+            return result;
+        switch (result) {
+        case LIBUSB_ERROR_NO_MEM:
+        case LIBUSB_ERROR_INVALID_PARAM:
+        case LIBUSB_ERROR_ACCESS:
+        case LIBUSB_ERROR_NOT_SUPPORTED:
+            return result;
+        }
+
+        retries++;
+        backoff(attempt);
+        /* a stall is cleared by the next setup packet, only a device that
+           dropped off needs a new handle */
+        if (result == LIBUSB_ERROR_NO_DEVICE && reopen() < 0)
+            return result;
+    }
+}
+
+/* microseconds on a monotonic clock, also for completion callbacks */
+static unsigned long long getClock() {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return count.QuadPart / frequency.QuadPart * 1000000ULL
+            + count.QuadPart % frequency.QuadPart * 1000000ULL
+            / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+#endif
+}
+
+/* getClock(), the modelled time when emulated */
+unsigned long long CBootloader::getMicroseconds() {
+    if (emulator != NULL)
+        return emulator->getTime();
+    return getClock();
+}
+
+/* wait retrydelay * 2^attempt ms, at most USBBOOT_RETRYDELAYMAX */
+void CBootloader::backoff(unsigned int attempt) {
+    unsigned int delay = retrydelay;
+    for (unsigned int n = 0; n < attempt && delay < USBBOOT_RETRYDELAYMAX; n++)
+        delay *= 2;
+    if (delay > USBBOOT_RETRYDELAYMAX)
+        delay = USBBOOT_RETRYDELAYMAX;
+
+    if (emulator != NULL) {
+        emulator->idle(delay * 1000UL);
+        return;
+    }
+#ifdef _WIN32
+    Sleep(delay);
+#else
+    usleep(delay * 1000);
+#endif
+}
+
+/* Open the device at the same bus and port path again after it dropped
+ * off, looking for it every USBBOOT_REOPENPOLL ms until it re-enumerated
+ * or USBBOOT_REOPENTIME passed. Claimed interfaces are lost, the bulk
+ * endpoint is looked up again on next use.
+ */
+int CBootloader::reopen() {
+    reopens++;
+    bulkendpoint = -1;
+    if (emulator != NULL) {
+        for (unsigned int waited = 0; !emulator->reconnect();
+                waited += USBBOOT_REOPENPOLL) {
+            if (waited >= USBBOOT_REOPENTIME)
+                return setError(ERROR_NODEVICE, "Bootloader did not come back!");
+            emulator->idle(USBBOOT_REOPENPOLL * 1000UL);
+        }
+        devicegone = false;
+        return ERROR_NONE;
+    }
+
+    uint8_t bus = 0;
+    uint8_t ports[8];
+    int nPorts = 0;
+    if (usbhandle != NULL) {
+        libusb_device *dev = libusb_get_device(usbhandle);
+        bus = libusb_get_bus_number(dev);
+        nPorts = libusb_get_port_numbers(dev, ports, sizeof(ports));
+        /* buffers in device memory belong to the old handle */
+        transferpool->setHandle(NULL);
+        if (bulkinterface >= 0)
+            libusb_release_interface(usbhandle, bulkinterface);
+        bulkinterface = -1;
+        libusb_close(usbhandle);
+        usbhandle = NULL;
+        reopenbus = bus;
+        reopenports.assign(ports, ports + (nPorts > 0 ? nPorts : 0));
+    }
+
+    /* the old device may still be listed until its removal is processed,
+       opening it then fails and the port is looked at again */
+    unsigned long long deadline = getClock() + USBBOOT_REOPENTIME * 1000ULL;
+    for (;;) {
+        struct libusb_device **devList;
+        ssize_t size = libusb_get_device_list(NULL, &devList);
+        for (ssize_t i = 0; i < size && usbhandle == NULL; i++) {
+            uint8_t devPorts[8];
+            int nDevPorts = libusb_get_port_numbers(devList[i], devPorts,
+                    sizeof(devPorts));
+            if (libusb_get_bus_number(devList[i]) != reopenbus || nDevPorts < 0
+                    || (size_t) nDevPorts != reopenports.size()
+                    || !std::equal(reopenports.begin(), reopenports.end(),
+                            devPorts))
+                continue;
+            usbhandle = openDevice(devList[i]);
+        }
+        if (size >= 0)
+            libusb_free_device_list(devList, 1);
+
+        if (usbhandle != NULL)
+            break;
+        if (getClock() >= deadline)
+            return setError(ERROR_NODEVICE, "Bootloader did not come back!");
+#ifdef _WIN32
+        Sleep(USBBOOT_REOPENPOLL);
+#else
+        usleep(USBBOOT_REOPENPOLL * 1000);
+#endif
+    }
+    transferpool->setHandle(usbhandle);
+    devicegone = false;
+    return ERROR_NONE;
+}
+
+/* one attempt of submitTransfer() */
+int CBootloader::submitOnce(CTransferpool::SSlot *slot,
+        uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+        uint16_t wIndex, uint16_t wLength, unsigned int timeout) {
+    struct libusb_transfer *transfer = slot->pTransfer;
+    int result;
+
+    if (emulator != NULL)
+        return emulator->controlTransfer(bmRequestType, bRequest, wValue,
+                wIndex, slot->pBuffer + LIBUSB_CONTROL_SETUP_SIZE, wLength,
+                timeout);
+    if (usbhandle == NULL)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    libusb_fill_control_setup(slot->pBuffer, bmRequestType, bRequest, wValue,
+            wIndex, wLength);
+    slot->nDone = 0;
+    libusb_fill_control_transfer(transfer, usbhandle, slot->pBuffer,
+            transferDone, &slot->nDone, timeout);
+
+    if ((result = libusb_submit_transfer(transfer)) < 0)
+        return result;
+    if (!waitSlot(transferpool, slot))
+        return LIBUSB_ERROR_OTHER;
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return transfer->actual_length;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+/* Synchronous control transfer on a pooled transfer. The payload is copied
+ * once into the (device memory) buffer, since setup packet and data have to
+ * be contiguous.
+ */
+int CBootloader::controlTransfer(uint8_t bmRequestType, uint8_t bRequest,
+        uint16_t wValue, uint16_t wIndex, unsigned char *data,
+        uint16_t wLength, unsigned int pages, bool probe) {
+    CTransferpool::SSlot *slot = transferpool->acquire(wLength);
+    if (slot == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    bool in = (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+    if (!in)
+        memcpy(slot->pBuffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+
+    int result = submitTransfer(slot, bmRequestType, bRequest, wValue, wIndex,
+            wLength, pages, probe);
+    if (in && result > 0)
+        memcpy(data, slot->pBuffer + LIBUSB_CONTROL_SETUP_SIZE, result);
+
+    transferpool->release(slot);
+    return result;
+}
+
+static unsigned int getLE(const unsigned char *data, int bytes) {
+    unsigned int value = 0;
+    while (bytes-- > 0)
+        value = (value << 8) | data[bytes];
+    return value;
+}
+
+/* Fill info from nBytes of a USBBOOT_FUNC_GET_INFO answer (a negative
+ * nBytes is the error of the request). 1 if parsed, 0 for a legacy
+ * bootloader that did not answer (info is cleared), -1 for page size 0.
+ */
+int CBootloader::parseInfo(const unsigned char *buffer, int nBytes,
+        SBootinfo &info) {
+    memset(&info, 0, sizeof(info));
+    if (nBytes < USBBOOT_INFOSIZE || buffer[0] < 1)
+        return 0;
+    info.version = buffer[0];
+    info.features = buffer[1];
+    info.pagesize = getLE(buffer + 2, 2);
+    info.flashsize = getLE(buffer + 4, 4);
+    info.bootstart = getLE(buffer + 8, 4);
+    info.batchsize = buffer[12];
+    if (!(info.features & (USBBOOT_FEATURE_BATCH | USBBOOT_FEATURE_COMPRESS))
+            || info.batchsize < 1)
+        info.batchsize = 1;
+    return info.pagesize == 0 ? -1 : 1;
+}
+
+/* Device description, asked once. Protocol 1 bootloaders answer
+ * USBBOOT_FUNC_GET_INFO in one round trip; older ones stall it and are
+ * asked for page size and batch size separately (version 0, flash size
+ * and bootloader start unknown). NULL on error.
+ */
+const SBootinfo *CBootloader::getInfo() {
+    unsigned char buffer[USBBOOT_INFOSIZE + 3];
     int nBytes;
 
-    nBytes = libusb_control_transfer(usbhandle,
-            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
-                    | LIBUSB_ENDPOINT_IN, 3, 0, 0, buffer, sizeof(buffer),
-            5000);
+    if (infovalid)
+        return &info;
+
+    nBytes = controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_INFO, 0, 0,
+            buffer, sizeof(buffer), 0, true);
+    int parsed = parseInfo(buffer, nBytes, info);
+    if (parsed < 0) {
+        setError(ERROR_TRANSFER, "Bootloader reports page size 0 !");
+        return NULL;
+    }
+    if (parsed > 0) {
+        infovalid = true;
+        return &info;
+    }
 
+    /* legacy bootloader */
+    nBytes = controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_PAGESIZE, 0,
+            0, buffer, sizeof(buffer), 0);
     if (nBytes != 2) {
-        fprintf(stderr, "Error: wrong response size in getPageSize: %d !\n",
+        setError(ERROR_TRANSFER, "Wrong response size in getPageSize: %d !",
                 nBytes);
-        exit(1);
+        return NULL;
     }
+    info.pagesize = (buffer[0] << 8) | buffer[1];
+
+    nBytes = controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_BATCHSIZE, 0,
+            0, buffer, sizeof(buffer), 0, true);
+    info.batchsize = 1;
+    if (nBytes >= 1 && buffer[0] > 1) {
+        info.batchsize = buffer[0];
+        info.features |= USBBOOT_FEATURE_BATCH;
+    }
+    infovalid = true;
+    return &info;
+}
+
+/* page size reported by the bootloader, 0 on error */
+unsigned int CBootloader::getPagesize() {
+    const SBootinfo *pInfo = getInfo();
+    return pInfo != NULL ? pInfo->pagesize : 0;
+}
+
+/* ERROR_RANGE if the bytes would overwrite the bootloader (or lie beyond
+ * the flash), as far as the device tells. Legacy bootloaders ignore
+ * wIndex, so they only reach the first 64 kB.
+ */
+int CBootloader::checkRange(unsigned int address, unsigned int length) {
+    const SBootinfo *pInfo = getInfo();
+    if (pInfo == NULL)
+        return m_nError;
+
+    if (pInfo->version == 0 && (address > 0xffff || length > 0x10000 - address))
+        return setError(ERROR_RANGE,
+                "Page 0x%x beyond the 64 kB a legacy bootloader addresses!",
+                address);
+
+    unsigned int end = pInfo->bootstart ? pInfo->bootstart : pInfo->flashsize;
+    if (end != 0 && (address >= end || length > end - address))
+        return setError(ERROR_RANGE,
+                "Page 0x%x beyond application flash (ends at 0x%x)!", address,
+                end);
+    return ERROR_NONE;
+}
+
+/* Number of consecutive pages written in one request, by the fastest
+ * path the bootloader supports: a run of up to USBBOOT_MAXBATCH pages on
+ * the bulk endpoint, its batch size for USBBOOT_FUNC_WRITE_BATCH and
+ * USBBOOT_FUNC_WRITE_COMPRESSED or 1, i.e. single page writes. A control
+ * batch with its header fits USBBOOT_MAXCONTROL bytes; the uncoded
+ * fallback of a compressed batch has the same size. Batches shrink while
+ * requests are slow or fail (see submitTransfer), so ask again for every
+ * batch.
+ */
+unsigned int CBootloader::getBatchsize() {
+    const SBootinfo *pInfo = getInfo();
+    if (pInfo == NULL)
+        return 1;
+
+    unsigned int pages = USBBOOT_MAXBATCH;
+    if (getBulkendpoint() <= 0) {
+        pages = std::min(pInfo->batchsize, batchwindow);
+        pages = std::min(pages, USBBOOT_CONTROLPAGES(pInfo->pagesize));
+        if (pages == 0)
+            pages = 1;
+    }
+    return pages < batchlimit ? pages : batchlimit;
+}
+
+/* Bulk OUT endpoint of the bootloader interface, 0 if there is none (or
+ * the bulk path is disabled or, for a protocol 1 bootloader, not among
+ * its features). Looked up in the interface descriptors once, the
+ * interface is claimed on the way.
+ */
+int CBootloader::getBulkendpoint() {
+    if (!bulkenabled)
+        return 0;
+    if (bulkendpoint >= 0)
+        return bulkendpoint;
+
+    bulkendpoint = 0;
+    const SBootinfo *pInfo = getInfo();
+    if (pInfo == NULL || (pInfo->version >= 1
+            && !(pInfo->features & USBBOOT_FEATURE_BULK)))
+        return 0;
+    if (emulator != NULL) {
+        bulkendpoint = emulator->getBulkendpoint();
+        return bulkendpoint;
+    }
+    if (usbhandle == NULL) {
+        bulkendpoint = -1;
+        return 0;
+    }
+
+    struct libusb_config_descriptor *config;
+    if (libusb_get_active_config_descriptor(libusb_get_device(usbhandle),
+            &config) < 0)
+        return 0;
+
+    for (int i = 0; i < config->bNumInterfaces && bulkendpoint == 0; i++) {
+        const struct libusb_interface_descriptor *altsetting =
+                &config->interface[i].altsetting[0];
+        for (int e = 0; e < altsetting->bNumEndpoints; e++) {
+            const struct libusb_endpoint_descriptor *endpoint =
+                    &altsetting->endpoint[e];
+            if ((endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+                    == LIBUSB_TRANSFER_TYPE_BULK
+                    && (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+                    == LIBUSB_ENDPOINT_OUT
+                    && libusb_claim_interface(usbhandle,
+                            altsetting->bInterfaceNumber) == 0) {
+                bulkendpoint = endpoint->bEndpointAddress;
+                bulkinterface = altsetting->bInterfaceNumber;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return bulkendpoint;
+}
 
-    return (buffer[0] << 8) | buffer[1];
+/* false sends all data through control transfers, e.g. for comparison */
+void CBootloader::setBulkenabled(bool enabled) {
+    bulkenabled = enabled;
 }
 
-void CBootloader::startApplication() {
+/* false sends pages uncoded even if the bootloader decodes them */
+void CBootloader::setCompressenabled(bool enabled) {
+    compressenabled = enabled;
+}
+
+/* false writes duplicate pages instead of copying them on the device */
+void CBootloader::setCopyenabled(bool enabled) {
+    copyenabled = enabled;
+}
+
+/* failed requests are repeated up to limit times, the first time after
+ * delay ms, then doubling (0: fail on the first error)
+ */
+void CBootloader::setRetries(unsigned int limit, unsigned int delay) {
+    retrylimit = limit;
+    retrydelay = delay;
+}
+
+/* attempts repeated since construction or resetStatistics() */
+unsigned long CBootloader::getRetries() {
+    return retries;
+}
+
+/* requests that failed and succeeded on a retry */
+unsigned long CBootloader::getRecoveries() {
+    return recoveries;
+}
+
+/* times the device was opened again */
+unsigned long CBootloader::getReopens() {
+    return reopens;
+}
+
+/* microseconds per page below which percent of the recent page writes
+ * completed, on the write request used most; 0 before the first write
+ */
+unsigned long CBootloader::getWritelatency(unsigned int percent) {
+    static const unsigned int kinds[] = { USBBOOT_LATENCY_BULK,
+            USBBOOT_FUNC_WRITE_PAGE, USBBOOT_FUNC_WRITE_BATCH,
+            USBBOOT_FUNC_WRITE_COMPRESSED, USBBOOT_FUNC_WRITE_PARTIAL };
+    unsigned int kind = kinds[0];
+    for (unsigned int n = 1; n < sizeof(kinds) / sizeof(kinds[0]); n++)
+        if (latency.getSamples(kinds[n]) > latency.getSamples(kind))
+            kind = kinds[n];
+    return latency.getPercentile(kind, percent);
+}
+
+/* bulk transfers currently kept in flight */
+unsigned int CBootloader::getInflight() {
+    return inflight;
+}
+
+/* page bytes written since construction or resetStatistics() */
+unsigned long CBootloader::getPagebytes() {
+    return pagebytes;
+}
+
+/* page data bytes on the bus, below getPagebytes() where coding paid off */
+unsigned long CBootloader::getSentbytes() {
+    return sentbytes;
+}
+
+/* pages written by copyPages() */
+unsigned long CBootloader::getCopiedpages() {
+    return copiedpages;
+}
+
+/* bus bytes saved by copyPages() */
+unsigned long CBootloader::getCopysaving() {
+    return copysaving;
+}
+
+void CBootloader::resetStatistics() {
+    retries = 0;
+    recoveries = 0;
+    reopens = 0;
+    copiedpages = 0;
+    copysaving = 0;
+    pagebytes = 0;
+    sentbytes = 0;
+}
+
+/* limit the batch size, e.g. to compare with single page writes */
+void CBootloader::setBatchlimit(unsigned int limit) {
+    batchlimit = limit > 0 ? limit : 1;
+}
+
+int CBootloader::startApplication() {
     unsigned char buffer[8];
     int nBytes;
 
-    nBytes = libusb_control_transfer(usbhandle,
-            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
-                    | LIBUSB_ENDPOINT_IN, 1, 0, 0, buffer, sizeof(buffer),
-            5000);
+    nBytes = controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_LEAVE_BOOT, 0, 0,
+            buffer, sizeof(buffer), 0);
+
+    if (nBytes != 0)
+        return setError(ERROR_TRANSFER,
+                "Wrong response size in startApplication: %d !", nBytes);
+    return ERROR_NONE;
+}
+
+/* The page address goes to wValue. Addresses above 64k (extended address
+ * records) carry their upper 16 bits in wIndex, which is 0 for classic parts.
+ */
+int CBootloader::writePage(CPage* page) {
+
+    int nBytes;
+    uint8_t request = USBBOOT_FUNC_WRITE_PAGE;
+    unsigned int length = page->getPagesize();
+
+    if (checkRange(page->getPageaddress(), page->getPagesize()) < 0)
+        return m_nError;
+
+    /* the bootloader fills the erased tail itself */
+    const SBootinfo *pInfo = getInfo();
+    if (pInfo != NULL && (pInfo->features & USBBOOT_FEATURE_PARTIAL)
+            && (length = page->getDatalength()) < page->getPagesize())
+        request = USBBOOT_FUNC_WRITE_PARTIAL;
+    else
+        length = page->getPagesize();
 
-    if (nBytes != 0) {
-        fprintf(stderr,
-                "Error: wrong response size in startApplication: %d !\n",
+    nBytes = controlTransfer(USBBOOT_REQUEST_OUT, request,
+            page->getPageaddress() & 0xffff, page->getPageaddress() >> 16,
+            (unsigned char*) page->getData(), length, 1);
+
+    if (nBytes != (int) length)
+        return setError(ERROR_TRANSFER, "Wrong byte count in writePage: %d !",
                 nBytes);
-        exit(1);
+    sentbytes += nBytes;
+    return ERROR_NONE;
+}
+
+/* Write count consecutive pages (each starting where the previous one
+ * ends): streamed over the bulk endpoint if there is one, else coded in
+ * one compressed request, in one batch request or page by page.
+ */
+int CBootloader::writePages(CPage** pages, unsigned int count) {
+    if (getInfo() == NULL)
+        return m_nError;
+
+    pagebytes += count * pages[0]->getPagesize();
+    if (getBulkendpoint() > 0) {
+        /* a broken stream is announced again from the first page the
+           device did not take; retries count from the last progress. A
+           stream that breaks before its first transfer is retried one
+           chunk long, so the retry does not repeat the same request. */
+        unsigned int chunk = USBBOOT_BULKCHUNK / pages[0]->getPagesize();
+        unsigned int written = 0;
+        unsigned int attempt = 0;
+        unsigned int run = count;
+        if (chunk == 0)
+            chunk = 1;
+        while (written < count) {
+            unsigned int n = 0;
+            if (run > count - written)
+                run = count - written;
+            if (getBulkendpoint() <= 0)
+                setError(ERROR_NODEVICE, "Bulk endpoint lost!");
+            else if (writePagesBulk(pages + written, run, n) == ERROR_NONE) {
+                if (attempt > 0)
+                    recoveries++;
+                written += run;
+                attempt = 0;
+                run = count;
+                continue;
+            }
+            written += n;
+            if (n > 0) {
+                attempt = 0;
+                run = count;
+            } else
+                run = chunk;
+            if (m_nError == ERROR_MEMORY || attempt >= retrylimit)
+                return m_nError;
+            retries++;
+            backoff(attempt++);
+            /* a stalled endpoint is cleared, a device that dropped off is
+               opened again */
+            if (devicegone) {
+                if (reopen() < 0)
+                    return m_nError;
+            } else if (emulator == NULL && usbhandle != NULL
+                    && bulkendpoint > 0)
+                libusb_clear_halt(usbhandle, bulkendpoint);
+        }
+        return ERROR_NONE;
+    }
+    if (compressenabled && (info.features & USBBOOT_FEATURE_COMPRESS))
+        return writeCompressed(pages, count);
+    return writeRaw(pages, count);
+}
+
+/* uncoded, in one batch request or page by page */
+int CBootloader::writeRaw(CPage** pages, unsigned int count) {
+    if (count == 1 || !(info.features & USBBOOT_FEATURE_BATCH)) {
+        for (unsigned int n = 0; n < count; n++)
+            if (writePage(pages[n]) < 0)
+                return m_nError;
+        return ERROR_NONE;
     }
+    return writeBatch(pages, count);
+}
+
+/* the bootloader copies flash pages (USBBOOT_FUNC_COPY_PAGES) */
+bool CBootloader::canCopy() {
+    const SBootinfo *pInfo = getInfo();
+    return copyenabled && pInfo != NULL
+            && (pInfo->features & USBBOOT_FEATURE_COPY);
 }
 
-void CBootloader::writePage(CPage* page) {
+/* Let the bootloader program count pages at address with the flash
+ * contents at source, pages already written; no page data on the bus.
+ * The pages are copied one by one in ascending order, so a run may read
+ * pages it has just written.
+ */
+int CBootloader::copyPages(unsigned int address, unsigned int source,
+        unsigned int count) {
+    unsigned char payload[USBBOOT_COPYSIZE];
+
+    assert(count >= 1 && count <= USBBOOT_MAXBATCH);
+    for (int n = 0; n < 4; n++)
+        payload[n] = (source >> (8 * n)) & 0xff;
+    payload[4] = count;
 
-    unsigned int nBytes;
+    int nBytes = controlTransfer(USBBOOT_REQUEST_OUT, USBBOOT_FUNC_COPY_PAGES,
+            address & 0xffff, address >> 16, payload, sizeof(payload), count);
+    if (nBytes != sizeof(payload))
+        return setError(ERROR_TRANSFER, "Wrong byte count in copyPages: %d !",
+                nBytes);
 
-    nBytes = libusb_control_transfer(usbhandle,
-            LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
-                    | LIBUSB_ENDPOINT_OUT, 2, page->getPageaddress(), 0,
-            (unsigned char*) page->getData(), page->getPagesize(), 5000);
+    pagebytes += count * info.pagesize;
+    sentbytes += sizeof(payload);
+    copiedpages += count;
+    copysaving += count * info.pagesize - sizeof(payload);
+    return ERROR_NONE;
+}
 
-    if (nBytes != page->getPagesize()) {
-        fprintf(stderr, "Error: wrong byte count in writePage: %d !\n", nBytes);
-        exit(1);
+/* the bootloader can checksum or read back its flash */
+bool CBootloader::canVerify() {
+    const SBootinfo *pInfo = getInfo();
+    return pInfo != NULL
+            && (pInfo->features & (USBBOOT_FEATURE_CRC | USBBOOT_FEATURE_READ));
+}
+
+/* Compare a page with the flash by CRC (USBBOOT_FUNC_GET_CRC) or, if the
+ * bootloader cannot checksum, by reading it back. Returns 1 if equal, 0 if
+ * not, or an error.
+ */
+int CBootloader::verifyPage(CPage* page) {
+    if (!canVerify())
+        return setError(ERROR_ARGUMENT,
+                "Bootloader can neither checksum nor read its flash!");
+
+    unsigned int pagesize = page->getPagesize();
+    if (info.features & USBBOOT_FEATURE_CRC) {
+        unsigned char buffer[2];
+        int nBytes = controlTransfer(USBBOOT_REQUEST_IN, USBBOOT_FUNC_GET_CRC,
+                page->getPageaddress() & 0xffff, page->getPageaddress() >> 16,
+                buffer, sizeof(buffer), 0);
+        if (nBytes != sizeof(buffer))
+            return setError(ERROR_TRANSFER, "Wrong response size in getCRC: %d !",
+                    nBytes);
+        return (buffer[0] | (buffer[1] << 8)) == page->getCRC16();
     }
+
+    CTransferpool::SSlot *slot = transferpool->acquire(pagesize);
+    if (slot == NULL)
+        return setError(ERROR_MEMORY, "Out of memory!");
+    int nBytes = submitTransfer(slot, USBBOOT_REQUEST_IN, USBBOOT_FUNC_READ_PAGE,
+            page->getPageaddress() & 0xffff, page->getPageaddress() >> 16,
+            pagesize, 0);
+    int result = nBytes == (int) pagesize && memcmp(slot->pBuffer
+            + LIBUSB_CONTROL_SETUP_SIZE, page->getData(), pagesize) == 0;
+    transferpool->release(slot);
+
+    if (nBytes != (int) pagesize)
+        return setError(ERROR_TRANSFER, "Wrong response size in readPage: %d !",
+                nBytes);
+    return result;
 }
 
+/* Which device this is, for the resume journal: vendor and product id, bus
+ * and port path and, if there is one, the serial number.
+ */
+std::string CBootloader::getIdentity() {
+    if (emulator != NULL)
+        return "emulator";
+
+    libusb_device *dev = libusb_get_device(usbhandle);
+    struct libusb_device_descriptor descriptor;
+    char buffer[128];
+
+    if (libusb_get_device_descriptor(dev, &descriptor) < 0)
+        return "unknown";
+    snprintf(buffer, sizeof(buffer), "%04x:%04x@", descriptor.idVendor,
+            descriptor.idProduct);
+    std::string identity = buffer + getPath(dev);
+
+    if (descriptor.iSerialNumber != 0
+            && libusb_get_string_descriptor_ascii(usbhandle,
+                    descriptor.iSerialNumber, (unsigned char *) buffer,
+                    sizeof(buffer)) > 0) {
+        identity += "/";
+        for (char *p = buffer; *p; p++)
+            identity += (*p > ' ' && *p < 0x7f) ? *p : '_';
+    }
+    return identity;
+}
+
+/* USBBOOT_FUNC_WRITE_BATCH payload for count consecutive pages: header
+ * and page data, with partial the last page without its erased tail.
+ * payload takes USBBOOT_BATCHHEADER + count * page size bytes. Returns the
+ * payload length.
+ */
+unsigned int CBootloader::codeBatch(CPage** pages, unsigned int count,
+        bool partial, unsigned char *payload) {
+    unsigned int pagesize = pages[0]->getPagesize();
+    unsigned int length = USBBOOT_BATCHHEADER + count * pagesize;
+    if (partial)
+        length -= pagesize - pages[count - 1]->getDatalength();
+
+    payload[0] = count;
+    payload[1] = 0;
+    for (unsigned int n = 0; n < count; n++)
+        memcpy(payload + USBBOOT_BATCHHEADER + n * pagesize, pages[n]->getData(),
+                n + 1 < count ? pagesize
+                : length - USBBOOT_BATCHHEADER - n * pagesize);
+    return length;
+}
+
+/* USBBOOT_FUNC_WRITE_COMPRESSED payload: header as for WRITE_BATCH, then
+ * the pages coded one by one (see CCompressor). payload takes
+ * USBBOOT_BATCHHEADER + count * COMPRESS_BOUND(page size) bytes. Returns
+ * the payload length, 0 if coding does not make the pages smaller or the
+ * request would not fit a control transfer.
+ */
+unsigned int CBootloader::codeCompressed(CPage** pages, unsigned int count,
+        unsigned char *payload) {
+    unsigned int pagesize = pages[0]->getPagesize();
+    unsigned int length = USBBOOT_BATCHHEADER;
+    payload[0] = count;
+    payload[1] = 0;
+    for (unsigned int n = 0; n < count; n++)
+        length += CCompressor::compressPage(pages[n]->getData(), pagesize,
+                payload + length);
+
+    if (length - USBBOOT_BATCHHEADER >= count * pagesize
+            || length > USBBOOT_MAXCONTROL)
+        return 0;
+    return length;
+}
+
+/* One USBBOOT_FUNC_WRITE_BATCH request: address as for writePage, the
+ * payload is a USBBOOT_BATCHHEADER byte header followed by the page data.
+ * Bootloaders with the partial feature pad a short last page with 0xff.
+ */
+int CBootloader::writeBatch(CPage** pages, unsigned int count) {
+    assert(count <= getBatchsize());
+
+    CTransferpool::SSlot *slot = transferpool->acquire(USBBOOT_BATCHHEADER
+            + count * pages[0]->getPagesize());
+    if (slot == NULL)
+        return setError(ERROR_MEMORY, "Out of memory!");
+
+    unsigned int length = codeBatch(pages, count,
+            (info.features & USBBOOT_FEATURE_PARTIAL) != 0,
+            slot->pBuffer + LIBUSB_CONTROL_SETUP_SIZE);
+    int nBytes = submitTransfer(slot, USBBOOT_REQUEST_OUT,
+            USBBOOT_FUNC_WRITE_BATCH, pages[0]->getPageaddress() & 0xffff,
+            pages[0]->getPageaddress() >> 16, length, count);
+    transferpool->release(slot);
+
+    if (nBytes != (int) length)
+        return setError(ERROR_TRANSFER, "Wrong byte count in writePages: %d !",
+                nBytes);
+    sentbytes += length - USBBOOT_BATCHHEADER;
+    return ERROR_NONE;
+}
+
+/* One USBBOOT_FUNC_WRITE_COMPRESSED request (see codeCompressed). Runs
+ * that do not get smaller are sent uncoded.
+ */
+int CBootloader::writeCompressed(CPage** pages, unsigned int count) {
+    assert(count <= getBatchsize());
+
+    unsigned int pagesize = pages[0]->getPagesize();
+    CTransferpool::SSlot *slot = transferpool->acquire(USBBOOT_BATCHHEADER
+            + count * COMPRESS_BOUND(pagesize));
+    if (slot == NULL)
+        return setError(ERROR_MEMORY, "Out of memory!");
+
+    unsigned int length = codeCompressed(pages, count,
+            slot->pBuffer + LIBUSB_CONTROL_SETUP_SIZE);
+    if (length == 0) {
+        transferpool->release(slot);
+        return writeRaw(pages, count);
+    }
+
+    int nBytes = submitTransfer(slot, USBBOOT_REQUEST_OUT,
+            USBBOOT_FUNC_WRITE_COMPRESSED, pages[0]->getPageaddress() & 0xffff,
+            pages[0]->getPageaddress() >> 16, length, count);
+    transferpool->release(slot);
+
+    if (nBytes != (int) length)
+        return setError(ERROR_TRANSFER,
+                "Wrong byte count in writeCompressed: %d !", nBytes);
+    sentbytes += length - USBBOOT_BATCHHEADER;
+    return ERROR_NONE;
+}
+
+/* Result into the slot: 1 for a complete transfer, else a negative libusb
+ * error. The completion time is taken here, not when the reap loop gets to
+ * the slot, so latency samples do not include the wait for earlier
+ * transfers.
+ */
+static void LIBUSB_CALL bulkDone(struct libusb_transfer *transfer) {
+    CTransferpool::SSlot *slot = (CTransferpool::SSlot *) transfer->user_data;
+    int result = LIBUSB_ERROR_IO;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED
+            && transfer->actual_length == transfer->length)
+        result = 1;
+    else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        result = LIBUSB_ERROR_TIMEOUT;
+    else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+        result = LIBUSB_ERROR_NO_DEVICE;
+    slot->nCompleted = getClock();
+    slot->nDone = result;
+}
+
+/* USBBOOT_FUNC_BULK_BEGIN announces count pages at the address (as for
+ * writePage) on the control pipe, then the page data follows on the bulk
+ * endpoint. Transfers of about USBBOOT_BULKCHUNK bytes are kept in
+ * flight, so the bus never waits for the host between transfers: up to
+ * USBBOOT_BULKINFLIGHT, one more after every transfer in time, half as
+ * many after a slow one or a timeout. written tells how many pages went
+ * through before an error.
+ */
+int CBootloader::writePagesBulk(CPage** pages, unsigned int count,
+        unsigned int &written) {
+    written = 0;
+    unsigned char header[2] = { (unsigned char) (count & 0xff),
+            (unsigned char) (count >> 8) };
+    int nBytes = controlTransfer(USBBOOT_REQUEST_OUT, USBBOOT_FUNC_BULK_BEGIN,
+            pages[0]->getPageaddress() & 0xffff,
+            pages[0]->getPageaddress() >> 16, header, sizeof(header), 0);
+    if (nBytes != sizeof(header))
+        return setError(ERROR_TRANSFER, "Wrong byte count in bulk begin: %d !",
+                nBytes);
+    /* a retried announce may have reopened the device */
+    int endpoint = getBulkendpoint();
+    if (endpoint <= 0)
+        return setError(ERROR_NODEVICE, "Bulk endpoint lost!");
+
+    unsigned int pagesize = pages[0]->getPagesize();
+    unsigned int perTransfer = USBBOOT_BULKCHUNK / pagesize;
+    if (perTransfer == 0)
+        perTransfer = 1;
+
+    CTransferpool::SSlot *slots[USBBOOT_BULKINFLIGHT];
+    unsigned int lengths[USBBOOT_BULKINFLIGHT];
+    unsigned long long starts[USBBOOT_BULKINFLIGHT];
+    unsigned long long previous = 0; /* completion of the last transfer */
+    unsigned int submitted = 0;
+    unsigned int completed = 0;
+    unsigned int page = 0;
+    int result = ERROR_NONE;
+
+    while (completed < submitted || (page < count && result == ERROR_NONE)) {
+        /* keep the pipeline full */
+        if (page < count && result == ERROR_NONE
+                && submitted - completed < inflight) {
+            unsigned int n = count - page < perTransfer ? count - page : perTransfer;
+            unsigned int length = n * pagesize;
+            unsigned int k = submitted % USBBOOT_BULKINFLIGHT;
+            CTransferpool::SSlot *slot = transferpool->acquire(length);
+            if (slot == NULL) {
+                result = ERROR_MEMORY;
+                continue;
+            }
+            for (unsigned int i = 0; i < n; i++)
+                memcpy(slot->pBuffer + i * pagesize, pages[page + i]->getData(),
+                        pagesize);
+
+            unsigned int timeout = latency.getTimeout(USBBOOT_LATENCY_BULK, n,
+                    USBBOOT_TIMEOUT);
+            slot->nDone = 0;
+            starts[k] = getMicroseconds();
+            if (emulator != NULL) {
+                int r = emulator->bulkTransfer(endpoint, slot->pBuffer, length,
+                        timeout);
+                slot->nDone = r == (int) length ? 1 : r < 0 ? r : LIBUSB_ERROR_IO;
+                slot->nCompleted = getMicroseconds();
+            } else {
+                libusb_fill_bulk_transfer(slot->pTransfer, usbhandle,
+                        endpoint, slot->pBuffer, length, bulkDone, slot,
+                        timeout);
+                if (libusb_submit_transfer(slot->pTransfer) < 0) {
+                    transferpool->release(slot);
+                    result = ERROR_TRANSFER;
+                    continue;
+                }
+            }
+            slots[k] = slot;
+            lengths[k] = length;
+            submitted++;
+            page += n;
+            continue;
+        }
+
+        /* bulk transfers on one endpoint complete in order. If event
+           handling fails for good the transfers still in flight are given
+           up with their slots. */
+        unsigned int k = completed % USBBOOT_BULKINFLIGHT;
+        int done = slots[k]->nDone;
+        if (done == 0) {
+            if (!waitSlot(transferpool, slots[k])) {
+                for (unsigned int i = completed + 1; i < submitted; i++) {
+                    CTransferpool::SSlot *slot = slots[i % USBBOOT_BULKINFLIGHT];
+                    libusb_cancel_transfer(slot->pTransfer);
+                    if (slot->nDone == 0)
+                        transferpool->abandon(slot);
+                    transferpool->release(slot);
+                }
+                return setError(ERROR_TRANSFER, "USB event handling failed!");
+            }
+            done = slots[k]->nDone;
+        }
+        if (done < 0 && result == ERROR_NONE) {
+            if (done == LIBUSB_ERROR_NO_DEVICE)
+                devicegone = true;
+            if (done == LIBUSB_ERROR_TIMEOUT)
+                adapt(inflight, USBBOOT_BULKINFLIGHT, true);
+            result = ERROR_TRANSFER;
+            for (unsigned int i = completed + 1; i < submitted; i++)
+                if (emulator == NULL)
+                    libusb_cancel_transfer(slots[i % USBBOOT_BULKINFLIGHT]->pTransfer);
+        }
+        if (done > 0 && result == ERROR_NONE) {
+            /* a transfer queued behind another one starts on the bus when
+               that one completes */
+            unsigned long elapsed = (unsigned long) (slots[k]->nCompleted
+                    - std::max(starts[k], previous));
+            adapt(inflight, USBBOOT_BULKINFLIGHT, latency.isSlow(
+                    USBBOOT_LATENCY_BULK, lengths[k] / pagesize, elapsed));
+            latency.addSample(USBBOOT_LATENCY_BULK, lengths[k] / pagesize,
+                    elapsed);
+            sentbytes += lengths[k];
+            written += lengths[k] / pagesize;
+        }
+        previous = slots[k]->nCompleted;
+        transferpool->release(slots[k]);
+        completed++;
+    }
+
+    if (result == ERROR_MEMORY)
+        return setError(ERROR_MEMORY, "Out of memory!");
+    if (result < 0)
+        return setError(ERROR_TRANSFER, "Bulk transfer failed at page 0x%x !",
+                pages[0]->getPageaddress());
+    return ERROR_NONE;
+}
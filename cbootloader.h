@@ -7,27 +7,206 @@
   Last change....: 2006-06-25
 */
 
+#ifndef _H_CBOOTLOADER_
+#define _H_CBOOTLOADER_
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <string>
+#include <vector>
 
 #include "libusb.h"
 #include "cpage.h"
+#include "cerror.h"
+#include "ctransferpool.h"
+#include "clatency.h"
 
 #define USBDEV_SHARED_VENDOR    0x16C0  /* VOTI */
 #define USBDEV_SHARED_PRODUCT   0x05DC  /* Obdev's free shared PID */
 
-class CBootloader {
+/* vendor requests of the bootloader */
+#define USBBOOT_FUNC_LEAVE_BOOT     1
+#define USBBOOT_FUNC_WRITE_PAGE     2
+#define USBBOOT_FUNC_GET_PAGESIZE   3
+#define USBBOOT_FUNC_WRITE_BATCH    4   /* several consecutive pages */
+#define USBBOOT_FUNC_GET_BATCHSIZE  5   /* 1 byte: pages per WRITE_BATCH */
+#define USBBOOT_FUNC_BULK_BEGIN     6   /* 2 bytes page count, data on bulk OUT */
+#define USBBOOT_FUNC_GET_INFO       7   /* USBBOOT_INFOSIZE bytes device info */
+#define USBBOOT_FUNC_WRITE_COMPRESSED 8 /* batch header, pages coded by CCompressor */
+#define USBBOOT_FUNC_COPY_PAGES     9   /* source address (4), page count */
+#define USBBOOT_FUNC_WRITE_PARTIAL  10  /* page without its 0xff tail */
+#define USBBOOT_FUNC_READ_PAGE      11  /* page size bytes of flash */
+#define USBBOOT_FUNC_GET_CRC        12  /* 2 bytes CRC-16 of a flash page */
+
+/* GET_INFO answer, multi byte fields little endian: protocol version,
+   features, page size (2), flash size (4), bootloader start (4), pages
+   per WRITE_BATCH or WRITE_COMPRESSED. Bootloaders before protocol 1 stall the request. */
+#define USBBOOT_INFOSIZE    13
+#define USBBOOT_PROTOCOL    1
+
+/* feature bits of GET_INFO */
+#define USBBOOT_FEATURE_BATCH     0x01
+#define USBBOOT_FEATURE_CRC       0x02
+#define USBBOOT_FEATURE_ERASE     0x04
+#define USBBOOT_FEATURE_READ      0x08
+#define USBBOOT_FEATURE_COMPRESS  0x10
+#define USBBOOT_FEATURE_BULK      0x20
+#define USBBOOT_FEATURE_COPY      0x40
+#define USBBOOT_FEATURE_PARTIAL   0x80  /* also: WRITE_BATCH may end short */
+
+/* COPY_PAGES payload: little endian source address, page count */
+#define USBBOOT_COPYSIZE 5
+
+/* WRITE_BATCH payload: page count, reserved, then the pages */
+#define USBBOOT_BATCHHEADER 2
+#define USBBOOT_MAXBATCH    255
+/* longest control payload; Linux usbfs refuses longer ones, and wLength
+   is 16 bit anyway */
+#define USBBOOT_MAXCONTROL  4096
+/* pages of a batch that fit USBBOOT_MAXCONTROL with the header */
+#define USBBOOT_CONTROLPAGES(pagesize) \
+    ((USBBOOT_MAXCONTROL - USBBOOT_BATCHHEADER) / (pagesize))
+
+/* bulk data path: bytes per transfer and transfers in flight */
+#define USBBOOT_BULKCHUNK    1024
+#define USBBOOT_BULKINFLIGHT 4
+
+/* failed event handling rounds in a row before a transfer is given up */
+#define USBBOOT_EVENTERRORS  3
+
+/* longest wait for any request (ms); learned timeouts stay below */
+#define USBBOOT_TIMEOUT 5000
+/* latency kind of bulk data transfers, request 0 is unused */
+#define USBBOOT_LATENCY_BULK 0
+
+/* retry policy: attempts after the first, first backoff and its limit (ms) */
+#define USBBOOT_RETRIES       3
+#define USBBOOT_RETRYDELAY    10
+#define USBBOOT_RETRYDELAYMAX 1000
+/* how long a device that dropped off may take to re-enumerate, and how
+   often its port is looked at meanwhile (ms) */
+#define USBBOOT_REOPENTIME    2000
+#define USBBOOT_REOPENPOLL    50
+
+/* per string descriptor while looking for the bootloader (ms) */
+#define USBBOOT_PROBETIMEOUT 250
+
+/* int cast: C++20 deprecates mixing the libusb enums */
+#define USBBOOT_REQUEST_IN  ((int) LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN)
+#define USBBOOT_REQUEST_OUT ((int) LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT)
+
+class CEmulator;
+
+struct SBootinfo {
+  unsigned int version;     /* 0: legacy bootloader without GET_INFO */
+  unsigned int features;    /* USBBOOT_FEATURE_* */
+  unsigned int pagesize;
+  unsigned int flashsize;   /* 0: unknown */
+  unsigned int bootstart;   /* first byte of the bootloader, 0: unknown */
+  unsigned int batchsize;   /* pages per WRITE_BATCH or WRITE_COMPRESSED */
+};
+
+/* Without a device the default constructor sets ERROR_NODEVICE, check
+   isOpen() before use. Transfers return ERROR_NONE or ERROR_TRANSFER. */
+class CBootloader : public CErrorstate {
  public:
   CBootloader();
+  CBootloader(const std::string &selector);
+  CBootloader(libusb_device_handle *handle);
+  CBootloader(CEmulator *emulator);
   ~CBootloader();
+  static libusb_device_handle *openDevice(libusb_device *dev,
+                                          const std::string &selector = "",
+                                          bool *mismatch = NULL);
+  static std::string getPath(libusb_device *dev);
+  static int parseInfo(const unsigned char *buffer, int nBytes, SBootinfo &info);
+  static unsigned int codeBatch(CPage** pages, unsigned int count, bool partial,
+                                unsigned char *payload);
+  static unsigned int codeCompressed(CPage** pages, unsigned int count,
+                                     unsigned char *payload);
+  bool isOpen();
+  const SBootinfo *getInfo();
   unsigned int getPagesize();
-  void writePage(CPage* page);
-  void startApplication();
+  int checkRange(unsigned int address, unsigned int length);
+  int writePage(CPage* page);
+  int writePages(CPage** pages, unsigned int count);
+  bool canCopy();
+  int copyPages(unsigned int address, unsigned int source, unsigned int count);
+  unsigned int getBatchsize();
+  void setBatchlimit(unsigned int limit);
+  int getBulkendpoint();
+  void setBulkenabled(bool enabled);
+  void setCompressenabled(bool enabled);
+  void setCopyenabled(bool enabled);
+  void setRetries(unsigned int limit, unsigned int delay);
+  unsigned long getRetries();
+  unsigned long getRecoveries();
+  unsigned long getReopens();
+  unsigned long getWritelatency(unsigned int percent);
+  unsigned int getInflight();
+  unsigned long getPagebytes();
+  unsigned long getSentbytes();
+  unsigned long getCopiedpages();
+  unsigned long getCopysaving();
+  void resetStatistics();
+  bool canVerify();
+  int verifyPage(CPage* page);
+  std::string getIdentity();
+  int startApplication();
+  CTransferpool* getTransferpool();
 
  protected:
+  int controlTransfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                      uint16_t wIndex, unsigned char *data, uint16_t wLength,
+                      unsigned int pages, bool probe = false);
+  int submitTransfer(CTransferpool::SSlot *slot, uint8_t bmRequestType,
+                     uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                     uint16_t wLength, unsigned int pages, bool probe = false);
+  int submitOnce(CTransferpool::SSlot *slot, uint8_t bmRequestType,
+                 uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                 uint16_t wLength, unsigned int timeout);
+  void backoff(unsigned int attempt);
+  unsigned long long getMicroseconds();
+  int reopen();
+  void init();
+  void find(const std::string &selector);
+  int writeRaw(CPage** pages, unsigned int count);
+  int writeBatch(CPage** pages, unsigned int count);
+  int writeCompressed(CPage** pages, unsigned int count);
+  int writePagesBulk(CPage** pages, unsigned int count, unsigned int &written);
+
   libusb_device_handle *usbhandle;
+  bool libusbinit;      /* find() holds a reference on libusb */
+  CTransferpool *transferpool;
+  CEmulator *emulator;
+  SBootinfo info;
+  bool infovalid;
+  unsigned int batchlimit;
+  int bulkendpoint;     /* -1 not looked up yet, 0 none */
+  int bulkinterface;    /* claimed interface or -1 */
+  bool bulkenabled;
+  bool compressenabled;
+  bool copyenabled;
+  unsigned long copiedpages;
+  unsigned long copysaving; /* page bytes minus COPY_PAGES payloads */
+  unsigned long pagebytes;  /* page data handed to writePages */
+  unsigned long sentbytes;  /* page data after coding, as sent */
+  unsigned int retrylimit;
+  unsigned int retrydelay;
+  unsigned long retries;    /* attempts after a failed one */
+  unsigned long recoveries; /* operations that succeeded on a retry */
+  unsigned long reopens;
+  bool devicegone;          /* a transfer found the device unplugged */
+  /* learned round trips, AIMD windows they steer */
+  CLatency latency;
+  unsigned int batchwindow; /* pages per control write request */
+  unsigned int inflight;    /* bulk transfers queued at once */
+  /* where the device was, to find it again */
+  uint8_t reopenbus;
+  std::vector<uint8_t> reopenports;
   libusb_context *ctx;
 };
 
+#endif
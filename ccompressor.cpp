@@ -0,0 +1,67 @@
+/*
+  ccompressor.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Page compression for USBBOOT_FUNC_WRITE_COMPRESSED, see ccompressor.h
+  for the format. The reference decoder is in the emulator.
+*/
+
+#include "ccompressor.h"
+
+static void flushLiterals(const unsigned char* pData, unsigned int nStart,
+    unsigned int nEnd, unsigned char* pOut, unsigned int& nOut) {
+  while (nStart < nEnd) {
+    unsigned int nCount = nEnd - nStart;
+    if (nCount > COMPRESS_MAXLITERAL) nCount = COMPRESS_MAXLITERAL;
+    pOut[nOut++] = COMPRESS_LITERAL | (nCount - 1);
+    for (unsigned int n = 0; n < nCount; n++)
+      pOut[nOut++] = pData[nStart++];
+  }
+}
+
+/* code one page greedily, taking the longest run or back reference at
+   every position. Returns the coded size, at most COMPRESS_BOUND. */
+unsigned int CCompressor::compressPage(const unsigned char* pData, unsigned int nPagesize,
+    unsigned char* pOut) {
+  unsigned int nOut = 0;
+  unsigned int nLiteral = 0;
+  unsigned int nPos = 0;
+
+  while (nPos < nPagesize) {
+    unsigned int nLimit = nPagesize - nPos;
+    if (nLimit > COMPRESS_MAXMATCH) nLimit = COMPRESS_MAXMATCH;
+
+    unsigned int nRun = 1;
+    while (nRun < nLimit && pData[nPos + nRun] == pData[nPos]) nRun++;
+
+    unsigned int nCopy = 0;
+    unsigned int nOffset = 0;
+    unsigned int nFirst = nPos > COMPRESS_WINDOW ? nPos - COMPRESS_WINDOW : 0;
+    for (unsigned int nFrom = nFirst; nFrom < nPos && nCopy < nLimit; nFrom++) {
+      unsigned int nLength = 0;
+      while (nLength < nLimit && pData[nFrom + nLength] == pData[nPos + nLength]) nLength++;
+      if (nLength > nCopy) {
+        nCopy = nLength;
+        nOffset = nPos - nFrom;
+      }
+    }
+
+    if (nRun < COMPRESS_MINMATCH && nCopy < COMPRESS_MINMATCH) {
+      nPos++;
+      continue;
+    }
+
+    flushLiterals(pData, nLiteral, nPos, pOut, nOut);
+    if (nRun >= nCopy) {
+      pOut[nOut++] = COMPRESS_RUN | (nRun - COMPRESS_MINMATCH);
+      pOut[nOut++] = pData[nPos];
+      nPos += nRun;
+    } else {
+      pOut[nOut++] = COMPRESS_COPY | (nCopy - COMPRESS_MINMATCH);
+      pOut[nOut++] = nOffset - 1;
+      nPos += nCopy;
+    }
+    nLiteral = nPos;
+  }
+  flushLiterals(pData, nLiteral, nPos, pOut, nOut);
+  return nOut;
+}
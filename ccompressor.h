@@ -0,0 +1,36 @@
+/*
+  ccompressor.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Page compression for USBBOOT_FUNC_WRITE_COMPRESSED. Every page is coded
+  on its own, so the bootloader decodes into its page buffer without any
+  further RAM. Tokens, by the control byte c:
+
+    0x00-0x7f  c + 1 literal bytes follow
+    0x80-0xbf  the next byte, repeated (c & 0x3f) + 3 times
+    0xc0-0xff  copy (c & 0x3f) + 3 bytes from n + 1 bytes back in the
+               page, n is the next byte
+
+  No token crosses a page boundary.
+*/
+
+#ifndef _H_CCOMPRESSOR_
+#define _H_CCOMPRESSOR_
+
+#define COMPRESS_LITERAL  0x00
+#define COMPRESS_RUN      0x80
+#define COMPRESS_COPY     0xc0
+#define COMPRESS_MINMATCH 3
+#define COMPRESS_MAXMATCH (0x3f + COMPRESS_MINMATCH)
+#define COMPRESS_MAXLITERAL 0x80
+#define COMPRESS_WINDOW   256
+
+/* worst case size of a coded page */
+#define COMPRESS_BOUND(pagesize) ((pagesize) + ((pagesize) + COMPRESS_MAXLITERAL - 1) / COMPRESS_MAXLITERAL)
+
+class CCompressor {
+ public:
+  static unsigned int compressPage(const unsigned char* pData, unsigned int nPagesize,
+                                   unsigned char* pOut);
+};
+
+#endif
@@ -0,0 +1,364 @@
+/*
+  cdaemon.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Resident flashing daemon: keeps libusb initialised and parsed images
+  cached, tracks bootloader devices through hotplug and takes flash jobs
+  over a Unix domain socket.
+
+  Protocol: the client sends one line and reads lines until the daemon
+  closes the connection.
+    FLASH <options and files as on the command line>
+        -> PAGESIZE <n>, PAGE <n>/<pages> 0x<address> ..., OK <pages> <ms>
+    STATUS
+        -> DEVICES <n>, IMAGES <n>, JOBS <n> <failures>, OK
+    SHUTDOWN
+        -> OK
+  Errors are answered with "ERROR <message>".
+*/
+
+#ifndef _WIN32
+
+#include <stdarg.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <errno.h>
+
+#include "cdaemon.h"
+
+static void reply(int fd, const char* format, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer, sizeof(buffer) - 1, format, args);
+  va_end(args);
+  if (n < 0) return;
+  if (n > (int) sizeof(buffer) - 2) n = sizeof(buffer) - 2;
+  buffer[n++] = '\n';
+  if (write(fd, buffer, n) != n) {
+    /* client went away, the job still completes */
+  }
+}
+
+static unsigned long getMilliseconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+CDaemon::CDaemon(const char* socketpath) {
+  m_sSocketpath = socketpath;
+  m_bRunning = true;
+  m_nJobs = 0;
+  m_nFailures = 0;
+  m_nListenfd = -1;
+  m_bHotplug = false;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (m_sSocketpath.size() >= sizeof(addr.sun_path)) {
+    setError(ERROR_ARGUMENT, "Socket path %s too long!", socketpath);
+    return;
+  }
+  strcpy(addr.sun_path, socketpath);
+
+  /* a stale socket of an earlier daemon is replaced, anything else kept */
+  struct stat st;
+  if (lstat(socketpath, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      setError(ERROR_FILE, "%s exists and is not a socket!", socketpath);
+      return;
+    }
+    unlink(socketpath);
+  }
+
+  /* created with DAEMON_SOCKETMODE right away, not after a chmod */
+  mode_t nUmask = umask(~DAEMON_SOCKETMODE & 0777);
+  m_nListenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int nBound = m_nListenfd < 0 ? -1 : bind(m_nListenfd, (struct sockaddr*) &addr, sizeof(addr));
+  umask(nUmask);
+  if (nBound < 0 || listen(m_nListenfd, 8) < 0) {
+    setError(ERROR_FILE, "Cannot listen on %s: %s", socketpath, strerror(errno));
+    return;
+  }
+
+  fprintf(stdout, "libusb init ...\r\n");
+  libusb_init(NULL);
+
+  /* with hotplug the candidate list is kept up to date by libusb events,
+     otherwise the bus is enumerated for every job */
+  m_bHotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+      && libusb_hotplug_register_callback(NULL,
+          (libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+              | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+          LIBUSB_HOTPLUG_ENUMERATE, USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT,
+          LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, this, &m_hHotplug)
+          == LIBUSB_SUCCESS;
+
+  fprintf(stdout, "listening on %s (%s)\n", socketpath,
+      m_bHotplug ? "hotplug" : "enumerating per job");
+}
+
+CDaemon::~CDaemon() {
+  if (m_nListenfd >= 0) close(m_nListenfd);
+  if (m_nError < 0) return;
+
+  if (m_bHotplug)
+    libusb_hotplug_deregister_callback(NULL, m_hHotplug);
+  for (size_t n = 0; n < m_vDevices.size(); n++)
+    libusb_unref_device(m_vDevices[n]);
+  for (size_t n = 0; n < m_vImages.size(); n++)
+    delete m_vImages[n].pFlashmem;
+
+  unlink(m_sSocketpath.c_str());
+  libusb_exit(NULL);
+}
+
+int LIBUSB_CALL CDaemon::hotplugCallback(libusb_context* ctx, libusb_device* dev,
+    libusb_hotplug_event event, void* pUser) {
+  CDaemon* pDaemon = (CDaemon*) pUser;
+  std::vector<libusb_device*>& devices = pDaemon->m_vDevices;
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+    devices.push_back(libusb_ref_device(dev));
+  } else {
+    std::vector<libusb_device*>::iterator it = std::find(devices.begin(), devices.end(), dev);
+    if (it != devices.end()) {
+      libusb_unref_device(*it);
+      devices.erase(it);
+    }
+  }
+  return 0;
+}
+
+/* serve until SHUTDOWN, returns the error if the socket was not set up */
+int CDaemon::run() {
+  if (m_nError < 0) return m_nError;
+
+  while (m_bRunning) {
+    struct pollfd pfd;
+    pfd.fd = m_nListenfd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 100) > 0) {
+      int fd = accept(m_nListenfd, NULL, NULL);
+      if (fd >= 0) {
+        handleClient(fd);
+        close(fd);
+      }
+    }
+
+    struct timeval tv = { 0, 0 };
+    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+  }
+  return ERROR_NONE;
+}
+
+void CDaemon::handleClient(int fd) {
+  char request[DAEMON_MAXREQUEST];
+  size_t nRequest = 0;
+
+  /* read up to the first line end. The loop serves one client at a time,
+     so a client that sends no line is dropped after DAEMON_REQUESTTIMEOUT */
+  unsigned long nDeadline = getMilliseconds() + DAEMON_REQUESTTIMEOUT;
+  while (nRequest < sizeof(request) - 1) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    unsigned long nNow = getMilliseconds();
+    if (nNow >= nDeadline || poll(&pfd, 1, nDeadline - nNow) <= 0) {
+      reply(fd, "ERROR request timeout");
+      return;
+    }
+    ssize_t n = read(fd, request + nRequest, sizeof(request) - 1 - nRequest);
+    if (n <= 0) break;
+    nRequest += n;
+    if (memchr(request, '\n', nRequest) != NULL) break;
+  }
+  request[nRequest] = 0;
+  char* pEnd = strchr(request, '\n');
+  if (pEnd != NULL) *pEnd = 0;
+
+  std::vector<char*> args;
+  for (char* pToken = strtok(request, " \t\r"); pToken != NULL; pToken = strtok(NULL, " \t\r"))
+    args.push_back(pToken);
+
+  if (args.empty()) {
+    reply(fd, "ERROR empty request");
+  } else if (strcmp(args[0], "FLASH") == 0) {
+    runJob(fd, args.size(), &args[0]);
+  } else if (strcmp(args[0], "STATUS") == 0) {
+    status(fd);
+  } else if (strcmp(args[0], "SHUTDOWN") == 0) {
+    m_bRunning = false;
+    reply(fd, "OK");
+  } else {
+    reply(fd, "ERROR unknown request %s", args[0]);
+  }
+}
+
+void CDaemon::status(int fd) {
+  reply(fd, "DEVICES %d", (int) m_vDevices.size());
+  reply(fd, "IMAGES %d", (int) m_vImages.size());
+  reply(fd, "JOBS %d %d", m_nJobs, m_nFailures);
+  reply(fd, "OK");
+}
+
+libusb_device_handle* CDaemon::openBootloader() {
+  libusb_device_handle* handle = NULL;
+
+  if (m_bHotplug) {
+    for (size_t n = 0; n < m_vDevices.size() && handle == NULL; n++)
+      handle = CBootloader::openDevice(m_vDevices[n]);
+    return handle;
+  }
+
+  libusb_device** devList;
+  ssize_t size = libusb_get_device_list(NULL, &devList);
+  for (ssize_t n = 0; n < size && handle == NULL; n++)
+    handle = CBootloader::openDevice(devList[n]);
+  if (size >= 0)
+    libusb_free_device_list(devList, 1);
+  return handle;
+}
+
+/* parsed images are cached by their key, the oldest one is dropped first.
+   NULL if the image cannot be parsed, the error is kept in pJob. */
+CFlashmem* CDaemon::getImage(CFlashjob* pJob, unsigned int pagesize) {
+  std::string key = pJob->getImagekey(pagesize);
+
+  for (size_t n = 0; n < m_vImages.size(); n++) {
+    if (m_vImages[n].key == key) return m_vImages[n].pFlashmem;
+  }
+
+  CFlashmem* pFlashmem = pJob->loadImage(pagesize);
+  if (pFlashmem == NULL) return NULL;
+
+  if (m_vImages.size() >= DAEMON_MAXIMAGES) {
+    delete m_vImages[0].pFlashmem;
+    m_vImages.erase(m_vImages.begin());
+  }
+
+  SImage image = { key, pFlashmem };
+  m_vImages.push_back(image);
+  return image.pFlashmem;
+}
+
+void CDaemon::progressCallback(void* pUser, unsigned int nPage, unsigned int nPages,
+    CPage* pPage) {
+  reply(*(int*) pUser, "PAGE %d/%d 0x%x", nPage + 1, nPages, pPage->getPageaddress());
+}
+
+void CDaemon::runJob(int fd, int argc, char** argv) {
+  CFlashjob job;
+  unsigned long nStart = getMilliseconds();
+
+  m_nJobs++;
+  for (int i = 1; i < argc; i++) {
+    if (!job.parseOption(argc, argv, i)) {
+      reply(fd, "ERROR invalid argument %s", argv[i]);
+      m_nFailures++;
+      return;
+    }
+  }
+  if (!job.hasInputs()) {
+    reply(fd, "ERROR no input file");
+    m_nFailures++;
+    return;
+  }
+
+  libusb_device_handle* handle = openBootloader();
+  if (handle == NULL) {
+    reply(fd, "ERROR no bootloader device");
+    m_nFailures++;
+    return;
+  }
+
+  CBootloader bootloader(handle);
+  unsigned int pagesize = bootloader.getPagesize();
+  if (pagesize == 0) {
+    reply(fd, "ERROR %s", bootloader.getErrormessage());
+    m_nFailures++;
+    return;
+  }
+  reply(fd, "PAGESIZE %d", pagesize);
+
+  CFlashmem* pFlashmem = getImage(&job, pagesize);
+  if (pFlashmem == NULL) {
+    reply(fd, "ERROR %s", job.getErrormessage());
+    m_nFailures++;
+    return;
+  }
+
+  CFlashpatch flashpatch(pFlashmem);
+  if (job.applyPatches(&flashpatch) < 0) {
+    reply(fd, "ERROR %s", job.getErrormessage());
+    m_nFailures++;
+    return;
+  }
+  if (CFlashjob::flash(&bootloader, &flashpatch, progressCallback, &fd) < 0) {
+    reply(fd, "ERROR %s", bootloader.getErrormessage());
+    m_nFailures++;
+    return;
+  }
+
+  reply(fd, "OK %d %lu", flashpatch.getPagecount(), getMilliseconds() - nStart);
+}
+
+/* client side: send the job to a running daemon and relay its answer,
+   returns the exit code for the command line tool */
+int CDaemon::runClient(const char* socketpath, int argc, char** argv) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketpath, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Cannot connect to %s: %s\n", socketpath, strerror(errno));
+    return 1;
+  }
+
+  /* the daemon has its own working directory, send absolute file names */
+  std::string request = "FLASH";
+  for (int i = 0; i < argc; i++) {
+    char path[PATH_MAX];
+    struct stat st;
+    request += " ";
+    if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode) && realpath(argv[i], path) != NULL)
+      request += path;
+    else
+      request += argv[i];
+  }
+  request += "\n";
+  if (write(fd, request.c_str(), request.size()) != (ssize_t) request.size()) {
+    fprintf(stderr, "Cannot send request to %s\n", socketpath);
+    close(fd);
+    return 1;
+  }
+
+  std::string answer;
+  char buffer[1024];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, n, stdout);
+    answer.append(buffer, n);
+  }
+  close(fd);
+
+  /* the last line tells the result */
+  size_t nLast = answer.rfind('\n', answer.size() >= 2 ? answer.size() - 2 : 0);
+  nLast = (nLast == std::string::npos) ? 0 : nLast + 1;
+  return answer.compare(nLast, 2, "OK") == 0 ? 0 : 1;
+}
+
+#endif
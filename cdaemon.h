@@ -0,0 +1,62 @@
+/*
+  cdaemon.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Resident flashing daemon: keeps libusb initialised and parsed images
+  cached, tracks bootloader devices through hotplug and takes flash jobs
+  over a Unix domain socket.
+*/
+
+#ifndef _H_CDAEMON_
+#define _H_CDAEMON_
+
+#include <string>
+#include <vector>
+
+#include "libusb.h"
+#include "cflashjob.h"
+#include "cerror.h"
+
+/* number of parsed images kept in the cache */
+#define DAEMON_MAXIMAGES 8
+/* longest request line */
+#define DAEMON_MAXREQUEST 4096
+/* ms a client may take to send its request line */
+#define DAEMON_REQUESTTIMEOUT 2000
+/* socket permissions: only the daemon's user may send jobs */
+#define DAEMON_SOCKETMODE 0600
+
+class CDaemon : public CErrorstate {
+ public:
+  CDaemon(const char* socketpath);
+  ~CDaemon();
+  int run();
+  static int runClient(const char* socketpath, int argc, char** argv);
+
+ protected:
+  static int LIBUSB_CALL hotplugCallback(libusb_context* ctx, libusb_device* dev,
+                                         libusb_hotplug_event event, void* pUser);
+  static void progressCallback(void* pUser, unsigned int nPage, unsigned int nPages,
+                               CPage* pPage);
+  void handleClient(int fd);
+  void runJob(int fd, int argc, char** argv);
+  void status(int fd);
+  libusb_device_handle* openBootloader();
+  CFlashmem* getImage(CFlashjob* pJob, unsigned int pagesize);
+
+  struct SImage {
+    std::string key;
+    CFlashmem* pFlashmem;
+  };
+
+  std::string m_sSocketpath;
+  int m_nListenfd;
+  bool m_bRunning;
+  bool m_bHotplug;
+  libusb_hotplug_callback_handle m_hHotplug;
+  std::vector<libusb_device*> m_vDevices;
+  std::vector<SImage> m_vImages;
+  unsigned int m_nJobs;
+  unsigned int m_nFailures;
+};
+
+#endif
@@ -0,0 +1,449 @@
+/*
+  cemulator.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Host side model of the bootloader: answers the vendor requests like the
+  firmware, keeps the written flash and accounts the time the transfers
+  would take on a low speed device, so protocol changes can be measured
+  without hardware.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cemulator.h"
+#include "cbootloader.h"
+#include "ccompressor.h"
+
+CEmulator::CEmulator() {
+  m_nVersion = USBBOOT_PROTOCOL;
+  m_nPagesize = 64;
+  m_nBootstart = 0;
+  m_nBatchsize = 16;
+  m_nBulkendpoint = 0;
+  m_bCompress = false;
+  m_bCopy = false;
+  m_bPartial = false;
+  m_bCRC = false;
+  m_bRead = false;
+  m_nMaxpacket = EMULATOR_PACKETSIZE;
+  m_nBulkpages = 0;
+  m_vFlash.assign(0x20000, 0xff);
+  m_nTransfertime = EMULATOR_TRANSFERTIME;
+  m_nPackettime = EMULATOR_PACKETTIME;
+  m_nBulkpackettime = EMULATOR_BULKPACKETTIME;
+  m_nStallrate = 0;
+  m_nTimeoutrate = 0;
+  m_nShortrate = 0;
+  m_nUnplugrate = 0;
+  m_nDatarequests = 0;
+  m_bUnplugged = false;
+  m_nUnplugtime = 0;
+  m_nReenumtime = EMULATOR_REENUMTIME;
+  m_nProgramtime = EMULATOR_PROGRAMTIME;
+  resetStatistics();
+}
+
+/* device description "key=value,...", keys: protocol (0 for a bootloader
+   without GET_INFO), pagesize, flash, boot (bootloader start, protected
+   from writes), batch (0 without WRITE_BATCH), compress (1 to decode
+   WRITE_COMPRESSED), copy (1 to take COPY_PAGES), partial (1 to take
+   pages without their 0xff tail), crc and read (1 to answer GET_CRC and
+   READ_PAGE), bulk (1 for a full speed device with a bulk OUT
+   endpoint), maxpacket (control packet size), the timing model
+   transfer, packet, bulkpacket, program in microseconds, and faults on
+   every n-th data request: stall, timeout, short (half the data taken),
+   unplug (gone until the host reopens it), and reenum, the microseconds an
+   unplugged device takes to show up again. false on an unknown key. */
+bool CEmulator::parseSpec(const char* spec) {
+  char buffer[256];
+  strncpy(buffer, spec, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = 0;
+
+  for (char* pItem = strtok(buffer, ","); pItem != NULL; pItem = strtok(NULL, ",")) {
+    char* pValue = strchr(pItem, '=');
+    if (pValue == NULL) return false;
+    *pValue++ = 0;
+    unsigned int nValue = strtoul(pValue, NULL, 0);
+
+    if (strcmp(pItem, "protocol") == 0) m_nVersion = nValue;
+    else if (strcmp(pItem, "pagesize") == 0 && nValue > 0) m_nPagesize = nValue;
+    else if (strcmp(pItem, "boot") == 0) m_nBootstart = nValue;
+    else if (strcmp(pItem, "flash") == 0 && nValue > 0) m_vFlash.assign(nValue, 0xff);
+    else if (strcmp(pItem, "batch") == 0 && nValue <= USBBOOT_MAXBATCH) m_nBatchsize = nValue;
+    else if (strcmp(pItem, "compress") == 0) m_bCompress = nValue != 0;
+    else if (strcmp(pItem, "copy") == 0) m_bCopy = nValue != 0;
+    else if (strcmp(pItem, "partial") == 0) m_bPartial = nValue != 0;
+    else if (strcmp(pItem, "crc") == 0) m_bCRC = nValue != 0;
+    else if (strcmp(pItem, "read") == 0) m_bRead = nValue != 0;
+    else if (strcmp(pItem, "bulk") == 0) m_nBulkendpoint = nValue ? 0x01 : 0;
+    else if (strcmp(pItem, "maxpacket") == 0 && nValue > 0) m_nMaxpacket = nValue;
+    else if (strcmp(pItem, "transfer") == 0) m_nTransfertime = nValue;
+    else if (strcmp(pItem, "packet") == 0) m_nPackettime = nValue;
+    else if (strcmp(pItem, "bulkpacket") == 0) m_nBulkpackettime = nValue;
+    else if (strcmp(pItem, "stall") == 0) m_nStallrate = nValue;
+    else if (strcmp(pItem, "timeout") == 0) m_nTimeoutrate = nValue;
+    else if (strcmp(pItem, "short") == 0) m_nShortrate = nValue;
+    else if (strcmp(pItem, "unplug") == 0) m_nUnplugrate = nValue;
+    else if (strcmp(pItem, "reenum") == 0) m_nReenumtime = nValue;
+    else if (strcmp(pItem, "program") == 0) m_nProgramtime = nValue;
+    else return false;
+  }
+  return true;
+}
+
+static void putLE(unsigned char* pData, unsigned int nValue, int nBytes) {
+  for (int n = 0; n < nBytes; n++, nValue >>= 8)
+    pData[n] = nValue & 0xff;
+}
+
+int CEmulator::programPages(unsigned int nAddress, const unsigned char* pData,
+    unsigned int nPages) {
+  if (nAddress % m_nPagesize != 0 || nAddress > getBootstart()
+      || nPages * m_nPagesize > getBootstart() - nAddress)
+    return LIBUSB_ERROR_PIPE;
+
+  memcpy(&m_vFlash[nAddress], pData, nPages * m_nPagesize);
+  m_nPagewrites += nPages;
+  m_nTime += (unsigned long long) nPages * m_nProgramtime;
+  return ERROR_NONE;
+}
+
+/* reference decoder for one page as coded by CCompressor, writing only
+   into the page buffer like the firmware. Bytes consumed or -1 for a
+   broken stream. */
+int CEmulator::decodePage(const unsigned char* pData, unsigned int nLength,
+    unsigned char* pPage) {
+  unsigned int nIn = 0;
+  unsigned int nOut = 0;
+
+  while (nOut < m_nPagesize) {
+    if (nIn >= nLength) return -1;
+    unsigned char c = pData[nIn++];
+    unsigned int nCount;
+
+    if (c < COMPRESS_RUN) {
+      nCount = c + 1;
+      if (nCount > m_nPagesize - nOut || nCount > nLength - nIn) return -1;
+      memcpy(pPage + nOut, pData + nIn, nCount);
+      nIn += nCount;
+    } else {
+      nCount = (c & 0x3f) + COMPRESS_MINMATCH;
+      if (nCount > m_nPagesize - nOut || nIn >= nLength) return -1;
+      unsigned char nArgument = pData[nIn++];
+      if ((c & COMPRESS_COPY) == COMPRESS_RUN) {
+        memset(pPage + nOut, nArgument, nCount);
+      } else {
+        unsigned int nOffset = nArgument + 1;
+        if (nOffset > nOut) return -1;
+        /* byte by byte, the source may overlap the bytes being written */
+        for (unsigned int n = 0; n < nCount; n++)
+          pPage[nOut + n] = pPage[nOut + n - nOffset];
+      }
+    }
+    nOut += nCount;
+  }
+  return nIn;
+}
+
+/* the injected fault for this data request, 0 for none. A timeout costs
+   the host's timeout, a short write the packets that made it. */
+int CEmulator::injectFault(int nLength, unsigned int nTimeout) {
+  m_nDatarequests++;
+  if (m_nUnplugrate != 0 && m_nDatarequests % m_nUnplugrate == 0) {
+    m_bUnplugged = true;
+    m_nUnplugtime = m_nTime;
+    m_nFaults++;
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if (m_nTimeoutrate != 0 && m_nDatarequests % m_nTimeoutrate == 0) {
+    m_nTime += (unsigned long long) nTimeout * 1000;
+    m_nFaults++;
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  if (m_nStallrate != 0 && m_nDatarequests % m_nStallrate == 0) {
+    m_nFaults++;
+    return LIBUSB_ERROR_PIPE;
+  }
+  if (m_nShortrate != 0 && m_nDatarequests % m_nShortrate == 0 && nLength > 1) {
+    m_nTime += (unsigned long long) ((nLength / 2 + m_nMaxpacket - 1) / m_nMaxpacket)
+        * m_nPackettime;
+    m_nFaults++;
+    return nLength / 2;
+  }
+  return 0;
+}
+
+/* one vendor request as the firmware handles it: number of data bytes,
+   LIBUSB_ERROR_PIPE where the firmware stalls or LIBUSB_ERROR_TIMEOUT if it
+   takes longer than the host waits (nTimeout ms). The firmware may have
+   programmed the pages of a request that timed out. */
+int CEmulator::controlTransfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+    uint16_t wIndex, unsigned char* data, uint16_t wLength, unsigned int nTimeout) {
+  /* like Linux usbfs, which takes at most USBBOOT_MAXCONTROL bytes */
+  if (wLength > USBBOOT_MAXCONTROL) return LIBUSB_ERROR_INVALID_PARAM;
+
+  unsigned long long nStart = m_nTime;
+  int nResult = handleRequest(bmRequestType, bRequest, wValue, wIndex, data, wLength,
+                              nTimeout);
+  if (m_nTime - nStart > (unsigned long long) nTimeout * 1000) {
+    m_nTime = nStart + (unsigned long long) nTimeout * 1000;
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  return nResult;
+}
+
+int CEmulator::handleRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+    uint16_t wIndex, unsigned char* data, uint16_t wLength, unsigned int nTimeout) {
+  /* legacy bootloaders know no wIndex, pages beyond 64 kB wrap */
+  unsigned int nAddress = m_nVersion == 0 ? wValue : ((unsigned int) wIndex << 16) | wValue;
+  int nResult = LIBUSB_ERROR_PIPE;
+
+  if (m_bUnplugged) return LIBUSB_ERROR_NO_DEVICE;
+  m_nTransfers++;
+  m_nTime += m_nTransfertime;
+
+  switch (bRequest) {
+  case USBBOOT_FUNC_WRITE_PAGE:
+  case USBBOOT_FUNC_WRITE_BATCH:
+  case USBBOOT_FUNC_WRITE_COMPRESSED:
+  case USBBOOT_FUNC_COPY_PAGES:
+  case USBBOOT_FUNC_WRITE_PARTIAL:
+  case USBBOOT_FUNC_BULK_BEGIN:
+    if ((nResult = injectFault(wLength, nTimeout)) != 0) return nResult;
+    nResult = LIBUSB_ERROR_PIPE;
+    break;
+  }
+
+  switch (bRequest) {
+  case USBBOOT_FUNC_LEAVE_BOOT:
+    m_nStarts++;
+    nResult = 0;
+    break;
+  case USBBOOT_FUNC_GET_PAGESIZE:
+    if (wLength < 2) break;
+    data[0] = m_nPagesize >> 8;
+    data[1] = m_nPagesize & 0xff;
+    nResult = 2;
+    break;
+  case USBBOOT_FUNC_GET_INFO:
+    if (m_nVersion == 0 || wLength < USBBOOT_INFOSIZE) break;
+    data[0] = m_nVersion;
+    data[1] = (m_nBatchsize ? USBBOOT_FEATURE_BATCH : 0)
+        | (m_bCompress ? USBBOOT_FEATURE_COMPRESS : 0)
+        | (m_nBulkendpoint ? USBBOOT_FEATURE_BULK : 0)
+        | (m_bCopy ? USBBOOT_FEATURE_COPY : 0)
+        | (m_bPartial ? USBBOOT_FEATURE_PARTIAL : 0)
+        | (m_bCRC ? USBBOOT_FEATURE_CRC : 0)
+        | (m_bRead ? USBBOOT_FEATURE_READ : 0);
+    putLE(data + 2, m_nPagesize, 2);
+    putLE(data + 4, m_vFlash.size(), 4);
+    putLE(data + 8, getBootstart(), 4);
+    data[12] = m_nBatchsize ? m_nBatchsize : 1;
+    nResult = USBBOOT_INFOSIZE;
+    break;
+  case USBBOOT_FUNC_GET_BATCHSIZE:
+    if (wLength < 1 || m_nBatchsize == 0) break;
+    data[0] = m_nBatchsize;
+    nResult = 1;
+    break;
+  case USBBOOT_FUNC_WRITE_PAGE:
+    if (wLength != m_nPagesize || programPages(nAddress, data, 1) < 0) break;
+    nResult = wLength;
+    break;
+  case USBBOOT_FUNC_WRITE_PARTIAL:
+    if (!m_bPartial || wLength > m_nPagesize) break;
+    m_vDecoded.assign(m_nPagesize, 0xff);
+    memcpy(&m_vDecoded[0], data, wLength);
+    if (programPages(nAddress, &m_vDecoded[0], 1) < 0) break;
+    nResult = wLength;
+    break;
+  case USBBOOT_FUNC_WRITE_BATCH: {
+    if (m_nBatchsize == 0 || wLength < USBBOOT_BATCHHEADER || data[0] == 0
+        || data[0] > m_nBatchsize) break;
+    unsigned int nFull = USBBOOT_BATCHHEADER + data[0] * m_nPagesize;
+    /* with the partial feature the last page may end short */
+    if (wLength > nFull || (wLength < nFull
+        && (!m_bPartial || wLength < nFull - m_nPagesize))) break;
+    m_vDecoded.assign(data[0] * m_nPagesize, 0xff);
+    memcpy(&m_vDecoded[0], data + USBBOOT_BATCHHEADER, wLength - USBBOOT_BATCHHEADER);
+    if (programPages(nAddress, &m_vDecoded[0], data[0]) < 0) break;
+    nResult = wLength;
+    break;
+  }
+  case USBBOOT_FUNC_WRITE_COMPRESSED: {
+    unsigned int nPages = wLength >= USBBOOT_BATCHHEADER ? data[0] : 0;
+    if (!m_bCompress || nPages == 0 || nPages > (m_nBatchsize ? m_nBatchsize : 1)) break;
+    m_vDecoded.resize(nPages * m_nPagesize);
+    unsigned int nIn = USBBOOT_BATCHHEADER;
+    unsigned int n;
+    for (n = 0; n < nPages; n++) {
+      int nUsed = decodePage(data + nIn, wLength - nIn, &m_vDecoded[n * m_nPagesize]);
+      if (nUsed < 0) break;
+      nIn += nUsed;
+    }
+    if (n < nPages || nIn != wLength
+        || programPages(nAddress, &m_vDecoded[0], nPages) < 0) break;
+    nResult = wLength;
+    break;
+  }
+  case USBBOOT_FUNC_READ_PAGE:
+    if (!m_bRead || wLength != m_nPagesize || nAddress % m_nPagesize != 0
+        || nAddress > m_vFlash.size() - m_nPagesize) break;
+    memcpy(data, &m_vFlash[nAddress], m_nPagesize);
+    nResult = wLength;
+    break;
+  case USBBOOT_FUNC_GET_CRC: {
+    if (!m_bCRC || wLength < 2 || nAddress % m_nPagesize != 0
+        || nAddress > m_vFlash.size() - m_nPagesize) break;
+    /* _crc16_update() of avr-libc over the page */
+    unsigned short nCRC = 0xffff;
+    for (unsigned int n = 0; n < m_nPagesize; n++) {
+      nCRC ^= m_vFlash[nAddress + n];
+      for (int nBit = 0; nBit < 8; nBit++)
+        nCRC = (nCRC & 1) ? (nCRC >> 1) ^ 0xa001 : nCRC >> 1;
+    }
+    data[0] = nCRC & 0xff;
+    data[1] = nCRC >> 8;
+    nResult = 2;
+    break;
+  }
+  case USBBOOT_FUNC_COPY_PAGES: {
+    if (!m_bCopy || wLength != USBBOOT_COPYSIZE || data[4] == 0) break;
+    unsigned int nSource = data[0] | (data[1] << 8) | (data[2] << 16)
+        | ((unsigned int) data[3] << 24);
+    unsigned int nPages = data[4];
+    if (nSource % m_nPagesize != 0 || nSource > getBootstart()
+        || nPages * m_nPagesize > getBootstart() - nSource) break;
+    /* page by page through the page buffer, as the firmware does */
+    m_vDecoded.resize(m_nPagesize);
+    unsigned int n;
+    for (n = 0; n < nPages; n++) {
+      memcpy(&m_vDecoded[0], &m_vFlash[nSource + n * m_nPagesize], m_nPagesize);
+      if (programPages(nAddress + n * m_nPagesize, &m_vDecoded[0], 1) < 0) break;
+    }
+    if (n < nPages) break;
+    nResult = wLength;
+    break;
+  }
+  case USBBOOT_FUNC_BULK_BEGIN:
+    if (m_nBulkendpoint == 0 || wLength != 2) break;
+    m_nBulkaddress = nAddress;
+    m_nBulkpages = data[0] | (data[1] << 8);
+    nResult = wLength;
+    break;
+  }
+
+  if (nResult > 0) {
+    m_nBytes += nResult;
+    m_nTime += (unsigned long long) ((nResult + m_nMaxpacket - 1) / m_nMaxpacket)
+        * m_nPackettime;
+  }
+  return nResult;
+}
+
+/* page data announced by BULK_BEGIN, whole pages per transfer. The host
+   keeps transfers queued, so only the packets cost bus time. */
+int CEmulator::bulkTransfer(unsigned char endpoint, unsigned char* data, int length,
+    unsigned int nTimeout) {
+  if (m_bUnplugged) return LIBUSB_ERROR_NO_DEVICE;
+  int nFault = injectFault(length, nTimeout);
+  if (nFault != 0) {
+    m_nBulkpages = 0;
+    return nFault;
+  }
+  if (m_nBulkendpoint == 0 || endpoint != m_nBulkendpoint || length <= 0
+      || length % m_nPagesize != 0 || length / m_nPagesize > m_nBulkpages)
+    return LIBUSB_ERROR_PIPE;
+
+  unsigned int nPages = length / m_nPagesize;
+  unsigned long long nStart = m_nTime;
+  m_nTransfers++;
+  m_nBytes += length;
+  m_nTime += (unsigned long long) ((length + EMULATOR_BULKPACKETSIZE - 1)
+      / EMULATOR_BULKPACKETSIZE) * m_nBulkpackettime;
+  if (programPages(m_nBulkaddress, data, nPages) < 0) {
+    m_nBulkpages = 0;
+    return LIBUSB_ERROR_PIPE;
+  }
+  m_nBulkaddress += length;
+  m_nBulkpages -= nPages;
+  if (m_nTime - nStart > (unsigned long long) nTimeout * 1000) {
+    m_nTime = nStart + (unsigned long long) nTimeout * 1000;
+    m_nBulkpages = 0;
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  return length;
+}
+
+/* the host opens the device again: false while an unplugged device has
+   not re-enumerated yet, else plugged in with the bulk state lost */
+bool CEmulator::reconnect() {
+  if (m_bUnplugged && m_nTime - m_nUnplugtime < m_nReenumtime) return false;
+  m_bUnplugged = false;
+  m_nBulkpages = 0;
+  m_nReconnects++;
+  return true;
+}
+
+/* the host waits, e.g. backing off before a retry */
+void CEmulator::idle(unsigned long nMicroseconds) {
+  m_nTime += nMicroseconds;
+}
+
+/* bulk OUT endpoint address, 0 if the device has none */
+int CEmulator::getBulkendpoint() {
+  return m_nBulkendpoint;
+}
+
+const unsigned char* CEmulator::getFlash() {
+  return &m_vFlash[0];
+}
+
+unsigned int CEmulator::getFlashsize() {
+  return m_vFlash.size();
+}
+
+unsigned int CEmulator::getPagesize() {
+  return m_nPagesize;
+}
+
+/* end of the application section */
+unsigned int CEmulator::getBootstart() {
+  return m_nBootstart != 0 && m_nBootstart < m_vFlash.size() ? m_nBootstart : m_vFlash.size();
+}
+
+unsigned long CEmulator::getTransfers() {
+  return m_nTransfers;
+}
+
+unsigned long CEmulator::getPagewrites() {
+  return m_nPagewrites;
+}
+
+/* data bytes moved in both directions */
+unsigned long CEmulator::getBytes() {
+  return m_nBytes;
+}
+
+/* modelled bus and programming time in microseconds */
+unsigned long long CEmulator::getTime() {
+  return m_nTime;
+}
+
+unsigned long CEmulator::getFaults() {
+  return m_nFaults;
+}
+
+unsigned long CEmulator::getReconnects() {
+  return m_nReconnects;
+}
+
+void CEmulator::resetStatistics() {
+  m_nFaults = 0;
+  m_nReconnects = 0;
+  m_nTransfers = 0;
+  m_nPagewrites = 0;
+  m_nBytes = 0;
+  m_nStarts = 0;
+  m_nTime = 0;
+}
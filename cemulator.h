@@ -0,0 +1,102 @@
+/*
+  cemulator.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Host side model of the bootloader: answers the vendor requests like the
+  firmware, keeps the written flash and accounts the time the transfers
+  would take on a low speed device, so protocol changes can be measured
+  without hardware.
+*/
+
+#ifndef _H_CEMULATOR_
+#define _H_CEMULATOR_
+
+#include <vector>
+
+#include "libusb.h"
+
+/* timing model (microseconds) */
+#define EMULATOR_TRANSFERTIME 1000  /* setup stage, status handshake and frame scheduling */
+#define EMULATOR_PACKETTIME   100   /* one data packet */
+#define EMULATOR_PACKETSIZE   8     /* low speed control endpoint */
+#define EMULATOR_PROGRAMTIME  4500  /* erase and program one page */
+#define EMULATOR_BULKPACKETTIME 60  /* one full speed bulk packet, no handshake wait */
+#define EMULATOR_BULKPACKETSIZE 64
+#define EMULATOR_REENUMTIME   200000  /* re-enumeration after a disconnect */
+
+class CEmulator {
+ public:
+  CEmulator();
+  bool parseSpec(const char* spec);
+  int controlTransfer(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                      uint16_t wIndex, unsigned char* data, uint16_t wLength,
+                      unsigned int nTimeout = 5000);
+  int bulkTransfer(unsigned char endpoint, unsigned char* data, int length,
+                   unsigned int nTimeout = 5000);
+  bool reconnect();
+  void idle(unsigned long nMicroseconds);
+  int getBulkendpoint();
+  const unsigned char* getFlash();
+  unsigned int getFlashsize();
+  unsigned int getPagesize();
+  unsigned int getBootstart();
+  unsigned long getTransfers();
+  unsigned long getPagewrites();
+  unsigned long getBytes();
+  unsigned long long getTime();
+  unsigned long getFaults();
+  unsigned long getReconnects();
+  void resetStatistics();
+
+ protected:
+  int handleRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                    uint16_t wIndex, unsigned char* data, uint16_t wLength,
+                    unsigned int nTimeout);
+  int programPages(unsigned int nAddress, const unsigned char* pData, unsigned int nPages);
+  int decodePage(const unsigned char* pData, unsigned int nLength, unsigned char* pPage);
+  int injectFault(int nLength, unsigned int nTimeout);
+
+  /* device */
+  unsigned int m_nVersion;       /* 0: legacy bootloader without GET_INFO */
+  unsigned int m_nPagesize;
+  unsigned int m_nBootstart;     /* 0: no bootloader section in the flash */
+  unsigned int m_nBatchsize;     /* 0: legacy bootloader without WRITE_BATCH */
+  unsigned int m_nBulkendpoint;  /* 0: control endpoint only */
+  bool m_bCompress;              /* decodes WRITE_COMPRESSED */
+  bool m_bCopy;                  /* takes COPY_PAGES */
+  bool m_bPartial;               /* pads short pages with 0xff */
+  bool m_bCRC;                   /* answers GET_CRC */
+  bool m_bRead;                  /* answers READ_PAGE */
+  unsigned int m_nMaxpacket;     /* control endpoint packet size */
+  /* pending BULK_BEGIN */
+  unsigned int m_nBulkaddress;
+  unsigned int m_nBulkpages;
+  std::vector<unsigned char> m_vFlash;
+  std::vector<unsigned char> m_vDecoded;
+
+  /* timing model */
+  unsigned int m_nTransfertime;
+  unsigned int m_nPackettime;
+  unsigned int m_nBulkpackettime;
+
+  /* fault injection: every n-th data request fails, 0 never */
+  unsigned int m_nStallrate;
+  unsigned int m_nTimeoutrate;
+  unsigned int m_nShortrate;
+  unsigned int m_nUnplugrate;
+  unsigned long m_nDatarequests;
+  bool m_bUnplugged;             /* every request fails until reconnect() */
+  unsigned long long m_nUnplugtime;
+  unsigned long m_nReenumtime;   /* until the host can open it again */
+  unsigned int m_nProgramtime;
+
+  /* statistics */
+  unsigned long m_nTransfers;
+  unsigned long m_nPagewrites;
+  unsigned long m_nBytes;
+  unsigned long m_nStarts;
+  unsigned long m_nFaults;
+  unsigned long m_nReconnects;
+  unsigned long long m_nTime;
+};
+
+#endif
@@ -0,0 +1,39 @@
+/*
+  cerror.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Error codes returned by the flashtool classes, so the library can be
+  used in process instead of terminating on the first error.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "cerror.h"
+
+CErrorstate::CErrorstate() {
+  clearError();
+}
+
+/* last error, ERROR_NONE if the last operation succeeded */
+int CErrorstate::getError() {
+  return m_nError;
+}
+
+const char* CErrorstate::getErrormessage() {
+  return m_szError;
+}
+
+/* remember the error and its message, returns nError for convenience */
+int CErrorstate::setError(int nError, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(m_szError, sizeof(m_szError), format, args);
+  va_end(args);
+  m_nError = nError;
+  return nError;
+}
+
+void CErrorstate::clearError() {
+  m_nError = ERROR_NONE;
+  m_szError[0] = 0;
+}
@@ -0,0 +1,40 @@
+/*
+  cerror.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Error codes returned by the flashtool classes, so the library can be
+  used in process instead of terminating on the first error.
+*/
+
+#ifndef _H_CERROR_
+#define _H_CERROR_
+
+#define ERROR_NONE       0
+#define ERROR_FILE      -1   /* input file cannot be opened or read */
+#define ERROR_FORMAT    -2   /* invalid record or file structure */
+#define ERROR_RANGE     -3   /* address outside the flash or address space */
+#define ERROR_OVERLAP   -4   /* inputs overlap with policy "error" */
+#define ERROR_MEMORY    -5   /* out of memory */
+#define ERROR_NODEVICE  -6   /* no bootloader found */
+#define ERROR_TRANSFER  -7   /* USB transfer failed or had a wrong size */
+#define ERROR_ARGUMENT  -8   /* invalid argument or option */
+#define ERROR_VERIFY    -9   /* flash contents differ from the image */
+
+class CErrorstate {
+ public:
+  CErrorstate();
+  int getError();
+  const char* getErrormessage();
+
+ protected:
+  int setError(int nError, const char* format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 3, 4)))
+#endif
+    ;
+  void clearError();
+
+  int m_nError;
+  char m_szError[256];
+};
+
+#endif
@@ -0,0 +1,381 @@
+/*
+  cflasher.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  In process flashing API: keeps the bootloader handle open and the parsed
+  image cached between flash jobs, reports errors by return value and
+  progress through a callback.
+*/
+
+#include "cflasher.h"
+
+CFlasher::CFlasher() {
+  m_pBootloader = NULL;
+  m_nPagesize = 0;
+  m_nBatchlimit = USBBOOT_MAXBATCH;
+  m_bBulkenabled = true;
+  m_bCompressenabled = true;
+  m_bCopyenabled = true;
+  m_nRetries = USBBOOT_RETRIES;
+  m_nRetrydelay = USBBOOT_RETRYDELAY;
+  m_nResumedpages = 0;
+  m_pFlashmem = NULL;
+  m_pFlashpatch = NULL;
+  m_bShared = false;
+  m_pPreloadjob = NULL;
+  m_pPreloaded = NULL;
+}
+
+CFlasher::~CFlasher() {
+  cancelPreload();
+  close();
+  releaseImage();
+}
+
+/* search the bus for a bootloader */
+int CFlasher::open() {
+  return openBootloader(new CBootloader());
+}
+
+/* the bootloader at a bus and port path ("1-2.3") or with a serial number */
+int CFlasher::open(const std::string& selector) {
+  return openBootloader(new CBootloader(selector));
+}
+
+/* use a device opened by the caller (see CBootloader::openDevice), the
+   handle is closed with this object */
+int CFlasher::open(libusb_device_handle* handle) {
+  return openBootloader(new CBootloader(handle));
+}
+
+/* flash an emulated bootloader, e.g. to benchmark the protocol */
+int CFlasher::open(CEmulator* pEmulator) {
+  return openBootloader(new CBootloader(pEmulator));
+}
+
+int CFlasher::openBootloader(CBootloader* pBootloader) {
+  close();
+  clearError();
+
+  pBootloader->setRetries(m_nRetries, m_nRetrydelay);
+  if (!pBootloader->isOpen() || (m_nPagesize = pBootloader->getPagesize()) == 0) {
+    setError(pBootloader->getError(), "%s", pBootloader->getErrormessage());
+    delete pBootloader;
+    return m_nError;
+  }
+  m_pBootloader = pBootloader;
+  m_pBootloader->setBatchlimit(m_nBatchlimit);
+  m_pBootloader->setBulkenabled(m_bBulkenabled);
+  m_pBootloader->setCompressenabled(m_bCompressenabled);
+  m_pBootloader->setCopyenabled(m_bCopyenabled);
+  return ERROR_NONE;
+}
+
+void CFlasher::close() {
+  delete m_pBootloader;
+  m_pBootloader = NULL;
+  m_nPagesize = 0;
+}
+
+bool CFlasher::isOpen() {
+  return m_pBootloader != NULL;
+}
+
+unsigned int CFlasher::getPagesize() {
+  return m_nPagesize;
+}
+
+/* what the bootloader reported about itself, NULL with the error set if
+   not open or the bootloader does not answer */
+const SBootinfo* CFlasher::getInfo() {
+  if (m_pBootloader == NULL) {
+    setError(ERROR_NODEVICE, "No bootloader opened!");
+    return NULL;
+  }
+  const SBootinfo* pInfo = m_pBootloader->getInfo();
+  if (pInfo == NULL)
+    setError(m_pBootloader->getError(), "%s", m_pBootloader->getErrormessage());
+  return pInfo;
+}
+
+/* pages per write request, 1 for bootloaders without batch support */
+unsigned int CFlasher::getBatchsize() {
+  return m_pBootloader != NULL ? m_pBootloader->getBatchsize() : 0;
+}
+
+/* 1 forces single page writes */
+void CFlasher::setBatchlimit(unsigned int nLimit) {
+  m_nBatchlimit = nLimit;
+  if (m_pBootloader != NULL) m_pBootloader->setBatchlimit(nLimit);
+}
+
+/* false keeps the page data on the control pipe even if the bootloader
+   has a bulk endpoint */
+void CFlasher::setBulkenabled(bool bEnabled) {
+  m_bBulkenabled = bEnabled;
+  if (m_pBootloader != NULL) m_pBootloader->setBulkenabled(bEnabled);
+}
+
+/* false sends pages uncoded to bootloaders that decode compressed writes */
+void CFlasher::setCompressenabled(bool bEnabled) {
+  m_bCompressenabled = bEnabled;
+  if (m_pBootloader != NULL) m_pBootloader->setCompressenabled(bEnabled);
+}
+
+/* false writes duplicate pages instead of copying them on the device */
+void CFlasher::setCopyenabled(bool bEnabled) {
+  m_bCopyenabled = bEnabled;
+  if (m_pBootloader != NULL) m_pBootloader->setCopyenabled(bEnabled);
+}
+
+/* failed requests are repeated up to nLimit times with exponential
+   backoff from nDelay ms; 0 fails on the first error */
+void CFlasher::setRetries(unsigned int nLimit, unsigned int nDelay) {
+  m_nRetries = nLimit;
+  m_nRetrydelay = nDelay;
+  if (m_pBootloader != NULL) m_pBootloader->setRetries(nLimit, nDelay);
+}
+
+/* page data goes over the bulk endpoint */
+bool CFlasher::isBulk() {
+  return m_pBootloader != NULL && m_pBootloader->getBulkendpoint() > 0;
+}
+
+/* Start parsing the job's inputs on a worker thread, e.g. before open()
+   searches the bus; the next flash() of the job waits for it and pages
+   the image for the device. Shared images are keyed by the page size and
+   parsed in flash() as before. */
+void CFlasher::preload(CFlashjob* pJob) {
+  cancelPreload();
+  if (pJob->isShared() || !pJob->hasInputs()) return;
+
+  m_pPreloadjob = pJob;
+  m_preloader = std::thread([this, pJob]() {
+    m_pPreloaded = pJob->loadImage(FLASHER_PARSEPAGESIZE);
+  });
+}
+
+/* wait for the worker, drop what it parsed */
+void CFlasher::cancelPreload() {
+  if (m_preloader.joinable()) m_preloader.join();
+  delete m_pPreloaded;
+  m_pPreloaded = NULL;
+  m_pPreloadjob = NULL;
+}
+
+/* the image preload() parsed for the job, paged for the device */
+int CFlasher::takePreload(CFlashjob* pJob) {
+  m_preloader.join();
+  CFlashmem* pFlashmem = m_pPreloaded;
+  m_pPreloaded = NULL;
+  m_pPreloadjob = NULL;
+  if (pFlashmem == NULL)
+    return setError(pJob->getError(), "%s", pJob->getErrormessage());
+
+  if (pFlashmem->getPagesize() != m_nPagesize) {
+    CFlashmem* pPaged = pJob->repage(pFlashmem, m_nPagesize);
+    delete pFlashmem;
+    if ((pFlashmem = pPaged) == NULL)
+      return setError(pJob->getError(), "%s", pJob->getErrormessage());
+  }
+
+  releaseImage();
+  m_bShared = false;
+  m_pFlashmem = pFlashmem;
+  m_pFlashpatch = new CFlashpatch(m_pFlashmem);
+  m_sImagekey = pJob->getImagekey(m_nPagesize);
+  return ERROR_NONE;
+}
+
+void CFlasher::releaseImage() {
+  delete m_pFlashpatch;
+  m_pFlashpatch = NULL;
+#ifndef _WIN32
+  if (m_bShared) {
+    /* the shared image owns its pages */
+    m_sharedimage.detach();
+    m_pFlashmem = NULL;
+  }
+#endif
+  delete m_pFlashmem;
+  m_pFlashmem = NULL;
+  m_sImagekey.clear();
+}
+
+/* parse the job's image unless the cached one has the same key */
+int CFlasher::loadImage(CFlashjob* pJob) {
+  if (pJob == m_pPreloadjob) return takePreload(pJob);
+
+  std::string key = pJob->getImagekey(m_nPagesize);
+  if (m_pFlashmem != NULL && key == m_sImagekey && pJob->isShared() == m_bShared)
+    return ERROR_NONE;
+
+  releaseImage();
+  m_bShared = pJob->isShared();
+#ifndef _WIN32
+  if (m_bShared) {
+    CFlashmem* pFlashmem = m_sharedimage.attach(pJob, m_nPagesize);
+    if (pFlashmem == NULL)
+      return setError(pJob->getError(), "%s", pJob->getErrormessage());
+    m_pFlashpatch = new CFlashpatch(pFlashmem);
+    m_pFlashmem = pFlashmem;
+    m_sImagekey = key;
+    return ERROR_NONE;
+  }
+#endif
+  if ((m_pFlashmem = pJob->loadImage(m_nPagesize)) == NULL)
+    return setError(pJob->getError(), "%s", pJob->getErrormessage());
+  m_pFlashpatch = new CFlashpatch(m_pFlashmem);
+  m_sImagekey = key;
+  return ERROR_NONE;
+}
+
+/* load (or reuse) the image of the job, apply its patches and write it */
+int CFlasher::flash(CFlashjob* pJob, TProgresscallback pfnProgress, void* pUser) {
+  clearError();
+  if (m_pBootloader == NULL)
+    return setError(ERROR_NODEVICE, "No bootloader opened!");
+  if (!pJob->hasInputs())
+    return setError(ERROR_ARGUMENT, "No input file!");
+
+  if (loadImage(pJob) < 0) return m_nError;
+  if (pJob->applyPatches(m_pFlashpatch) < 0)
+    return setError(pJob->getError(), "%s", pJob->getErrormessage());
+
+  m_pBootloader->resetStatistics();
+  m_nResumedpages = 0;
+  if (pJob->getJournal().empty()) {
+    if (CFlashjob::flash(m_pBootloader, m_pFlashpatch, pfnProgress, pUser) < 0)
+      return setError(m_pBootloader->getError(), "%s", m_pBootloader->getErrormessage());
+    return ERROR_NONE;
+  }
+
+  CJournal journal;
+  unsigned long long nImagehash = CJournal::hashImage(m_pFlashpatch);
+  std::string device = m_pBootloader->getIdentity();
+  if (pJob->isResume()) m_nResumedpages = findResumepoint(pJob, nImagehash, device);
+  if (journal.begin(pJob->getJournal().c_str(), nImagehash, device, m_nResumedpages) < 0)
+    return setError(journal.getError(), "%s", journal.getErrormessage());
+
+  if (CFlashjob::flash(m_pBootloader, m_pFlashpatch, pfnProgress, pUser, &journal,
+      m_nResumedpages) < 0)
+    return setError(m_pBootloader->getError(), "%s", m_pBootloader->getErrormessage());
+  if (journal.finish() < 0)
+    return setError(journal.getError(), "%s", journal.getErrormessage());
+  return ERROR_NONE;
+}
+
+/* pages of an interrupted run that need not be written again: all the
+   journal confirms if it is for this image and device and the first and
+   last of them verify on the device, else 0 */
+unsigned int CFlasher::findResumepoint(CFlashjob* pJob, unsigned long long nImagehash,
+    const std::string& device) {
+  CJournal journal;
+  if (!journal.load(pJob->getJournal().c_str()) || journal.getImagehash() != nImagehash
+      || journal.getDevice() != device || journal.getPages() == 0
+      || journal.getPages() > m_pFlashpatch->getPagecount()
+      || !m_pBootloader->canVerify())
+    return 0;
+
+  CPage* pFirst = m_pFlashpatch->getFirstpage();
+  CPage* pLast = pFirst;
+  for (unsigned int n = 1; n < journal.getPages(); n++)
+    pLast = m_pFlashpatch->getNextpage(pLast);
+  if (m_pBootloader->verifyPage(pFirst) != 1 || m_pBootloader->verifyPage(pLast) != 1)
+    return 0;
+  return journal.getPages();
+}
+
+/* compare every page of the last job with the flash (by CRC or by
+   reading it back) */
+int CFlasher::verify() {
+  clearError();
+  if (m_pBootloader == NULL)
+    return setError(ERROR_NODEVICE, "No bootloader opened!");
+  if (m_pFlashpatch == NULL)
+    return setError(ERROR_ARGUMENT, "Nothing flashed to verify!");
+  if (!m_pBootloader->canVerify())
+    return setError(ERROR_ARGUMENT, "Bootloader can neither checksum nor read its flash!");
+
+  for (CPage* pPage = m_pFlashpatch->getFirstpage(); pPage != NULL;
+       pPage = m_pFlashpatch->getNextpage(pPage)) {
+    int nResult = m_pBootloader->verifyPage(pPage);
+    if (nResult < 0)
+      return setError(m_pBootloader->getError(), "%s", m_pBootloader->getErrormessage());
+    if (nResult == 0)
+      return setError(ERROR_VERIFY, "Page at 0x%x differs from the image!",
+                      pPage->getPageaddress());
+  }
+  return ERROR_NONE;
+}
+
+int CFlasher::startApplication() {
+  clearError();
+  if (m_pBootloader == NULL)
+    return setError(ERROR_NODEVICE, "No bootloader opened!");
+  if (m_pBootloader->startApplication() < 0)
+    return setError(m_pBootloader->getError(), "%s", m_pBootloader->getErrormessage());
+  return ERROR_NONE;
+}
+
+/* pages written by the last flash job */
+unsigned int CFlasher::getPagecount() {
+  return m_pFlashpatch != NULL ? m_pFlashpatch->getPagecount() : 0;
+}
+
+unsigned int CFlasher::getPatchedpages() {
+  return m_pFlashpatch != NULL ? m_pFlashpatch->getPatchedpages() : 0;
+}
+
+/* pages of the last flash job skipped because the journal of an
+   interrupted run confirmed them */
+unsigned int CFlasher::getResumedpages() {
+  return m_nResumedpages;
+}
+
+/* page bytes of the last flash job */
+unsigned long CFlasher::getPagebytes() {
+  return m_pBootloader != NULL ? m_pBootloader->getPagebytes() : 0;
+}
+
+/* page data bytes the last flash job put on the bus, after compression */
+unsigned long CFlasher::getSentbytes() {
+  return m_pBootloader != NULL ? m_pBootloader->getSentbytes() : 0;
+}
+
+/* duplicate pages of the last flash job copied on the device */
+unsigned long CFlasher::getCopiedpages() {
+  return m_pBootloader != NULL ? m_pBootloader->getCopiedpages() : 0;
+}
+
+/* bytes the copies kept off the bus */
+unsigned long CFlasher::getCopysaving() {
+  return m_pBootloader != NULL ? m_pBootloader->getCopysaving() : 0;
+}
+
+/* retried requests of the last flash job, those that then succeeded and
+   how often the device was opened again */
+unsigned long CFlasher::getRetries() {
+  return m_pBootloader != NULL ? m_pBootloader->getRetries() : 0;
+}
+
+unsigned long CFlasher::getRecoveries() {
+  return m_pBootloader != NULL ? m_pBootloader->getRecoveries() : 0;
+}
+
+unsigned long CFlasher::getReopens() {
+  return m_pBootloader != NULL ? m_pBootloader->getReopens() : 0;
+}
+
+/* microseconds per page within which nPercent of the recent writes
+   completed; the request timeouts follow it */
+unsigned long CFlasher::getWritelatency(unsigned int nPercent) {
+  return m_pBootloader != NULL ? m_pBootloader->getWritelatency(nPercent) : 0;
+}
+
+/* processes using the shared image, 0 if the image is not shared */
+unsigned int CFlasher::getSharedusers() {
+#ifndef _WIN32
+  if (m_bShared && m_pFlashmem != NULL) return m_sharedimage.getRefcount();
+#endif
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+  cflasher.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  In process flashing API: keeps the bootloader handle open and the parsed
+  image cached between flash jobs, reports errors by return value and
+  progress through a callback.
+*/
+
+#ifndef _H_CFLASHER_
+#define _H_CFLASHER_
+
+#include <string>
+#include <thread>
+
+#include "cflashjob.h"
+#include "cerror.h"
+#include "cemulator.h"
+#ifndef _WIN32
+#include "csharedimage.h"
+#endif
+
+/* page size an image is parsed with before the device reports its own: it
+   divides the page size of every AVR with self programming, so repaging
+   keeps the page order */
+#define FLASHER_PARSEPAGESIZE 32
+
+class CFlasher : public CErrorstate {
+ public:
+  CFlasher();
+  ~CFlasher();
+  int open();
+  int open(const std::string& selector);
+  int open(libusb_device_handle* handle);
+  int open(CEmulator* pEmulator);
+  void close();
+  void preload(CFlashjob* pJob);
+  bool isOpen();
+  unsigned int getPagesize();
+  const SBootinfo* getInfo();
+  unsigned int getBatchsize();
+  void setBatchlimit(unsigned int nLimit);
+  void setBulkenabled(bool bEnabled);
+  void setCompressenabled(bool bEnabled);
+  void setCopyenabled(bool bEnabled);
+  void setRetries(unsigned int nLimit, unsigned int nDelay);
+  bool isBulk();
+  int flash(CFlashjob* pJob, TProgresscallback pfnProgress, void* pUser);
+  int verify();
+  int startApplication();
+  unsigned int getPagecount();
+  unsigned int getPatchedpages();
+  unsigned int getResumedpages();
+  unsigned long getPagebytes();
+  unsigned long getSentbytes();
+  unsigned long getCopiedpages();
+  unsigned long getCopysaving();
+  unsigned long getRetries();
+  unsigned long getRecoveries();
+  unsigned long getReopens();
+  unsigned long getWritelatency(unsigned int nPercent);
+  unsigned int getSharedusers();
+
+ protected:
+  int openBootloader(CBootloader* pBootloader);
+  int loadImage(CFlashjob* pJob);
+  unsigned int findResumepoint(CFlashjob* pJob, unsigned long long nImagehash,
+                               const std::string& device);
+  void releaseImage();
+  int takePreload(CFlashjob* pJob);
+  void cancelPreload();
+
+  CBootloader* m_pBootloader;
+  unsigned int m_nPagesize;
+  unsigned int m_nBatchlimit;
+  bool m_bBulkenabled;
+  bool m_bCompressenabled;
+  bool m_bCopyenabled;
+  unsigned int m_nRetries;
+  unsigned int m_nRetrydelay;
+  unsigned int m_nResumedpages;
+
+  /* image of the last job, reused while its key does not change */
+  CFlashmem* m_pFlashmem;
+  CFlashpatch* m_pFlashpatch;
+  std::string m_sImagekey;
+  bool m_bShared;
+#ifndef _WIN32
+  CSharedimage m_sharedimage;
+#endif
+
+  /* image parsed on a worker thread while the device is searched */
+  std::thread m_preloader;
+  CFlashjob* m_pPreloadjob;
+  CFlashmem* m_pPreloaded;
+};
+
+#endif
@@ -0,0 +1,341 @@
+/*
+  cflashjob.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  One flash job: the input images with their options and the per device
+  patches, as given on the command line or sent to the daemon.
+*/
+
+#include <sys/stat.h>
+#include <limits.h>
+#include <unordered_map>
+
+#include "cflashjob.h"
+
+CFlashjob::CFlashjob() {
+  m_nFlashsize = 0;
+  m_nBaseaddress = 0;
+  m_nOverlappolicy = OVERLAP_LAST;
+  m_nCSVrow = 1;
+  m_bShared = false;
+  m_bResume = false;
+}
+
+void CFlashjob::usage() {
+  fprintf(stderr, "  filename        Intel HEX, Motorola S-record, ELF or raw .bin image;\n");
+  fprintf(stderr, "                  several files are merged into one image\n");
+  fprintf(stderr, "  -f flashsize    use one dense image buffer of flashsize bytes\n");
+  fprintf(stderr, "  -p policy       where files overlap: the last (default) or first file\n");
+  fprintf(stderr, "                  wins, or overlapping is an error\n");
+  fprintf(stderr, "  -b baseaddress  load address of the following raw .bin files (default 0)\n");
+  fprintf(stderr, "  -P addr=hex     patch bytes into the image for this device, e.g. serial numbers\n");
+  fprintf(stderr, "  -c file.csv     patch from a CSV file: header row addresses, one row per device\n");
+  fprintf(stderr, "  -r row          CSV data row to use (default 1)\n");
+  fprintf(stderr, "  -J journal      record the written pages, removed when the job completes\n");
+  fprintf(stderr, "  -R, --resume    continue an interrupted job from its journal after\n");
+  fprintf(stderr, "                  verifying the last written page\n");
+#ifndef _WIN32
+  fprintf(stderr, "  -S              share the parsed image with concurrent processes\n");
+#endif
+}
+
+/* consume the image option or file name at argv[i], false if unknown */
+bool CFlashjob::parseOption(int argc, char** argv, int& i) {
+  if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+    m_nFlashsize = strtoul(argv[++i], NULL, 0);
+  } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+    m_nBaseaddress = strtoul(argv[++i], NULL, 0);
+  } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+    i++;
+    if (strcmp(argv[i], "last") == 0) m_nOverlappolicy = OVERLAP_LAST;
+    else if (strcmp(argv[i], "first") == 0) m_nOverlappolicy = OVERLAP_FIRST;
+    else if (strcmp(argv[i], "error") == 0) m_nOverlappolicy = OVERLAP_ERROR;
+    else return false;
+  } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+    m_vPatches.push_back(argv[++i]);
+  } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+    m_sCSVfile = argv[++i];
+  } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+    m_nCSVrow = strtoul(argv[++i], NULL, 0);
+  } else if (strcmp(argv[i], "-J") == 0 && i + 1 < argc) {
+    m_sJournal = argv[++i];
+  } else if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--resume") == 0) {
+    m_bResume = true;
+#ifndef _WIN32
+  } else if (strcmp(argv[i], "-S") == 0) {
+    m_bShared = true;
+#endif
+  } else if (argv[i][0] != '-') {
+    SInput input = { argv[i], m_nBaseaddress };
+    m_vInputs.push_back(input);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool CFlashjob::hasInputs() {
+  return !m_vInputs.empty();
+}
+
+bool CFlashjob::isShared() {
+  return m_bShared;
+}
+
+/* journal file, empty without -J */
+const std::string& CFlashjob::getJournal() {
+  return m_sJournal;
+}
+
+bool CFlashjob::isResume() {
+  return m_bResume;
+}
+
+/* identifies the loaded image: options and files, with bSourcestate also
+   size, mtime and inode of the files so a changed file changes the key */
+std::string CFlashjob::getImagekey(unsigned int pagesize, bool bSourcestate) {
+  char buffer[96];
+  snprintf(buffer, sizeof(buffer), "%u/%u/%d", pagesize, m_nFlashsize, m_nOverlappolicy);
+  std::string key = buffer;
+
+  for (size_t n = 0; n < m_vInputs.size(); n++) {
+    const char* filename = m_vInputs[n].filename.c_str();
+#ifndef _WIN32
+    char path[PATH_MAX];
+    if (realpath(filename, path) != NULL) filename = path;
+#endif
+    snprintf(buffer, sizeof(buffer), "|%x|", m_vInputs[n].baseaddress);
+    key += buffer;
+    key += filename;
+
+    if (bSourcestate) {
+      struct stat st;
+      if (stat(filename, &st) != 0)
+        memset(&st, 0, sizeof(st));
+      snprintf(buffer, sizeof(buffer), "|%lld/%lld/%lld", (long long) st.st_size,
+          (long long) st.st_mtime, (long long) st.st_ino);
+      key += buffer;
+    }
+  }
+  return key;
+}
+
+static bool hasExtension(const char* filename, const char* extension) {
+  size_t nName = strlen(filename);
+  size_t nExt = strlen(extension);
+  return nName >= nExt && strcasecmp(filename + nName - nExt, extension) == 0;
+}
+
+enum EFileformat { FORMAT_IHEX, FORMAT_SREC, FORMAT_ELF, FORMAT_BIN };
+
+/* guess the image format from the first bytes of the file */
+static EFileformat detectFormat(const char* filename) {
+  unsigned char magic[4];
+  size_t nMagic = 0;
+
+  FILE* fp = fopen(filename, "rb");
+  if (fp != NULL) {
+    nMagic = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+  }
+
+  if (nMagic == 4 && memcmp(magic, "\177ELF", 4) == 0) return FORMAT_ELF;
+  if (hasExtension(filename, ".bin")) return FORMAT_BIN;
+  if (nMagic >= 2 && magic[0] == 'S' && magic[1] >= '0' && magic[1] <= '9') return FORMAT_SREC;
+  return FORMAT_IHEX;
+}
+
+/* parse all inputs into a new image, NULL on error */
+CFlashmem* CFlashjob::loadImage(unsigned int pagesize) {
+  CFlashmem* flashmem;
+  clearError();
+  if (m_nFlashsize > 0)
+    flashmem = new CFlashmem(pagesize, m_nFlashsize);
+  else
+    flashmem = new CFlashmem(pagesize);
+
+  flashmem->setOverlappolicy(m_nOverlappolicy);
+  for (size_t n = 0; n < m_vInputs.size(); n++) {
+    char* filename = (char*) m_vInputs[n].filename.c_str();
+
+    int nResult;
+    switch (detectFormat(filename)) {
+    case FORMAT_ELF:  nResult = flashmem->readFromELF(filename); break;
+    case FORMAT_BIN:  nResult = flashmem->readFromBIN(filename, m_vInputs[n].baseaddress); break;
+    case FORMAT_SREC: nResult = flashmem->readFromSREC(filename); break;
+    default:          nResult = flashmem->readFromIHEX(filename); break;
+    }
+    if (nResult < 0) {
+      setError(nResult, "%s", flashmem->getErrormessage());
+      delete flashmem;
+      return NULL;
+    }
+
+    if (flashmem->getOverlapbytes() > 0)
+      printf("%s: %d bytes overlap earlier data\n", filename,
+          flashmem->getOverlapbytes());
+  }
+
+  return flashmem;
+}
+
+/* the image again with pages of pagesize bytes, e.g. after it was parsed
+   before the device reported its page size; NULL on error. Only the
+   bytes the inputs wrote are carried over. Pages come in the order their
+   first byte was written, so an image parsed with a page size that
+   divides pagesize lists its pages as if parsed with pagesize. */
+CFlashmem* CFlashjob::repage(CFlashmem* pFlashmem, unsigned int pagesize) {
+  CFlashmem* flashmem;
+  clearError();
+  if (m_nFlashsize > 0)
+    flashmem = new CFlashmem(pagesize, m_nFlashsize);
+  else
+    flashmem = new CFlashmem(pagesize);
+
+  for (CPage* pPage = pFlashmem->getFirstpage(); pPage != NULL; pPage = pPage->getNext()) {
+    unsigned int nSize = pPage->getPagesize();
+    unsigned int nOffset = 0;
+    while (nOffset < nSize) {
+      unsigned int nEnd = nOffset;
+      if (nOffset == 0 && pPage->countCovered(0, nSize) == nSize)
+        nEnd = nSize;
+      while (nEnd < nSize && pPage->isCovered(nEnd)) nEnd++;
+      if (nEnd > nOffset && flashmem->insertBlock(pPage->getPageaddress() + nOffset,
+          pPage->getData() + nOffset, nEnd - nOffset) < 0) {
+        setError(flashmem->getError(), "%s", flashmem->getErrormessage());
+        delete flashmem;
+        return NULL;
+      }
+      nOffset = nEnd + 1;
+    }
+  }
+  return flashmem;
+}
+
+int CFlashjob::applyPatches(CFlashpatch* pFlashpatch) {
+  clearError();
+  pFlashpatch->clear();
+  if (!m_sCSVfile.empty() && pFlashpatch->readFromCSV((char*) m_sCSVfile.c_str(), m_nCSVrow) < 0)
+    return setError(pFlashpatch->getError(), "%s", pFlashpatch->getErrormessage());
+  for (size_t n = 0; n < m_vPatches.size(); n++) {
+    if (pFlashpatch->parsePatch(m_vPatches[n].c_str()) < 0)
+      return setError(pFlashpatch->getError(), "%s", pFlashpatch->getErrormessage());
+  }
+  return ERROR_NONE;
+}
+
+/* one write request, then the journal learns the pages are on the device */
+static int writeBatch(CBootloader* pBootloader, CJournal* pJournal, CPage** batch,
+    unsigned int nBatch, unsigned int& nDone) {
+  if (pBootloader->writePages(batch, nBatch) < 0) return pBootloader->getError();
+  nDone += nBatch;
+  if (pJournal != NULL) pJournal->confirm(nDone, batch[nBatch - 1]->getPageaddress());
+  return ERROR_NONE;
+}
+
+static int copyRun(CBootloader* pBootloader, CJournal* pJournal, unsigned int nAddress,
+    unsigned int nSource, unsigned int nCopy, unsigned int& nDone) {
+  if (pBootloader->copyPages(nAddress, nSource, nCopy) < 0) return pBootloader->getError();
+  nDone += nCopy;
+  if (pJournal != NULL)
+    pJournal->confirm(nDone, nAddress + (nCopy - 1) * pBootloader->getPagesize());
+  return ERROR_NONE;
+}
+
+/* write all pages, stops at the first failed page; the error is kept in
+   pBootloader. Nothing is written if a page would overwrite the bootloader.
+   Runs of consecutive pages go out in batches where the bootloader
+   supports it, pages identical to one written before are copied on the
+   device if it can. The progress callback comes as a page is queued.
+   The first nSkip pages are taken as written already; pJournal is told
+   about every confirmed request. */
+int CFlashjob::flash(CBootloader* pBootloader, CFlashpatch* pFlashpatch,
+    TProgresscallback pfnProgress, void* pUser, CJournal* pJournal,
+    unsigned int nSkip) {
+  unsigned int nPages = pFlashpatch->getPagecount();
+  CPage* batch[USBBOOT_MAXBATCH];
+  unsigned int nBatch = 0;
+  unsigned int nPage = 0;
+  bool bCopy = pBootloader->canCopy();
+  std::unordered_map<unsigned long long, CPage*> written;
+  std::unordered_map<unsigned int, CPage*> queued;
+  unsigned int nCopy = 0;
+  unsigned int nCopyaddress = 0;
+  unsigned int nCopysource = 0;
+  unsigned int nDone = nSkip;
+
+  CPage* pPage;
+  for (pPage = pFlashpatch->getFirstpage(); pPage != NULL;
+       pPage = pFlashpatch->getNextpage(pPage)) {
+    if (pBootloader->checkRange(pPage->getPageaddress(), pPage->getPagesize()) < 0)
+      return pBootloader->getError();
+  }
+
+  pPage = pFlashpatch->getFirstpage();
+  while (pPage != NULL) {
+    unsigned int nPagesize = pPage->getPagesize();
+    CPage* pSource = NULL;
+    if (bCopy) {
+      /* continue the copy run if the next source page fits (it may be one
+         the run copied itself), else the first page with this content */
+      if (nCopy > 0 && nCopy < USBBOOT_MAXBATCH
+          && pPage->getPageaddress() == nCopyaddress + nCopy * nPagesize) {
+        std::unordered_map<unsigned int, CPage*>::iterator it =
+            queued.find(nCopysource + nCopy * nPagesize);
+        if (it != queued.end()
+            && memcmp(it->second->getData(), pPage->getData(), nPagesize) == 0)
+          pSource = it->second;
+      }
+      std::unordered_map<unsigned long long, CPage*>::iterator it =
+          written.insert(std::make_pair(pPage->getHash(), pPage)).first;
+      if (pSource == NULL && it->second != pPage
+          && memcmp(it->second->getData(), pPage->getData(), nPagesize) == 0)
+        pSource = it->second;
+      queued[pPage->getPageaddress()] = pPage;
+    }
+
+    if (nPage < nSkip) {
+      /* on the device already, still a copy source */
+    } else if (pSource != NULL) {
+      if (nBatch > 0) {
+        if (writeBatch(pBootloader, pJournal, batch, nBatch, nDone) < 0)
+          return pBootloader->getError();
+        nBatch = 0;
+      }
+      if (nCopy > 0 && (nCopy == USBBOOT_MAXBATCH
+          || pPage->getPageaddress() != nCopyaddress + nCopy * nPagesize
+          || pSource->getPageaddress() != nCopysource + nCopy * nPagesize)) {
+        if (copyRun(pBootloader, pJournal, nCopyaddress, nCopysource, nCopy, nDone) < 0)
+          return pBootloader->getError();
+        nCopy = 0;
+      }
+      if (nCopy == 0) {
+        nCopyaddress = pPage->getPageaddress();
+        nCopysource = pSource->getPageaddress();
+      }
+      nCopy++;
+    } else {
+      if (nCopy > 0) {
+        if (copyRun(pBootloader, pJournal, nCopyaddress, nCopysource, nCopy, nDone) < 0)
+          return pBootloader->getError();
+        nCopy = 0;
+      }
+      /* the batch size follows the device's latency, ask every time */
+      if (nBatch > 0 && (nBatch >= pBootloader->getBatchsize()
+          || pPage->getPageaddress() != batch[nBatch - 1]->getPageaddress() + nPagesize)) {
+        if (writeBatch(pBootloader, pJournal, batch, nBatch, nDone) < 0)
+          return pBootloader->getError();
+        nBatch = 0;
+      }
+      batch[nBatch++] = pPage;
+    }
+    if (pfnProgress != NULL && nPage >= nSkip) pfnProgress(pUser, nPage, nPages, pPage);
+    nPage++;
+    pPage = pFlashpatch->getNextpage(pPage);
+  }
+  if (nBatch > 0 && writeBatch(pBootloader, pJournal, batch, nBatch, nDone) < 0)
+    return pBootloader->getError();
+  if (nCopy > 0 && copyRun(pBootloader, pJournal, nCopyaddress, nCopysource, nCopy,
+      nDone) < 0)
+    return pBootloader->getError();
+  return ERROR_NONE;
+}
@@ -0,0 +1,59 @@
+/*
+  cflashjob.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  One flash job: the input images with their options and the per device
+  patches, as given on the command line or sent to the daemon.
+*/
+
+#ifndef _H_CFLASHJOB_
+#define _H_CFLASHJOB_
+
+#include <string>
+#include <vector>
+
+#include "cflashmem.h"
+#include "cflashpatch.h"
+#include "cbootloader.h"
+#include "cjournal.h"
+#include "cerror.h"
+
+/* called before every page write */
+typedef void (*TProgresscallback)(void* pUser, unsigned int nPage,
+                                  unsigned int nPages, CPage* pPage);
+
+class CFlashjob : public CErrorstate {
+ public:
+  CFlashjob();
+  bool parseOption(int argc, char** argv, int& i);
+  bool hasInputs();
+  bool isShared();
+  const std::string& getJournal();
+  bool isResume();
+  std::string getImagekey(unsigned int pagesize, bool bSourcestate = true);
+  CFlashmem* loadImage(unsigned int pagesize);
+  CFlashmem* repage(CFlashmem* pFlashmem, unsigned int pagesize);
+  int applyPatches(CFlashpatch* pFlashpatch);
+  static int flash(CBootloader* pBootloader, CFlashpatch* pFlashpatch,
+                   TProgresscallback pfnProgress, void* pUser,
+                   CJournal* pJournal = NULL, unsigned int nSkip = 0);
+  static void usage();
+
+ protected:
+  struct SInput {
+    std::string filename;
+    unsigned int baseaddress;
+  };
+
+  unsigned int m_nFlashsize;
+  unsigned int m_nBaseaddress;
+  EOverlappolicy m_nOverlappolicy;
+  std::vector<SInput> m_vInputs;
+  std::vector<std::string> m_vPatches;
+  std::string m_sCSVfile;
+  unsigned int m_nCSVrow;
+  bool m_bShared;
+  std::string m_sJournal;
+  bool m_bResume;
+};
+
+#endif
@@ -7,6 +7,14 @@
   Last change....: 2006-06-25
 */
 
+#include <new>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "cflashmem.h"
 
 CFlashmem::CFlashmem(unsigned int pagesize) {
@@ -14,50 +22,351 @@ CFlashmem::CFlashmem(unsigned int pagesize) {
   m_nPagecount = 0;
   m_pFirstpage = NULL;
   m_pLastpage = NULL;
+
+  m_nFlashsize = 0;
+  m_nDensepages = 0;
+  m_pImageAlloc = NULL;
+  m_pImage = NULL;
+  m_pPagepool = NULL;
+  m_ppPageindex = NULL;
+
+  m_nRadixsize = ((0xffffffffu / pagesize) >> FLASHMEM_LEAFBITS) + 1;
+  m_pppRadix = NULL;
+  m_pSlabpages = NULL;
+  m_pSlabdata = NULL;
+  m_nSlabused = FLASHMEM_SLABPAGES;
+  m_nSlabdataused = FLASHMEM_SLABPAGES;
+  m_pSlabcoverage = NULL;
+  m_pCoverage = NULL;
+
+  initInputs();
+  selectInsertBlock();
+}
+
+/* dense backend for small flash parts: the whole address range lives in one
+   aligned buffer, page objects come from one pool and are views into it */
+CFlashmem::CFlashmem(unsigned int pagesize, unsigned int flashsize) {
+  assert(pagesize > 0);
+  assert(flashsize > 0);
+
+  m_nPagesize = pagesize;
+  m_nPagecount = 0;
+  m_pFirstpage = NULL;
+  m_pLastpage = NULL;
+
+  unsigned int nPages = (flashsize + pagesize - 1) / pagesize;
+  m_nFlashsize = nPages * pagesize;
+  m_nDensepages = nPages;
+
+  m_pImageAlloc = new unsigned char[m_nFlashsize + FLASHMEM_ALIGNMENT];
+  m_pImage = m_pImageAlloc + (FLASHMEM_ALIGNMENT
+      - ((size_t) m_pImageAlloc % FLASHMEM_ALIGNMENT)) % FLASHMEM_ALIGNMENT;
+  memset(m_pImage, 0xff, m_nFlashsize);
+
+  m_pPagepool = (CPage*) ::operator new(nPages * sizeof(CPage));
+  m_ppPageindex = new CPage*[nPages];
+  memset(m_ppPageindex, 0, nPages * sizeof(CPage*));
+  m_pCoverage = new unsigned int[nPages * PAGE_COVERAGEWORDS(pagesize)];
+  memset(m_pCoverage, 0, nPages * PAGE_COVERAGEWORDS(pagesize) * sizeof(unsigned int));
+
+  m_nRadixsize = 0;
+  m_pppRadix = NULL;
+  m_pSlabpages = NULL;
+  m_pSlabdata = NULL;
+  m_nSlabused = 0;
+  m_nSlabdataused = 0;
+  m_pSlabcoverage = NULL;
+
+  initInputs();
+  selectInsertBlock();
 }
 
 CFlashmem::~CFlashmem() {
-  
+  if (isDense()) {
+    for (unsigned int n = 0; n < m_nDensepages; n++) {
+      if (m_ppPageindex[n] != NULL) m_ppPageindex[n]->~CPage();
+    }
+    ::operator delete(m_pPagepool);
+    delete[] m_ppPageindex;
+    delete[] m_pCoverage;
+    delete[] m_pImageAlloc;
+    return;
+  }
+
+  CPage* pPage = m_pFirstpage;
+  while (pPage != NULL) {
+    CPage* pNext = pPage->getNext();
+    pPage->~CPage();
+    pPage = pNext;
+  }
+  for (size_t n = 0; n < m_vSlabpages.size(); n++) {
+    ::operator delete(m_vSlabpages[n]);
+    delete[] m_vSlabcoverage[n];
+  }
+  for (size_t n = 0; n < m_vSlabdata.size(); n++) {
+    delete[] m_vSlabdata[n];
+  }
+  for (size_t n = 0; n < m_vMappings.size(); n++) {
+    unmapFile(m_vMappings[n].pData, m_vMappings[n].nSize);
+  }
+  if (m_pppRadix != NULL) {
+    for (unsigned int n = 0; n < m_nRadixsize; n++) {
+      delete[] m_pppRadix[n];
+    }
+    free(m_pppRadix);
+  }
 }
 
 CPage * CFlashmem::getFirstpage() {
   return m_pFirstpage;
 }
 
+unsigned int CFlashmem::getPagecount() {
+  return m_nPagecount;
+}
+
+unsigned int CFlashmem::getPagesize() {
+  return m_nPagesize;
+}
+
+bool CFlashmem::isDense() {
+  return m_pImage != NULL;
+}
+
+inline CPage* CFlashmem::findPage(unsigned int nPagenumber) {
+  if (isDense()) {
+    if (nPagenumber >= m_nDensepages) return NULL;
+    return m_ppPageindex[nPagenumber];
+  }
+
+  if (m_pppRadix == NULL) return NULL;
+
+  CPage** ppLeaf = m_pppRadix[nPagenumber >> FLASHMEM_LEAFBITS];
+  if (ppLeaf == NULL) return NULL;
+
+  return ppLeaf[nPagenumber & ((1 << FLASHMEM_LEAFBITS) - 1)];
+}
+
+/* page number of an address: a shift for power of two page sizes */
+inline unsigned int CFlashmem::getPagenumber(unsigned int nAddress) {
+  return m_nPageshift != 0 ? nAddress >> m_nPageshift : nAddress / m_nPagesize;
+}
+
 CPage* CFlashmem::getPageToAddress(unsigned int nAddress) {
-  unsigned int nBaseaddress = nAddress - (nAddress % m_nPagesize);
-  
-  if (m_pFirstpage == NULL) return NULL;
+  return findPage(getPagenumber(nAddress));
+}
 
-  if (m_pLastpage->getPageaddress() == nBaseaddress) return m_pLastpage;
+/* carve a page for the sparse backend out of the current slab and enter it
+   into the radix table. With pData given the page is a view on that memory
+   (e.g. a mapped input file), otherwise its data comes from a data slab. */
+CPage* CFlashmem::allocPage(unsigned int nAddress, unsigned char* pData) {
+  if (m_pppRadix == NULL) {
+    /* calloc: untouched top level entries stay unbacked zero pages */
+    m_pppRadix = (CPage***) calloc(m_nRadixsize, sizeof(CPage**));
+    if (m_pppRadix == NULL) {
+      setError(ERROR_MEMORY, "Out of memory!");
+      return NULL;
+    }
+  }
 
-  CPage* pPage = m_pFirstpage;
-  while (pPage != NULL) {
-    if (pPage->getPageaddress() == nBaseaddress) return pPage;
-    pPage = pPage->getNext();
+  unsigned int nPagenumber = getPagenumber(nAddress);
+  CPage**& ppLeaf = m_pppRadix[nPagenumber >> FLASHMEM_LEAFBITS];
+  if (ppLeaf == NULL) {
+    ppLeaf = new CPage*[1 << FLASHMEM_LEAFBITS];
+    memset(ppLeaf, 0, (1 << FLASHMEM_LEAFBITS) * sizeof(CPage*));
   }
 
-  return NULL;
+  unsigned int nCoveragewords = PAGE_COVERAGEWORDS(m_nPagesize);
+  if (m_nSlabused == FLASHMEM_SLABPAGES) {
+    m_pSlabpages = (CPage*) ::operator new(FLASHMEM_SLABPAGES * sizeof(CPage));
+    m_pSlabcoverage = new unsigned int[FLASHMEM_SLABPAGES * nCoveragewords];
+    memset(m_pSlabcoverage, 0, FLASHMEM_SLABPAGES * nCoveragewords * sizeof(unsigned int));
+    m_vSlabpages.push_back(m_pSlabpages);
+    m_vSlabcoverage.push_back(m_pSlabcoverage);
+    m_nSlabused = 0;
+  }
+
+  if (pData == NULL) {
+    if (m_nSlabdataused == FLASHMEM_SLABPAGES) {
+      m_pSlabdata = new unsigned char[FLASHMEM_SLABPAGES * m_nPagesize];
+      m_vSlabdata.push_back(m_pSlabdata);
+      m_nSlabdataused = 0;
+    }
+    pData = m_pSlabdata + m_nSlabdataused * m_nPagesize;
+    memset(pData, 0xff, m_nPagesize);
+    m_nSlabdataused++;
+  }
+
+  CPage* pPage = new (m_pSlabpages + m_nSlabused) CPage(nAddress, m_nPagesize, pData,
+      m_pSlabcoverage + m_nSlabused * nCoveragewords);
+  m_nSlabused++;
+
+  ppLeaf[nPagenumber & ((1 << FLASHMEM_LEAFBITS) - 1)] = pPage;
+  return pPage;
+}
+
+void CFlashmem::appendPage(CPage* pPage) {
+  m_nPagecount++;
+
+  if (m_pLastpage != NULL) {
+    m_pLastpage->setNext(pPage);
+    pPage->setPrev(m_pLastpage);
+  } else {
+    m_pFirstpage = pPage;
+  }
+  m_pLastpage = pPage;
+}
+
+CPage* CFlashmem::createPage(unsigned int nAddress) {
+  CPage* pPage;
+
+  if (isDense()) {
+    if (nAddress >= m_nFlashsize) {
+      setError(ERROR_RANGE, "Address 0x%x exceeds flash size 0x%x!", nAddress, m_nFlashsize);
+      return NULL;
+    }
+    unsigned int nIndex = nAddress / m_nPagesize;
+    pPage = new (m_pPagepool + nIndex)
+        CPage(nAddress, m_nPagesize, m_pImage + nIndex * m_nPagesize,
+              m_pCoverage + nIndex * PAGE_COVERAGEWORDS(m_nPagesize));
+    m_ppPageindex[nIndex] = pPage;
+  } else {
+    pPage = allocPage(nAddress, NULL);
+    if (pPage == NULL) return NULL;
+  }
+  appendPage(pPage);
+
+  return pPage;
+}
+
+int CFlashmem::insertData(unsigned int nAddress, unsigned char bData) {
+  return (this->*m_pfnInsertBlock)(nAddress, &bData, 1);
+}
+
+int CFlashmem::insertBlock(unsigned int nAddress, const unsigned char* pData,
+    unsigned int nLength) {
+  return (this->*m_pfnInsertBlock)(nAddress, pData, nLength);
+}
+
+/* Page size specialised bulk insert: with N a compile time power of two the
+   page number is a shift, the offset a mask and full pages a fixed size copy. */
+template <unsigned int N>
+int CFlashmem::insertBlockFixed(unsigned int nAddress, const unsigned char* pData,
+    unsigned int nLength) {
+  while (nLength > 0) {
+    unsigned int nOffset = nAddress & (N - 1);
+    unsigned int nChunk = N - nOffset;
+    if (nChunk > nLength) nChunk = nLength;
+
+    CPage* pPage = findPage(nAddress / N);
+    if (pPage == NULL && (pPage = createPage(nAddress)) == NULL) return m_nError;
+
+    if (pPage->countCovered(nOffset, nChunk) != 0) {
+      if (overlapBlock(pPage, nOffset, pData, nChunk) < 0) return m_nError;
+    }
+    else if (nChunk == N)
+      memcpy(pPage->getData(), pData, N);
+    else
+      memcpy(pPage->getData() + nOffset, pData, nChunk);
+    pPage->cover(nOffset, nChunk);
+
+    nAddress += nChunk;
+    pData += nChunk;
+    nLength -= nChunk;
+  }
+  return ERROR_NONE;
 }
 
-void CFlashmem::insertData(unsigned int nAddress, unsigned char bData) {
-  
-  CPage* pPage = getPageToAddress(nAddress);
-  if (pPage == NULL) {
+/* fallback for page sizes without a specialisation */
+int CFlashmem::insertBlockGeneric(unsigned int nAddress, const unsigned char* pData,
+    unsigned int nLength) {
+  while (nLength > 0) {
+    unsigned int nOffset = nAddress % m_nPagesize;
+    unsigned int nChunk = m_nPagesize - nOffset;
+    if (nChunk > nLength) nChunk = nLength;
 
-    pPage = new CPage(nAddress, m_nPagesize);
-    m_nPagecount++;
+    CPage* pPage = findPage(nAddress / m_nPagesize);
+    if (pPage == NULL && (pPage = createPage(nAddress)) == NULL) return m_nError;
 
-    if (m_pLastpage != NULL) {
-      m_pLastpage->setNext(pPage);
-      pPage->setPrev(m_pLastpage);
-    } else {
-      m_pFirstpage = pPage;
+    if (pPage->countCovered(nOffset, nChunk) != 0) {
+      if (overlapBlock(pPage, nOffset, pData, nChunk) < 0) return m_nError;
     }
-    m_pLastpage = pPage;
+    else
+      memcpy(pPage->getData() + nOffset, pData, nChunk);
+    pPage->cover(nOffset, nChunk);
+
+    nAddress += nChunk;
+    pData += nChunk;
+    nLength -= nChunk;
+  }
+  return ERROR_NONE;
+}
+
+/* Data hits bytes already written by this or an earlier input. Report the
+   page once and copy according to the overlap policy. */
+int CFlashmem::overlapBlock(CPage* pPage, unsigned int nOffset,
+    const unsigned char* pData, unsigned int nLength) {
+  unsigned int nOverlap = pPage->countCovered(nOffset, nLength);
+  m_nOverlapbytes += nOverlap;
+
+  if (m_nOverlappolicy == OVERLAP_ERROR) {
+    return setError(ERROR_OVERLAP, "%s overlaps earlier data in page 0x%x!",
+        m_pInputname, pPage->getPageaddress());
+  }
+  if (pPage != m_pLastoverlap) {
+    printf("Warning: %s overlaps earlier data in page 0x%x\n",
+        m_pInputname, pPage->getPageaddress());
+    m_pLastoverlap = pPage;
+  }
+
+  if (m_nOverlappolicy == OVERLAP_FIRST) {
+    for (unsigned int n = 0; n < nLength; n++) {
+      if (!pPage->isCovered(nOffset + n))
+        pPage->getData()[nOffset + n] = pData[n];
+    }
+  } else {
+    memcpy(pPage->getData() + nOffset, pData, nLength);
+  }
+  return ERROR_NONE;
+}
+
+void CFlashmem::initInputs() {
+  m_nOverlappolicy = OVERLAP_LAST;
+  m_pInputname = "";
+  m_pLastoverlap = NULL;
+  m_nOverlapbytes = 0;
+}
+
+void CFlashmem::setOverlappolicy(EOverlappolicy nPolicy) {
+  m_nOverlappolicy = nPolicy;
+}
+
+/* called by the loaders, names the input in overlap reports */
+void CFlashmem::beginInput(const char* filename) {
+  clearError();
+  m_pInputname = filename;
+  m_pLastoverlap = NULL;
+  m_nOverlapbytes = 0;
+}
 
+unsigned int CFlashmem::getOverlapbytes() {
+  return m_nOverlapbytes;
+}
+
+void CFlashmem::selectInsertBlock() {
+  m_nPageshift = 0;
+  if ((m_nPagesize & (m_nPagesize - 1)) == 0) {
+    while ((1u << m_nPageshift) < m_nPagesize) m_nPageshift++;
+  }
+
+  switch (m_nPagesize) {
+  case 32:  m_pfnInsertBlock = &CFlashmem::insertBlockFixed<32>; break;
+  case 64:  m_pfnInsertBlock = &CFlashmem::insertBlockFixed<64>; break;
+  case 128: m_pfnInsertBlock = &CFlashmem::insertBlockFixed<128>; break;
+  case 256: m_pfnInsertBlock = &CFlashmem::insertBlockFixed<256>; break;
+  case 512: m_pfnInsertBlock = &CFlashmem::insertBlockFixed<512>; break;
+  default:  m_pfnInsertBlock = &CFlashmem::insertBlockGeneric; break;
   }
-  pPage->insert(nAddress, bData);
 }
 
 void CFlashmem::display() {
@@ -70,82 +379,367 @@ void CFlashmem::display() {
 }
 
 
-int sscanhex( unsigned char *str, unsigned int *hexout, int n )
-{
-  unsigned int hex = 0, x = 0;
-  for(; n; n--){
-    x = *str;
-    if( x >= 'a' )
-      x += 10 - 'a';
-    else if( x >= 'A' )
-      x += 10 - 'A';
-    else
-      x -= '0';
-    if( x >= 16 )
-      break;
-    hex = hex * 16 + x;
-    str++;
+/* Hex decoding core shared by the IHEX and S-record loaders. Characters are
+   translated through a table, invalid ones set bit 4 of the nibble; the
+   error bits are or'ed over the whole record and tested once at the end, so
+   the inner loop is branch free and vectorizes. The table is constant:
+   images may be parsed on several threads (CFlasher::preload). */
+static const unsigned char hexnibble[256] = {
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+};
+
+/* decode nBytes bytes from 2 * nBytes hex digits, returns 0 on success */
+static int hexDecode(const unsigned char* src, unsigned char* dst, unsigned int nBytes) {
+  unsigned char bError = 0;
+  for (unsigned int n = 0; n < nBytes; n++) {
+    unsigned char hi = hexnibble[src[2 * n]];
+    unsigned char lo = hexnibble[src[2 * n + 1]];
+    bError |= hi | lo;
+    dst[n] = (hi << 4) | lo;
   }
-  *hexout = hex;
-  return n;					// 0 if all digits read
+  return bError & 0x10;
 }
 
+/* hex string to bytes for other modules (patch specifications etc.) */
+int decodeHex(const char* src, unsigned char* dst, unsigned int nBytes) {
+  return hexDecode((const unsigned char*) src, dst, nBytes);
+}
 
-int readhex( FILE *fp, unsigned int *addr, unsigned char *data){
-  /* Return value: 1..255	number of bytes
-			0	end or segment record
-		       -1	file end
-		       -2	error or no HEX-File */
-  char hexline[524];				// intel hex: max 255 byte
-  unsigned char * hp = (unsigned char *) hexline;
-  unsigned int byte;
-  int i;
-  unsigned int num;
-
-  if( fgets( hexline, 524, fp ) == NULL )
-    return -1;					// end of file
-  if( *hp++ != ':' )
-    return -2;                                  // no hex record
-  if( sscanhex( hp, &num, 2 ))
-    return -2;					// no hex number
-  hp += 2;
-  if( sscanhex( hp, addr, 4 ))
+/* length of the line at p without line end, *pNext is set to the next line */
+static size_t nextLine(const unsigned char* p, const unsigned char* end,
+    const unsigned char** pNext) {
+  const unsigned char* eol = (const unsigned char*) memchr(p, '\n', end - p);
+  if (eol == NULL) eol = end;
+  *pNext = eol < end ? eol + 1 : end;
+  while (eol > p && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t')) eol--;
+  return eol - p;
+}
+
+/* Intel HEX record ":LLAAAATT<data>CC", checksum verified.
+   Return value: 1..255	number of bytes
+		0	end or segment record (record type in *type,
+			payload of 02/04 records in *addr)
+	       -2	error or no HEX record */
+static int parseIHEXRecord(const unsigned char* line, size_t len,
+    unsigned int* addr, unsigned char* data, unsigned int* type) {
+  unsigned char record[260];
+
+  if (len < 11 || line[0] != ':' || hexDecode(line + 1, record, 1))
     return -2;
-  hp += 4;
-  if( sscanhex( hp, &byte, 2 ))
+  unsigned int num = record[0];
+  if (len < 11 + 2 * num || hexDecode(line + 1, record, num + 5))
     return -2;
-  if( byte != 0 )				// end or segment record
-    return 0;
-  for( i = num; i--; ){
-    hp += 2;
-    if( sscanhex( hp, &byte, 2 ))
+
+  unsigned char sum = 0;
+  for (unsigned int n = 0; n < num + 5; n++) sum += record[n];
+  if (sum != 0)
+    return -2;
+
+  *addr = (record[1] << 8) | record[2];
+  *type = record[3];
+  if (*type == 2 || *type == 4) {		// extended segment/linear address
+    if (num != 2)
       return -2;
-    *data++ = byte;
+    *addr = (record[4] << 8) | record[5];
+    return 0;
   }
+  if (*type != 0)				// end or start address record
+    return 0;
+  memcpy(data, record + 4, num);
   return num;
 }
 
+/* Motorola S-record "STCC<address><data>SS", checksum verified.
+   Return value: 1..255	number of bytes (S1/S2/S3)
+		0	header, count or termination record
+	       -2	error or no S-record */
+static int parseSRecord(const unsigned char* line, size_t len,
+    unsigned int* addr, unsigned char* data, unsigned int* type) {
+  unsigned char record[256];
+  static const unsigned char addrlen[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
 
-void CFlashmem::readFromIHEX(char* filename) {
-  assert(filename);
-  
-  FILE* fp;
-  if ((fp = fopen(filename, "rb")) == NULL) {
-    printf("File %s open failed!\n", filename);
-    exit(1);
-  };
+  if (len < 4 || line[0] != 'S' || line[1] < '0' || line[1] > '9' || line[1] == '4')
+    return -2;
+  *type = line[1] - '0';
+  if (hexDecode(line + 2, record, 1))
+    return -2;
+  unsigned int count = record[0];
+  unsigned int nAddrlen = addrlen[*type];
+  if (count < nAddrlen + 1 || len < 4 + 2 * count || hexDecode(line + 2, record, count + 1))
+    return -2;
+
+  unsigned char sum = 0;
+  for (unsigned int n = 0; n <= count; n++) sum += record[n];
+  if (sum != 0xff)
+    return -2;
+
+  if (*type < 1 || *type > 3)
+    return 0;
+
+  *addr = 0;
+  for (unsigned int n = 0; n < nAddrlen; n++) *addr = (*addr << 8) | record[1 + n];
+  unsigned int num = count - nAddrlen - 1;
+  memcpy(data, record + 1 + nAddrlen, num);
+  return num;
+}
+
+int CFlashmem::readFromIHEX(char* filename) {
+  size_t nSize;
+  unsigned char* pFile;
+  beginInput(filename);
+  if (mapFile(filename, &pFile, &nSize) < 0) return m_nError;
+  const unsigned char* p = pFile;
+  const unsigned char* end = pFile + nSize;
 
   int i;
+  int line = 0;
   unsigned int addr;
+  unsigned int type;
+  unsigned int base = 0;
   unsigned char data[255];
 
-  while( (i = readhex( fp, &addr, data )) >= 0 ){
+  while (p < end) {
+    const unsigned char* record = p;
+    size_t len = nextLine(record, end, &p);
+    line++;
+    if (len == 0) continue;
+
+    if ((i = parseIHEXRecord(record, len, &addr, data, &type)) < 0) {
+      setError(ERROR_FORMAT, "File %s: invalid record in line %d!", filename, line);
+      break;
+    }
     if ( i ) {
-      for (int j = 0; j < i; j++) {
-	insertData(addr + j, data[j]);
-      }
+      if (insertBlock(base + addr, data, i) < 0) break;
+    } else if (type == 2) {
+      base = addr << 4;
+    } else if (type == 4) {
+      base = addr << 16;
+    } else if (type == 1) {
+      break;
     }
   }
 
+  unmapFile(pFile, nSize);
+  return m_nError;
+}
+
+int CFlashmem::readFromSREC(char* filename) {
+  size_t nSize;
+  unsigned char* pFile;
+  beginInput(filename);
+  if (mapFile(filename, &pFile, &nSize) < 0) return m_nError;
+  const unsigned char* p = pFile;
+  const unsigned char* end = pFile + nSize;
+
+  int i;
+  int line = 0;
+  unsigned int addr;
+  unsigned int type;
+  unsigned char data[255];
+
+  while (p < end) {
+    const unsigned char* record = p;
+    size_t len = nextLine(record, end, &p);
+    line++;
+    if (len == 0) continue;
+
+    if ((i = parseSRecord(record, len, &addr, data, &type)) < 0) {
+      setError(ERROR_FORMAT, "File %s: invalid record in line %d!", filename, line);
+      break;
+    }
+    if ( i ) {
+      if (insertBlock(addr, data, i) < 0) break;
+    } else if (type >= 7) {
+      break;
+    }
+  }
+
+  unmapFile(pFile, nSize);
+  return m_nError;
+}
+
+
+/* Map an input file into memory. The mapping is private and writable, so
+   pages viewing it may still be modified without touching the file. An
+   empty file gives a NULL mapping. */
+int CFlashmem::mapFile(char* filename, unsigned char** ppData, size_t* pnSize) {
+  assert(filename);
+
+#ifdef _WIN32
+  FILE* fp;
+  if ((fp = fopen(filename, "rb")) == NULL)
+    return setError(ERROR_FILE, "File %s open failed!", filename);
+  fseek(fp, 0, SEEK_END);
+  long nSize = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  unsigned char* pData = (unsigned char*) malloc(nSize > 0 ? nSize : 1);
+  if (pData == NULL || fread(pData, 1, nSize, fp) != (size_t) nSize) {
+    free(pData);
+    fclose(fp);
+    return setError(ERROR_FILE, "File %s read failed!", filename);
+  }
   fclose(fp);
+  *pnSize = nSize;
+#else
+  int fd;
+  struct stat st;
+  if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    return setError(ERROR_FILE, "File %s open failed!", filename);
+  }
+  unsigned char* pData = NULL;
+  if (st.st_size > 0) {
+    void* pMap = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (pMap == MAP_FAILED) {
+      close(fd);
+      return setError(ERROR_FILE, "File %s mmap failed!", filename);
+    }
+    pData = (unsigned char*) pMap;
+  }
+  close(fd);
+  *pnSize = st.st_size;
+#endif
+
+  *ppData = pData;
+  return ERROR_NONE;
+}
+
+/* pages may view the mapping, keep it until this object is destroyed */
+void CFlashmem::keepMapping(unsigned char* pData, size_t nSize) {
+  if (pData != NULL) {
+    SMapping mapping = { pData, nSize };
+    m_vMappings.push_back(mapping);
+  }
+}
+
+void CFlashmem::unmapFile(unsigned char* pData, size_t nSize) {
+  if (pData == NULL) return;
+#ifdef _WIN32
+  free(pData);
+#else
+  munmap(pData, nSize);
+#endif
+}
+
+/* Insert a memory block that stays valid as long as this object. Whole
+   pages not present yet become views on the block (sparse backend only);
+   only partial pages at the edges and pages already present are copied. */
+int CFlashmem::insertMapped(unsigned int nAddress, unsigned char* pData,
+    unsigned int nLength) {
+  while (nLength > 0) {
+    unsigned int nOffset = nAddress % m_nPagesize;
+    unsigned int nChunk = m_nPagesize - nOffset;
+    if (nChunk > nLength) nChunk = nLength;
+
+    if (!isDense() && nChunk == m_nPagesize && getPageToAddress(nAddress) == NULL) {
+      CPage* pPage = allocPage(nAddress, pData);
+      if (pPage == NULL) return m_nError;
+      pPage->cover(0, m_nPagesize);
+      appendPage(pPage);
+    } else if (insertBlock(nAddress, pData, nChunk) < 0) {
+      return m_nError;
+    }
+
+    nAddress += nChunk;
+    pData += nChunk;
+    nLength -= nChunk;
+  }
+  return ERROR_NONE;
+}
+
+/* add a page viewing memory owned by the caller, which has to stay valid
+   (and must not be written) as long as this object (sparse backend only) */
+int CFlashmem::insertPageview(unsigned int nAddress, unsigned char* pData,
+    const unsigned int* pCoverage) {
+  assert(!isDense());
+  assert(getPageToAddress(nAddress) == NULL);
+
+  CPage* pPage = allocPage(nAddress, pData);
+  if (pPage == NULL) return m_nError;
+  memcpy(pPage->getCoverage(), pCoverage,
+      PAGE_COVERAGEWORDS(m_nPagesize) * sizeof(unsigned int));
+  appendPage(pPage);
+  return ERROR_NONE;
+}
+
+static unsigned int readLE16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned int readLE32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+#define ELF_EM_AVR        83
+#define ELF_PT_LOAD       1
+#define AVR_FLASH_LIMIT   0x800000  /* avr-gcc places SRAM/EEPROM/fuses above */
+
+int CFlashmem::readFromELF(char* filename) {
+  size_t nSize;
+  unsigned char* pFile;
+  beginInput(filename);
+  if (mapFile(filename, &pFile, &nSize) < 0) return m_nError;
+  keepMapping(pFile, nSize);
+
+  if (nSize < 52 || memcmp(pFile, "\177ELF", 4) != 0)
+    return setError(ERROR_FORMAT, "File %s is no ELF file!", filename);
+  if (pFile[4] != 1 || pFile[5] != 1)
+    return setError(ERROR_FORMAT, "File %s is no 32 bit little endian ELF file!", filename);
+
+  unsigned int nMachine = readLE16(pFile + 18);
+  unsigned int nPhoff = readLE32(pFile + 28);
+  unsigned int nPhentsize = readLE16(pFile + 42);
+  unsigned int nPhnum = readLE16(pFile + 44);
+
+  if (nMachine != ELF_EM_AVR)
+    printf("Warning: %s is no AVR ELF file (machine %d)\n", filename, nMachine);
+
+  if (nPhentsize < 32 || nPhoff > nSize || nPhnum > (nSize - nPhoff) / nPhentsize)
+    return setError(ERROR_FORMAT, "File %s has a broken program header table!", filename);
+
+  for (unsigned int n = 0; n < nPhnum; n++) {
+    const unsigned char* pPh = pFile + nPhoff + n * nPhentsize;
+    unsigned int nType = readLE32(pPh);
+    unsigned int nOffset = readLE32(pPh + 4);
+    unsigned int nPaddr = readLE32(pPh + 12);
+    unsigned int nFilesz = readLE32(pPh + 16);
+
+    if (nType != ELF_PT_LOAD || nFilesz == 0) continue;
+    if (nMachine == ELF_EM_AVR && nPaddr >= AVR_FLASH_LIMIT) continue;
+    if (nOffset > nSize || nFilesz > nSize - nOffset)
+      return setError(ERROR_FORMAT, "File %s has a truncated segment!", filename);
+
+    if (insertMapped(nPaddr, pFile + nOffset, nFilesz) < 0) return m_nError;
+  }
+  return ERROR_NONE;
+}
+
+int CFlashmem::readFromBIN(char* filename, unsigned int nBaseaddress) {
+  size_t nSize;
+  unsigned char* pFile;
+  beginInput(filename);
+  if (mapFile(filename, &pFile, &nSize) < 0) return m_nError;
+  keepMapping(pFile, nSize);
+
+  if (nSize > 0xffffffffu - nBaseaddress)
+    return setError(ERROR_RANGE, "File %s does not fit at base address 0x%x!",
+        filename, nBaseaddress);
+  if (nSize > 0)
+    return insertMapped(nBaseaddress, pFile, nSize);
+  return ERROR_NONE;
 }
@@ -7,26 +7,119 @@
   Last change....: 2006-06-25
 */
 
+#ifndef _H_CFLASHMEM_
+#define _H_CFLASHMEM_
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <vector>
 
 #include "cpage.h"
+#include "cerror.h"
+
+/* alignment of the dense image buffer (one cache line) */
+#define FLASHMEM_ALIGNMENT 64
+
+/* sparse backend: two-level radix table over page numbers; each leaf holds
+   1 << FLASHMEM_LEAFBITS page pointers. Pages are carved from slabs. */
+#define FLASHMEM_LEAFBITS 12
+#define FLASHMEM_SLABPAGES 64
+
+/* decode nBytes bytes from 2 * nBytes hex digits, returns 0 on success */
+int decodeHex(const char* src, unsigned char* dst, unsigned int nBytes);
 
-class CFlashmem {
+/* which data wins where inputs overlap */
+enum EOverlappolicy {
+  OVERLAP_LAST,    /* later inputs override earlier ones */
+  OVERLAP_FIRST,   /* the first input writing a byte keeps it */
+  OVERLAP_ERROR    /* overlapping inputs are an error */
+};
+
+/* Loaders and insert functions return ERROR_NONE or a negative error code,
+   the message is kept in getErrormessage(). */
+class CFlashmem : public CErrorstate {
  public:
   CFlashmem(unsigned int pagesize);
+  CFlashmem(unsigned int pagesize, unsigned int flashsize);
   ~CFlashmem();
   CPage* getPageToAddress(unsigned int nAddress);
-  void insertData(unsigned int nAddress, unsigned char bData);
+  int insertData(unsigned int nAddress, unsigned char bData);
+  int insertBlock(unsigned int nAddress, const unsigned char* pData, unsigned int nLength);
+  int insertPageview(unsigned int nAddress, unsigned char* pData, const unsigned int* pCoverage);
   void display();
-  void readFromIHEX(char* filename);
+  int readFromIHEX(char* filename);
+  int readFromSREC(char* filename);
+  int readFromELF(char* filename);
+  int readFromBIN(char* filename, unsigned int nBaseaddress);
   CPage * getFirstpage();
+  void setOverlappolicy(EOverlappolicy nPolicy);
+  void beginInput(const char* filename);
+  unsigned int getOverlapbytes();
+  unsigned int getPagecount();
+  unsigned int getPagesize();
+  bool isDense();
 
  protected:
+  void appendPage(CPage* pPage);
+  CPage* allocPage(unsigned int nAddress, unsigned char* pData);
+  CPage* createPage(unsigned int nAddress);
+  CPage* findPage(unsigned int nPagenumber);
+  unsigned int getPagenumber(unsigned int nAddress);
+  void selectInsertBlock();
+  void initInputs();
+  int overlapBlock(CPage* pPage, unsigned int nOffset, const unsigned char* pData,
+                   unsigned int nLength);
+  template <unsigned int N>
+  int insertBlockFixed(unsigned int nAddress, const unsigned char* pData, unsigned int nLength);
+  int insertBlockGeneric(unsigned int nAddress, const unsigned char* pData, unsigned int nLength);
+  int insertMapped(unsigned int nAddress, unsigned char* pData, unsigned int nLength);
+  int mapFile(char* filename, unsigned char** ppData, size_t* pnSize);
+  void keepMapping(unsigned char* pData, size_t nSize);
+  void unmapFile(unsigned char* pData, size_t nSize);
+
+  /* bulk insert, specialised once for the page size in the constructor */
+  int (CFlashmem::*m_pfnInsertBlock)(unsigned int, const unsigned char*, unsigned int);
+
   unsigned int m_nPagesize;
+  unsigned int m_nPageshift;    /* log2 of the page size, 0 if no power of two */
   unsigned int m_nPagecount;
   CPage* m_pFirstpage;
   CPage* m_pLastpage;
-  
+
+  /* dense backend: one 0xFF-filled buffer for the whole flash, pages are views */
+  unsigned int m_nFlashsize;
+  unsigned int m_nDensepages;
+  unsigned char* m_pImageAlloc;
+  unsigned char* m_pImage;
+  CPage* m_pPagepool;
+  CPage** m_ppPageindex;
+  unsigned int* m_pCoverage;
+
+  /* sparse backend: radix table for the full 32 bit address space */
+  unsigned int m_nRadixsize;
+  CPage*** m_pppRadix;
+  CPage* m_pSlabpages;
+  unsigned char* m_pSlabdata;
+  unsigned int m_nSlabused;
+  unsigned int m_nSlabdataused;
+  unsigned int* m_pSlabcoverage;
+  std::vector<CPage*> m_vSlabpages;
+  std::vector<unsigned int*> m_vSlabcoverage;
+  std::vector<unsigned char*> m_vSlabdata;
+
+  /* mapped input files, pages may be views on them */
+  struct SMapping {
+    unsigned char* pData;
+    size_t nSize;
+  };
+  std::vector<SMapping> m_vMappings;
+
+  /* merging several inputs */
+  EOverlappolicy m_nOverlappolicy;
+  const char* m_pInputname;
+  CPage* m_pLastoverlap;
+  unsigned int m_nOverlapbytes;
 };
+
+#endif
@@ -0,0 +1,181 @@
+/*
+  cflashpatch.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Per device patch overlay (serial numbers, MAC addresses, calibration data)
+  on top of a shared flash image. Patched pages are copied on write, the
+  base image is never modified.
+*/
+
+#include "cflashpatch.h"
+
+CFlashpatch::CFlashpatch(CFlashmem* pBase) {
+  assert(pBase);
+  m_pBase = pBase;
+  m_nPagesize = pBase->getPagesize();
+}
+
+CFlashpatch::~CFlashpatch() {
+  clear();
+  for (size_t n = 0; n < m_vFreepages.size(); n++)
+    delete m_vFreepages[n];
+}
+
+/* drop the patches of the current unit, page copies are kept for reuse */
+void CFlashpatch::clear() {
+  m_vFreepages.insert(m_vFreepages.end(), m_vPages.begin(), m_vPages.end());
+  m_vPages.clear();
+  m_vExtrapages.clear();
+}
+
+unsigned int CFlashpatch::getPatchedpages() {
+  return m_vPages.size();
+}
+
+unsigned int CFlashpatch::getPagecount() {
+  return m_pBase->getPagecount() + m_vExtrapages.size();
+}
+
+/* copy on write: the first patch to a page copies it from the base image */
+CPage* CFlashpatch::getPatchedpage(unsigned int nAddress) {
+  unsigned int nPageaddress = nAddress - (nAddress % m_nPagesize);
+
+  for (size_t n = 0; n < m_vPages.size(); n++) {
+    if (m_vPages[n]->getPageaddress() == nPageaddress) return m_vPages[n];
+  }
+
+  CPage* pPage = NULL;
+  for (size_t n = 0; n < m_vFreepages.size(); n++) {
+    if (m_vFreepages[n]->getPageaddress() == nPageaddress) {
+      pPage = m_vFreepages[n];
+      m_vFreepages.erase(m_vFreepages.begin() + n);
+      break;
+    }
+  }
+  if (pPage == NULL) pPage = new CPage(nPageaddress, m_nPagesize);
+
+  unsigned int nCoveragesize = PAGE_COVERAGEWORDS(m_nPagesize) * sizeof(unsigned int);
+  CPage* pBasepage = m_pBase->getPageToAddress(nPageaddress);
+  if (pBasepage != NULL) {
+    memcpy(pPage->getData(), pBasepage->getData(), m_nPagesize);
+    memcpy(pPage->getCoverage(), pBasepage->getCoverage(), nCoveragesize);
+  } else {
+    memset(pPage->getData(), 0xff, m_nPagesize);
+    memset(pPage->getCoverage(), 0, nCoveragesize);
+    m_vExtrapages.push_back(pPage);
+  }
+
+  m_vPages.push_back(pPage);
+  return pPage;
+}
+
+void CFlashpatch::patch(unsigned int nAddress, const unsigned char* pData,
+    unsigned int nLength) {
+  while (nLength > 0) {
+    unsigned int nOffset = nAddress % m_nPagesize;
+    unsigned int nChunk = m_nPagesize - nOffset;
+    if (nChunk > nLength) nChunk = nLength;
+
+    CPage* pPage = getPatchedpage(nAddress);
+    memcpy(pPage->getData() + nOffset, pData, nChunk);
+    pPage->cover(nOffset, nChunk);
+
+    nAddress += nChunk;
+    pData += nChunk;
+    nLength -= nChunk;
+  }
+}
+
+/* patch given as "address=hexbytes", e.g. "0x7ff0=00A0C9123456" */
+int CFlashpatch::parsePatch(const char* spec) {
+  char* pEnd;
+  unsigned int nAddress = strtoul(spec, &pEnd, 0);
+  unsigned char data[256];
+
+  size_t nDigits = (*pEnd == '=') ? strlen(pEnd + 1) : 0;
+  if (pEnd == spec || nDigits == 0 || nDigits % 2 != 0 || nDigits / 2 > sizeof(data)
+      || decodeHex(pEnd + 1, data, nDigits / 2) != 0)
+    return setError(ERROR_ARGUMENT, "Invalid patch \"%s\", expected address=hexbytes!", spec);
+
+  patch(nAddress, data, nDigits / 2);
+  return ERROR_NONE;
+}
+
+static char* trimCell(char* cell) {
+  while (*cell == ' ' || *cell == '\t' || *cell == '"') cell++;
+  char* pEnd = cell + strlen(cell);
+  while (pEnd > cell && strchr(" \t\r\n\"", pEnd[-1]) != NULL) pEnd--;
+  *pEnd = 0;
+  return cell;
+}
+
+/* CSV with one column per patch location: the header row holds the
+   addresses, data row nRow (counting from 1) the hex bytes of one unit.
+   Empty cells and columns without an address (labels) are skipped. */
+int CFlashpatch::readFromCSV(char* filename, unsigned int nRow) {
+  assert(filename);
+
+  FILE* fp;
+  if ((fp = fopen(filename, "rb")) == NULL)
+    return setError(ERROR_FILE, "File %s open failed!", filename);
+
+  char header[4096];
+  char line[4096];
+  unsigned int n = 0;
+  bool bHeader = fgets(header, sizeof(header), fp) != NULL;
+  while (bHeader && n < nRow && fgets(line, sizeof(line), fp) != NULL) {
+    if (trimCell(line)[0] != 0) n++;
+  }
+  fclose(fp);
+
+  if (n < nRow || nRow == 0)
+    return setError(ERROR_ARGUMENT, "File %s has no row %d!", filename, nRow);
+
+  char* pHeader = header;
+  char* pLine = line;
+  while (pHeader != NULL && pLine != NULL) {
+    char* pNextheader = strchr(pHeader, ',');
+    char* pNextline = strchr(pLine, ',');
+    if (pNextheader != NULL) *pNextheader++ = 0;
+    if (pNextline != NULL) *pNextline++ = 0;
+
+    char* pAddress = trimCell(pHeader);
+    char* pValue = trimCell(pLine);
+    if (*pAddress >= '0' && *pAddress <= '9' && *pValue != 0) {
+      char spec[4096];
+      snprintf(spec, sizeof(spec), "%s=%s", pAddress, pValue);
+      if (parsePatch(spec) < 0) return m_nError;
+    }
+
+    pHeader = pNextheader;
+    pLine = pNextline;
+  }
+  return ERROR_NONE;
+}
+
+CPage* CFlashpatch::resolve(CPage* pBasepage) {
+  for (size_t n = 0; n < m_vPages.size(); n++) {
+    if (m_vPages[n]->getPageaddress() == pBasepage->getPageaddress()) return m_vPages[n];
+  }
+  return pBasepage;
+}
+
+/* iteration: the pages of the base image with patched copies in place of
+   the originals, then the patched pages the base image does not have */
+CPage* CFlashpatch::getFirstpage() {
+  CPage* pBasepage = m_pBase->getFirstpage();
+  if (pBasepage != NULL) return resolve(pBasepage);
+  return m_vExtrapages.empty() ? NULL : m_vExtrapages[0];
+}
+
+CPage* CFlashpatch::getNextpage(CPage* pPage) {
+  for (size_t n = 0; n < m_vExtrapages.size(); n++) {
+    if (m_vExtrapages[n] == pPage)
+      return (n + 1 < m_vExtrapages.size()) ? m_vExtrapages[n + 1] : NULL;
+  }
+
+  CPage* pBasepage = m_pBase->getPageToAddress(pPage->getPageaddress());
+  assert(pBasepage);
+  pBasepage = pBasepage->getNext();
+  if (pBasepage != NULL) return resolve(pBasepage);
+  return m_vExtrapages.empty() ? NULL : m_vExtrapages[0];
+}
@@ -0,0 +1,44 @@
+/*
+  cflashpatch.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Per device patch overlay (serial numbers, MAC addresses, calibration data)
+  on top of a shared flash image. Patched pages are copied on write, the
+  base image is never modified.
+*/
+
+#ifndef _H_CFLASHPATCH_
+#define _H_CFLASHPATCH_
+
+#include <vector>
+
+#include "cflashmem.h"
+#include "cerror.h"
+
+class CFlashpatch : public CErrorstate {
+ public:
+  CFlashpatch(CFlashmem* pBase);
+  ~CFlashpatch();
+  void patch(unsigned int nAddress, const unsigned char* pData, unsigned int nLength);
+  int parsePatch(const char* spec);
+  int readFromCSV(char* filename, unsigned int nRow);
+  void clear();
+  unsigned int getPatchedpages();
+  unsigned int getPagecount();
+  CPage* getFirstpage();
+  CPage* getNextpage(CPage* pPage);
+
+ protected:
+  CPage* getPatchedpage(unsigned int nAddress);
+  CPage* resolve(CPage* pBasepage);
+
+  CFlashmem* m_pBase;
+  unsigned int m_nPagesize;
+  /* pages of the current unit; few per unit, so searched linearly */
+  std::vector<CPage*> m_vPages;
+  /* pages beyond the base image, written after it */
+  std::vector<CPage*> m_vExtrapages;
+  /* page copies of earlier units, reused to keep per unit setup cheap */
+  std::vector<CPage*> m_vFreepages;
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+  cjournal.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Resume journal: image hash, device identity and the number of pages (in
+  write order) the bootloader has confirmed, rewritten in place after every
+  request so an interrupted run can continue where it stopped.
+*/
+
+#include <string.h>
+
+#include "cjournal.h"
+
+#define JOURNAL_MAGIC "avrusbboot journal 1"
+
+CJournal::CJournal() {
+  m_pFile = NULL;
+  m_nImagehash = 0;
+  m_nPages = 0;
+  m_nAddress = 0;
+}
+
+/* an unfinished journal stays on disk */
+CJournal::~CJournal() {
+  if (m_pFile != NULL) fclose(m_pFile);
+}
+
+/* read a journal left by an earlier run, false if there is none */
+bool CJournal::load(const char* filename) {
+  char line[256];
+  char device[200];
+  bool bValid = false;
+
+  FILE* fp = fopen(filename, "r");
+  if (fp == NULL) return false;
+  if (fgets(line, sizeof(line), fp) != NULL
+      && strncmp(line, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) == 0
+      && fscanf(fp, "image %llx\n", &m_nImagehash) == 1
+      && fscanf(fp, "device %199s\n", device) == 1
+      && fscanf(fp, "pages %u last 0x%x\n", &m_nPages, &m_nAddress) == 2) {
+    m_sDevice = device;
+    bValid = true;
+  }
+  fclose(fp);
+  return bValid;
+}
+
+/* start journaling a run that has nPages already on the device */
+int CJournal::begin(const char* filename, unsigned long long nImagehash,
+    const std::string& device, unsigned int nPages) {
+  if (m_pFile != NULL) fclose(m_pFile);
+  m_sFilename = filename;
+  m_nImagehash = nImagehash;
+  m_sDevice = device;
+  m_nPages = nPages;
+  m_nAddress = 0;
+
+  if ((m_pFile = fopen(filename, "w")) == NULL)
+    return setError(ERROR_FILE, "Cannot write journal %s!", filename);
+  return write();
+}
+
+/* fixed width fields, so the file is rewritten in place */
+int CJournal::write() {
+  rewind(m_pFile);
+  fprintf(m_pFile, "%s\nimage %016llx\ndevice %s\npages %10u last 0x%08x\n",
+      JOURNAL_MAGIC, m_nImagehash, m_sDevice.c_str(), m_nPages, m_nAddress);
+  if (fflush(m_pFile) != 0 || ferror(m_pFile))
+    return setError(ERROR_FILE, "Cannot write journal %s!", m_sFilename.c_str());
+  return ERROR_NONE;
+}
+
+/* the first nPages pages are written, the last one at nAddress */
+int CJournal::confirm(unsigned int nPages, unsigned int nAddress) {
+  if (m_pFile == NULL) return ERROR_NONE;
+  m_nPages = nPages;
+  m_nAddress = nAddress;
+  return write();
+}
+
+/* the run is complete: remove the journal */
+int CJournal::finish() {
+  if (m_pFile == NULL) return ERROR_NONE;
+  fclose(m_pFile);
+  m_pFile = NULL;
+  if (remove(m_sFilename.c_str()) != 0)
+    return setError(ERROR_FILE, "Cannot remove journal %s!", m_sFilename.c_str());
+  return ERROR_NONE;
+}
+
+unsigned long long CJournal::getImagehash() {
+  return m_nImagehash;
+}
+
+const std::string& CJournal::getDevice() {
+  return m_sDevice;
+}
+
+unsigned int CJournal::getPages() {
+  return m_nPages;
+}
+
+/* addresses and contents of all pages, patches applied */
+unsigned long long CJournal::hashImage(CFlashpatch* pFlashpatch) {
+  unsigned long long nHash = 14695981039346656037ULL;
+  for (CPage* pPage = pFlashpatch->getFirstpage(); pPage != NULL;
+       pPage = pFlashpatch->getNextpage(pPage)) {
+    nHash = (nHash ^ pPage->getPageaddress()) * 1099511628211ULL;
+    nHash = (nHash ^ pPage->getHash()) * 1099511628211ULL;
+  }
+  return nHash;
+}
@@ -0,0 +1,43 @@
+/*
+  cjournal.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Resume journal: image hash, device identity and the number of pages (in
+  write order) the bootloader has confirmed, rewritten in place after every
+  request so an interrupted run can continue where it stopped.
+*/
+
+#ifndef _H_CJOURNAL_
+#define _H_CJOURNAL_
+
+#include <stdio.h>
+#include <string>
+
+#include "cflashpatch.h"
+#include "cerror.h"
+
+class CJournal : public CErrorstate {
+ public:
+  CJournal();
+  ~CJournal();
+  bool load(const char* filename);
+  int begin(const char* filename, unsigned long long nImagehash,
+            const std::string& device, unsigned int nPages);
+  int confirm(unsigned int nPages, unsigned int nAddress);
+  int finish();
+  unsigned long long getImagehash();
+  const std::string& getDevice();
+  unsigned int getPages();
+  static unsigned long long hashImage(CFlashpatch* pFlashpatch);
+
+ protected:
+  int write();
+
+  FILE* m_pFile;
+  std::string m_sFilename;
+  unsigned long long m_nImagehash;
+  std::string m_sDevice;
+  unsigned int m_nPages;      /* confirmed pages in write order */
+  unsigned int m_nAddress;    /* last confirmed page */
+};
+
+#endif
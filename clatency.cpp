@@ -0,0 +1,69 @@
+/*
+  clatency.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Latency model of a device: the last LATENCY_SAMPLES round trips of every
+  request, per page it programs. Timeouts follow the 99th percentile times
+  a margin once enough samples are in, so a hung device is noticed after
+  a few times its usual latency instead of after the fixed limit.
+*/
+
+#include <algorithm>
+
+#include "clatency.h"
+
+CLatency::CLatency() {
+  reset();
+}
+
+void CLatency::reset() {
+  for (unsigned int n = 0; n < LATENCY_KINDS; n++) {
+    m_kinds[n].nCount = 0;
+    m_kinds[n].nNext = 0;
+  }
+}
+
+/* a request that programs no page counts as one */
+void CLatency::addSample(unsigned int nKind, unsigned int nPages, unsigned long nMicroseconds) {
+  SKind& kind = m_kinds[nKind % LATENCY_KINDS];
+  kind.nSamples[kind.nNext] = nMicroseconds / (nPages > 0 ? nPages : 1);
+  kind.nNext = (kind.nNext + 1) % LATENCY_SAMPLES;
+  if (kind.nCount < LATENCY_SAMPLES) kind.nCount++;
+}
+
+unsigned int CLatency::getSamples(unsigned int nKind) {
+  return m_kinds[nKind % LATENCY_KINDS].nCount;
+}
+
+/* microseconds per page below which nPercent of the samples lie, 0 without
+   samples. Selects on a copy, the write path stays free of allocations. */
+unsigned long CLatency::getPercentile(unsigned int nKind, unsigned int nPercent) {
+  SKind& kind = m_kinds[nKind % LATENCY_KINDS];
+  if (kind.nCount == 0) return 0;
+
+  unsigned long sorted[LATENCY_SAMPLES];
+  std::copy(kind.nSamples, kind.nSamples + kind.nCount, sorted);
+  unsigned int nIndex = (kind.nCount * nPercent + 99) / 100;
+  nIndex = nIndex > 0 ? nIndex - 1 : 0;
+  std::nth_element(sorted, sorted + nIndex, sorted + kind.nCount);
+  return sorted[nIndex];
+}
+
+/* ms to wait for a request programming nPages: nLimit until the request
+   has LATENCY_WARMUP samples, then the 99th percentile times
+   LATENCY_MARGIN, at least LATENCY_MINTIMEOUT and at most nLimit */
+unsigned int CLatency::getTimeout(unsigned int nKind, unsigned int nPages, unsigned int nLimit) {
+  if (getSamples(nKind) < LATENCY_WARMUP) return nLimit;
+
+  unsigned long long nTimeout = (unsigned long long) getPercentile(nKind, 99)
+      * (nPages > 0 ? nPages : 1) * LATENCY_MARGIN / 1000;
+  if (nTimeout < LATENCY_MINTIMEOUT) nTimeout = LATENCY_MINTIMEOUT;
+  return nTimeout < nLimit ? (unsigned int) nTimeout : nLimit;
+}
+
+/* the round trip took LATENCY_SLOWFACTOR times the median or longer: the
+   device or the bus is busy, send less at once */
+bool CLatency::isSlow(unsigned int nKind, unsigned int nPages, unsigned long nMicroseconds) {
+  if (getSamples(nKind) < LATENCY_WARMUP) return false;
+  return nMicroseconds / (nPages > 0 ? nPages : 1)
+      > getPercentile(nKind, 50) * LATENCY_SLOWFACTOR;
+}
@@ -0,0 +1,40 @@
+/*
+  clatency.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Latency model of a device: the last LATENCY_SAMPLES round trips of every
+  request, per page it programs. Timeouts follow the 99th percentile times
+  a margin once enough samples are in, so a hung device is noticed after
+  a few times its usual latency instead of after the fixed limit.
+*/
+
+#ifndef _H_CLATENCY_
+#define _H_CLATENCY_
+
+#define LATENCY_KINDS      16   /* request numbers kept apart */
+#define LATENCY_SAMPLES    64   /* ring per request */
+#define LATENCY_WARMUP     8    /* samples before the learned timeout applies */
+#define LATENCY_MARGIN     4    /* timeout: 99th percentile times this */
+#define LATENCY_MINTIMEOUT 50   /* ms, covers scheduling jitter of the host */
+#define LATENCY_SLOWFACTOR 2    /* above this times the median: congestion */
+
+class CLatency {
+ public:
+  CLatency();
+  void addSample(unsigned int nKind, unsigned int nPages, unsigned long nMicroseconds);
+  unsigned int getTimeout(unsigned int nKind, unsigned int nPages, unsigned int nLimit);
+  unsigned long getPercentile(unsigned int nKind, unsigned int nPercent);
+  bool isSlow(unsigned int nKind, unsigned int nPages, unsigned long nMicroseconds);
+  unsigned int getSamples(unsigned int nKind);
+  void reset();
+
+ protected:
+  struct SKind {
+    unsigned long nSamples[LATENCY_SAMPLES];  /* microseconds per page */
+    unsigned int nCount;
+    unsigned int nNext;
+  };
+
+  SKind m_kinds[LATENCY_KINDS];
+};
+
+#endif
@@ -13,19 +13,50 @@ CPage::CPage(unsigned int pageaddress, unsigned int pagesize) {
 
   assert(pagesize > 0);
 
-  m_nPagesize = pagesize;
-  m_nPageaddress = pageaddress - (pageaddress % m_nPagesize);
+  setPagesize(pageaddress, pagesize);
 
   m_pData = new unsigned char[m_nPagesize];
   memset(m_pData, 0xff, m_nPagesize);
+  m_pCoverage = new unsigned int[PAGE_COVERAGEWORDS(m_nPagesize)];
+  memset(m_pCoverage, 0, PAGE_COVERAGEWORDS(m_nPagesize) * sizeof(unsigned int));
+  m_bOwner = true;
+
+  m_pPrevpage = NULL;
+  m_pNextpage = NULL;
+}
+
+/* page as view into buffers owned by someone else (e.g. dense flash image),
+   the coverage bitmap is expected to be cleared */
+CPage::CPage(unsigned int pageaddress, unsigned int pagesize, unsigned char* pData,
+    unsigned int* pCoverage) {
+
+  assert(pagesize > 0);
+  assert(pData);
+  assert(pCoverage);
+
+  setPagesize(pageaddress, pagesize);
+
+  m_pData = pData;
+  m_pCoverage = pCoverage;
+  m_bOwner = false;
 
   m_pPrevpage = NULL;
   m_pNextpage = NULL;
 }
 
+/* the mask is chosen once here, insert() then needs no division */
+void CPage::setPagesize(unsigned int pageaddress, unsigned int pagesize) {
+  m_nPagesize = pagesize;
+  m_nOffsetmask = (pagesize & (pagesize - 1)) == 0 ? pagesize - 1 : 0;
+  m_nPageaddress = pageaddress - getOffset(pageaddress);
+}
+
 CPage::~CPage() {
   assert(m_pData);
-  delete m_pData;
+  if (m_bOwner) {
+    delete[] m_pData;
+    delete[] m_pCoverage;
+  }
 }
 
 unsigned int CPage::getPageaddress() {
@@ -40,6 +71,54 @@ unsigned char * CPage::getData() {
   return m_pData;
 }
 
+/* FNV-1a of the page data, to find identical pages */
+unsigned long long CPage::getHash() {
+  unsigned long long nHash = 14695981039346656037ULL;
+  for (unsigned int n = 0; n < m_nPagesize; n++) {
+    nHash ^= m_pData[n];
+    nHash *= 1099511628211ULL;
+  }
+  return nHash;
+}
+
+/* bytes up to the trailing run of 0xff (erased flash), 0 for an empty
+   page. Whole 64 bit words of 0xff are skipped from the end; in the first
+   word holding data the count of leading zero bits of its complement
+   gives the 0xff bytes above the last data byte (the last byte is the
+   most significant one on a little endian host). */
+unsigned int CPage::getDatalength() {
+  unsigned int nLength = m_nPagesize;
+  unsigned long long nWord;
+
+  while (nLength % sizeof(nWord) != 0 && nLength > 0 && m_pData[nLength - 1] == 0xff)
+    nLength--;
+  if (nLength % sizeof(nWord) != 0)
+    return nLength;
+  for (; nLength >= sizeof(nWord); nLength -= sizeof(nWord)) {
+    memcpy(&nWord, m_pData + nLength - sizeof(nWord), sizeof(nWord));
+    if (nWord != ~0ULL) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      return nLength - __builtin_ctzll(~nWord) / 8;
+#else
+      return nLength - __builtin_clzll(~nWord) / 8;
+#endif
+    }
+  }
+  return 0;
+}
+
+/* CRC-16 of the page data as computed by _crc16_update() of avr-libc
+   (polynomial 0xa001, initial value 0xffff) */
+unsigned short CPage::getCRC16() {
+  unsigned short nCRC = 0xffff;
+  for (unsigned int n = 0; n < m_nPagesize; n++) {
+    nCRC ^= m_pData[n];
+    for (int nBit = 0; nBit < 8; nBit++)
+      nCRC = (nCRC & 1) ? (nCRC >> 1) ^ 0xa001 : nCRC >> 1;
+  }
+  return nCRC;
+}
+
 CPage* CPage::getPrev() {
   return m_pPrevpage;
 }
@@ -57,13 +136,55 @@ void CPage::setNext(CPage* pPage) {
 }
 
 CPage* CPage::insert(unsigned int nAddress, unsigned char bValue) {
-  assert(m_nPageaddress == (nAddress - (nAddress % m_nPagesize)));
-  m_pData[nAddress % m_nPagesize] = bValue;
+  unsigned int nOffset = getOffset(nAddress);
+  assert(m_nPageaddress == nAddress - nOffset);
+  m_pData[nOffset] = bValue;
+  cover(nOffset, 1);
+  return this;
+}
+
+unsigned int* CPage::getCoverage() {
+  return m_pCoverage;
+}
+
+/* number of bytes in [nOffset, nOffset + nLength) already written */
+unsigned int CPage::countCovered(unsigned int nOffset, unsigned int nLength) {
+  assert(nOffset + nLength <= m_nPagesize);
+  unsigned int nCount = 0;
+
+  while (nLength > 0) {
+    unsigned int nBit = nOffset & 31;
+    unsigned int nBits = 32 - nBit;
+    if (nBits > nLength) nBits = nLength;
+    unsigned int nMask = (nBits == 32) ? 0xffffffffu : (((1u << nBits) - 1) << nBit);
+    nCount += __builtin_popcount(m_pCoverage[nOffset >> 5] & nMask);
+    nOffset += nBits;
+    nLength -= nBits;
+  }
+  return nCount;
+}
+
+void CPage::cover(unsigned int nOffset, unsigned int nLength) {
+  assert(nOffset + nLength <= m_nPagesize);
+
+  while (nLength > 0) {
+    unsigned int nBit = nOffset & 31;
+    unsigned int nBits = 32 - nBit;
+    if (nBits > nLength) nBits = nLength;
+    unsigned int nMask = (nBits == 32) ? 0xffffffffu : (((1u << nBits) - 1) << nBit);
+    m_pCoverage[nOffset >> 5] |= nMask;
+    nOffset += nBits;
+    nLength -= nBits;
+  }
+}
+
+bool CPage::isCovered(unsigned int nOffset) {
+  return (m_pCoverage[nOffset >> 5] >> (nOffset & 31)) & 1;
 }
 
 void CPage::display() {
   int n;
-   printf("Page Adresse: %d\n", getPageaddress());
+   printf("Page Adresse: 0x%x\n", getPageaddress());
 
   for (n = 0; n < 64; n++)
     printf("%2X ", m_pData[n]);
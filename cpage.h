@@ -15,25 +15,47 @@
 #include <assert.h>
 #include <string.h>
 
+/* 32 bit words of a coverage bitmap for a page */
+#define PAGE_COVERAGEWORDS(pagesize) (((pagesize) + 31) / 32)
+
 class CPage {
  public:
   CPage(unsigned int pageaddress, unsigned int pagesize);
+  CPage(unsigned int pageaddress, unsigned int pagesize, unsigned char* pData,
+        unsigned int* pCoverage);
   ~CPage();
 
   unsigned int getPageaddress();
   unsigned int getPagesize();
   unsigned char* getData();
+  unsigned long long getHash();
+  unsigned int getDatalength();
+  unsigned short getCRC16();
   CPage* getPrev();
   CPage* getNext();
   CPage* insert(unsigned int nAddress, unsigned char bValue);
+  unsigned int* getCoverage();
+  unsigned int countCovered(unsigned int nOffset, unsigned int nLength);
+  void cover(unsigned int nOffset, unsigned int nLength);
+  bool isCovered(unsigned int nOffset);
   void display();
   void setPrev(CPage* pPage);
   void setNext(CPage* pPage);
 
  protected:
-  int m_nPageaddress;
-  int m_nPagesize;
+  void setPagesize(unsigned int pageaddress, unsigned int pagesize);
+  /* offset of an address in its page: a mask for every AVR page size, the
+     division only for unusual sizes */
+  unsigned int getOffset(unsigned int nAddress) {
+    return m_nOffsetmask != 0 ? nAddress & m_nOffsetmask : nAddress % m_nPagesize;
+  }
+
+  unsigned int m_nPageaddress;
+  unsigned int m_nPagesize;
+  unsigned int m_nOffsetmask;   /* pagesize - 1 for powers of two, else 0 */
   unsigned char * m_pData;
+  unsigned int * m_pCoverage;   /* one bit per byte written by an input */
+  bool m_bOwner;
   CPage* m_pPrevpage;
   CPage* m_pNextpage;
 };
@@ -0,0 +1,430 @@
+/*
+  cscheduler.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Flashes every attached bootloader from one thread. Devices behind one hub
+  share its upstream link and all hubs of a bus share the bus, so the
+  scheduler groups the devices by hub and by bus and lets only a few write
+  requests per group be in flight. Slots are handed out in turn per batch:
+  while one device programs its pages the next one gets the bus.
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <string.h>
+#include <deque>
+#include <unordered_map>
+
+#include "cscheduler.h"
+#include "casyncbootloader.h"
+
+/* devices sharing a hub or a bus, with their write requests in flight */
+struct CScheduler::SGroup {
+  std::string key;
+  unsigned int nBus;
+  bool bBus;
+  unsigned int nLimit;
+  unsigned int nInflight;
+  std::deque<std::coroutine_handle<> > waiters;
+
+  /* usage of the last run */
+  unsigned long nBytes;
+  unsigned long long nBusy;
+  unsigned long long nBusysince;
+  unsigned long long nFirst;
+  unsigned long long nLast;
+};
+
+struct CScheduler::SDevice {
+  CAsyncbootloader* pBootloader;
+  std::string path;
+  SGroup* pHub;
+  SGroup* pBus;
+  unsigned int nPagesize;
+  int nResult;
+};
+
+/* co_await takes a slot of the group, waiting in line behind the devices
+   that asked before. A released slot goes straight to the first in line. */
+class CScheduler::CSlotawaiter {
+ public:
+  CSlotawaiter(SGroup* pGroup) { m_pGroup = pGroup; }
+
+  bool await_ready() {
+    if (m_pGroup->nInflight >= m_pGroup->nLimit || !m_pGroup->waiters.empty())
+      return false;
+    unsigned long long nNow = getMicroseconds();
+    if (m_pGroup->nInflight++ == 0) m_pGroup->nBusysince = nNow;
+    if (m_pGroup->nFirst == 0) m_pGroup->nFirst = nNow;
+    return true;
+  }
+  void await_suspend(std::coroutine_handle<> caller) { m_pGroup->waiters.push_back(caller); }
+  void await_resume() {}
+
+ protected:
+  SGroup* m_pGroup;
+};
+
+CScheduler::CScheduler() {
+  m_nHublimit = SCHEDULER_HUBLIMIT;
+  m_nBuslimit = SCHEDULER_BUSLIMIT;
+  m_nBatchlimit = USBBOOT_MAXBATCH;
+  m_bCompress = true;
+  m_bCopy = true;
+  m_nRetries = USBBOOT_RETRIES;
+  libusb_init(NULL);
+}
+
+CScheduler::~CScheduler() {
+  for (size_t n = 0; n < m_vDevices.size(); n++) {
+    delete m_vDevices[n]->pBootloader;
+    delete m_vDevices[n];
+  }
+  for (size_t n = 0; n < m_vGroups.size(); n++)
+    delete m_vGroups[n];
+  libusb_exit(NULL);
+}
+
+/* page writes in flight per hub and per bus, 0 keeps the default */
+void CScheduler::setLimits(unsigned int nHublimit, unsigned int nBuslimit) {
+  if (nHublimit > 0) m_nHublimit = nHublimit;
+  if (nBuslimit > 0) m_nBuslimit = nBuslimit;
+  for (size_t n = 0; n < m_vGroups.size(); n++)
+    m_vGroups[n]->nLimit = m_vGroups[n]->bBus ? m_nBuslimit : m_nHublimit;
+}
+
+/* request options of every device, as CBootloader's -B, -Z, -D and -t */
+void CScheduler::setWriteoptions(unsigned int nBatchlimit, bool bCompress, bool bCopy,
+    unsigned int nRetries) {
+  m_nBatchlimit = nBatchlimit;
+  m_bCompress = bCompress;
+  m_bCopy = bCopy;
+  m_nRetries = nRetries;
+  for (size_t n = 0; n < m_vDevices.size(); n++)
+    applyWriteoptions(m_vDevices[n]->pBootloader);
+}
+
+void CScheduler::applyWriteoptions(CAsyncbootloader* pBootloader) {
+  pBootloader->setBatchlimit(m_nBatchlimit);
+  pBootloader->setCompressenabled(m_bCompress);
+  pBootloader->setCopyenabled(m_bCopy);
+  pBootloader->setRetries(m_nRetries);
+}
+
+unsigned long long CScheduler::getMicroseconds() {
+#ifdef _WIN32
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return count.QuadPart / frequency.QuadPart * 1000000ULL
+      + count.QuadPart % frequency.QuadPart * 1000000ULL / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+#endif
+}
+
+CScheduler::SGroup* CScheduler::getGroup(const std::string& key, unsigned int nLimit) {
+  for (size_t n = 0; n < m_vGroups.size(); n++) {
+    if (m_vGroups[n]->key == key) return m_vGroups[n];
+  }
+  SGroup* pGroup = new SGroup;
+  pGroup->key = key;
+  pGroup->nBus = 0;
+  pGroup->bBus = false;
+  pGroup->nLimit = nLimit;
+  pGroup->nInflight = 0;
+  pGroup->nBytes = 0;
+  pGroup->nBusy = pGroup->nBusysince = pGroup->nFirst = pGroup->nLast = 0;
+  m_vGroups.push_back(pGroup);
+  return pGroup;
+}
+
+/* takes over a handle opened with CBootloader::openDevice. The hub is the
+   parent in the port path: "1-2.3" and "1-2.4" share hub "1-2". Devices
+   on a root port ("1-2", "1-3") have a link of their own to the host
+   controller, only the bus limits them. */
+int CScheduler::addDevice(libusb_device_handle* handle) {
+  libusb_device* dev = libusb_get_device(handle);
+  SDevice* pDevice = new SDevice;
+  pDevice->pBootloader = new CAsyncbootloader(handle);
+  applyWriteoptions(pDevice->pBootloader);
+  pDevice->path = CBootloader::getPath(dev);
+  pDevice->nPagesize = 0;
+  pDevice->nResult = ERROR_NONE;
+
+  size_t nParent = pDevice->path.find_last_of('.');
+  pDevice->pHub = NULL;
+  if (nParent != std::string::npos) {
+    pDevice->pHub = getGroup("hub " + pDevice->path.substr(0, nParent), m_nHublimit);
+    pDevice->pHub->nBus = libusb_get_bus_number(dev);
+  }
+  pDevice->pBus = getGroup("bus " + pDevice->path.substr(0, pDevice->path.find('-')),
+      m_nBuslimit);
+  pDevice->pBus->nBus = libusb_get_bus_number(dev);
+  pDevice->pBus->bBus = true;
+  m_vDevices.push_back(pDevice);
+  return ERROR_NONE;
+}
+
+/* open every attached bootloader, returns their number */
+unsigned int CScheduler::openAll() {
+  libusb_device** devList;
+  ssize_t size = libusb_get_device_list(NULL, &devList);
+  for (ssize_t n = 0; n < size; n++) {
+    libusb_device_handle* handle = CBootloader::openDevice(devList[n]);
+    if (handle != NULL) addDevice(handle);
+  }
+  if (size >= 0)
+    libusb_free_device_list(devList, 1);
+  return m_vDevices.size();
+}
+
+unsigned int CScheduler::getDevicecount() {
+  return m_vDevices.size();
+}
+
+const std::string& CScheduler::getDevicepath(unsigned int nDevice) {
+  return m_vDevices[nDevice]->path;
+}
+
+int CScheduler::getDeviceresult(unsigned int nDevice) {
+  return m_vDevices[nDevice]->nResult;
+}
+
+const char* CScheduler::getDevicemessage(unsigned int nDevice) {
+  return m_vDevices[nDevice]->nResult < 0
+      ? m_vDevices[nDevice]->pBootloader->getErrormessage() : "";
+}
+
+/* the slot goes to the first device in line, if any */
+void CScheduler::release(SGroup* pGroup, unsigned int nBytes) {
+  unsigned long long nNow = getMicroseconds();
+  pGroup->nBytes += nBytes;
+  pGroup->nLast = nNow;
+  if (!pGroup->waiters.empty()) {
+    std::coroutine_handle<> next = pGroup->waiters.front();
+    pGroup->waiters.pop_front();
+    next.resume();
+    return;
+  }
+  if (--pGroup->nInflight == 0) pGroup->nBusy += nNow - pGroup->nBusysince;
+}
+
+CTask<int> CScheduler::readInfo(SDevice* pDevice) {
+  int nResult = co_await pDevice->pBootloader->readInfo();
+  if (nResult == ERROR_NONE) pDevice->nPagesize = pDevice->pBootloader->getInfo()->pagesize;
+  co_return nResult;
+}
+
+/* one write request, holding a slot of the hub (if any) and of the bus */
+CTask<int> CScheduler::writeBatch(SDevice* pDevice, CPage** pages, unsigned int nCount) {
+  if (pDevice->pHub != NULL) co_await CSlotawaiter(pDevice->pHub);
+  co_await CSlotawaiter(pDevice->pBus);
+  int nResult = co_await pDevice->pBootloader->writePages(pages, nCount);
+  unsigned int nBytes = nResult < 0 ? 0 : nCount * pDevice->nPagesize;
+  release(pDevice->pBus, nBytes);
+  if (pDevice->pHub != NULL) release(pDevice->pHub, nBytes);
+  co_return nResult;
+}
+
+/* one copy request, the bus carries no page data but the device is busy
+   programming just the same */
+CTask<int> CScheduler::copyRun(SDevice* pDevice, unsigned int nAddress, unsigned int nSource,
+    unsigned int nCount) {
+  if (pDevice->pHub != NULL) co_await CSlotawaiter(pDevice->pHub);
+  co_await CSlotawaiter(pDevice->pBus);
+  int nResult = co_await pDevice->pBootloader->copyPages(nAddress, nSource, nCount);
+  unsigned int nBytes = nResult < 0 ? 0 : nCount * pDevice->nPagesize;
+  release(pDevice->pBus, nBytes);
+  if (pDevice->pHub != NULL) release(pDevice->pHub, nBytes);
+  co_return nResult;
+}
+
+/* the pages in batches of the bootloader's size and, if it can copy,
+   repeated pages as copy runs, planned as CFlashjob::flash does; every
+   request holds its own slots, so the devices take turns per batch */
+CTask<int> CScheduler::flashDevice(SDevice* pDevice, CFlashpatch* pFlashpatch) {
+  CAsyncbootloader* pBootloader = pDevice->pBootloader;
+  unsigned int nPagesize = pDevice->nPagesize;
+  CPage* batch[USBBOOT_MAXBATCH];
+  unsigned int nBatch = 0;
+  bool bCopy = pBootloader->canCopy();
+  std::unordered_map<unsigned long long, CPage*> written;
+  std::unordered_map<unsigned int, CPage*> queued;
+  unsigned int nCopy = 0;
+  unsigned int nCopyaddress = 0;
+  unsigned int nCopysource = 0;
+  int nResult = ERROR_NONE;
+
+  CPage* pPage;
+  for (pPage = pFlashpatch->getFirstpage(); pPage != NULL;
+       pPage = pFlashpatch->getNextpage(pPage)) {
+    if (pBootloader->checkRange(pPage->getPageaddress(), nPagesize) < 0)
+      co_return pBootloader->getError();
+  }
+
+  pPage = pFlashpatch->getFirstpage();
+  while (pPage != NULL) {
+    CPage* pSource = NULL;
+    if (bCopy) {
+      if (nCopy > 0 && nCopy < USBBOOT_MAXBATCH
+          && pPage->getPageaddress() == nCopyaddress + nCopy * nPagesize) {
+        std::unordered_map<unsigned int, CPage*>::iterator it =
+            queued.find(nCopysource + nCopy * nPagesize);
+        if (it != queued.end()
+            && memcmp(it->second->getData(), pPage->getData(), nPagesize) == 0)
+          pSource = it->second;
+      }
+      std::unordered_map<unsigned long long, CPage*>::iterator it =
+          written.insert(std::make_pair(pPage->getHash(), pPage)).first;
+      if (pSource == NULL && it->second != pPage
+          && memcmp(it->second->getData(), pPage->getData(), nPagesize) == 0)
+        pSource = it->second;
+      queued[pPage->getPageaddress()] = pPage;
+    }
+
+    if (pSource != NULL) {
+      if (nBatch > 0) {
+        nResult = co_await writeBatch(pDevice, batch, nBatch);
+        if (nResult < 0) co_return nResult;
+        nBatch = 0;
+      }
+      if (nCopy > 0 && (nCopy == USBBOOT_MAXBATCH
+          || pPage->getPageaddress() != nCopyaddress + nCopy * nPagesize
+          || pSource->getPageaddress() != nCopysource + nCopy * nPagesize)) {
+        nResult = co_await copyRun(pDevice, nCopyaddress, nCopysource, nCopy);
+        if (nResult < 0) co_return nResult;
+        nCopy = 0;
+      }
+      if (nCopy == 0) {
+        nCopyaddress = pPage->getPageaddress();
+        nCopysource = pSource->getPageaddress();
+      }
+      nCopy++;
+    } else {
+      if (nCopy > 0) {
+        nResult = co_await copyRun(pDevice, nCopyaddress, nCopysource, nCopy);
+        if (nResult < 0) co_return nResult;
+        nCopy = 0;
+      }
+      if (nBatch > 0 && (nBatch >= pBootloader->getBatchsize()
+          || pPage->getPageaddress() != batch[nBatch - 1]->getPageaddress() + nPagesize)) {
+        nResult = co_await writeBatch(pDevice, batch, nBatch);
+        if (nResult < 0) co_return nResult;
+        nBatch = 0;
+      }
+      batch[nBatch++] = pPage;
+    }
+    pPage = pFlashpatch->getNextpage(pPage);
+  }
+  if (nBatch > 0) {
+    nResult = co_await writeBatch(pDevice, batch, nBatch);
+    if (nResult < 0) co_return nResult;
+  }
+  if (nCopy > 0) nResult = co_await copyRun(pDevice, nCopyaddress, nCopysource, nCopy);
+  co_return nResult;
+}
+
+/* write the image of the job to every device, parsed once per page size.
+   Fails if any device fails, getDeviceresult() tells which. */
+int CScheduler::flash(CFlashjob* pJob) {
+  clearError();
+  if (m_vDevices.empty())
+    return setError(ERROR_NODEVICE, "No bootloader opened!");
+  if (!pJob->hasInputs())
+    return setError(ERROR_ARGUMENT, "No input file!");
+
+  std::vector<CTask<int> > tasks(m_vDevices.size());
+  std::vector<CTask<int>*> run(m_vDevices.size());
+  for (size_t n = 0; n < m_vDevices.size(); n++) {
+    tasks[n] = readInfo(m_vDevices[n]);
+    run[n] = &tasks[n];
+  }
+  if (CAsyncbootloader::run(NULL, run) < 0)
+    return setError(ERROR_TRANSFER, "USB event handling failed!");
+
+  /* devices that answered get the image for their page size */
+  run.clear();
+  std::vector<unsigned int> pagesizes;
+  std::vector<CFlashmem*> images;
+  std::vector<CFlashpatch*> patches;
+  for (size_t n = 0; n < m_vDevices.size(); n++) {
+    SDevice* pDevice = m_vDevices[n];
+    pDevice->nResult = tasks[n].getResult();
+    if (pDevice->nResult < 0) continue;
+
+    size_t nImage = 0;
+    while (nImage < pagesizes.size() && pagesizes[nImage] != pDevice->nPagesize) nImage++;
+    if (nImage == pagesizes.size()) {
+      CFlashmem* pFlashmem = pJob->loadImage(pDevice->nPagesize);
+      if (pFlashmem == NULL) {
+        setError(pJob->getError(), "%s", pJob->getErrormessage());
+        break;
+      }
+      CFlashpatch* pFlashpatch = new CFlashpatch(pFlashmem);
+      pagesizes.push_back(pDevice->nPagesize);
+      images.push_back(pFlashmem);
+      patches.push_back(pFlashpatch);
+      if (pJob->applyPatches(pFlashpatch) < 0) {
+        setError(pJob->getError(), "%s", pJob->getErrormessage());
+        break;
+      }
+    }
+    tasks[n] = flashDevice(pDevice, patches[nImage]);
+    run.push_back(&tasks[n]);
+  }
+
+  if (m_nError == ERROR_NONE) {
+    for (size_t n = 0; n < m_vGroups.size(); n++) {
+      SGroup* pGroup = m_vGroups[n];
+      pGroup->nBytes = 0;
+      pGroup->nBusy = pGroup->nFirst = pGroup->nLast = 0;
+    }
+    if (CAsyncbootloader::run(NULL, run) < 0)
+      setError(ERROR_TRANSFER, "USB event handling failed!");
+  }
+
+  unsigned int nFailed = 0;
+  for (size_t n = 0; n < m_vDevices.size(); n++) {
+    if (m_vDevices[n]->nResult == ERROR_NONE) {
+      bool bRun = false;
+      for (size_t k = 0; k < run.size(); k++) bRun = bRun || run[k] == &tasks[n];
+      m_vDevices[n]->nResult = bRun && m_nError == ERROR_NONE ? tasks[n].getResult() : m_nError;
+    }
+    if (m_vDevices[n]->nResult < 0) nFailed++;
+  }
+  /* tasks first, they refer to the images */
+  tasks.clear();
+  for (size_t n = 0; n < patches.size(); n++) {
+    delete patches[n];
+    delete images[n];
+  }
+
+  m_vUsage.clear();
+  for (size_t n = 0; n < m_vGroups.size(); n++) {
+    SGroup* pBus = m_vGroups[n];
+    if (!pBus->bBus) continue;
+    SBususage usage = { pBus->nBus, 0, 0, pBus->nBytes, pBus->nBusy,
+                        pBus->nLast - pBus->nFirst };
+    for (size_t k = 0; k < m_vDevices.size(); k++)
+      if (m_vDevices[k]->pBus == pBus) usage.devices++;
+    for (size_t k = 0; k < m_vGroups.size(); k++)
+      if (!m_vGroups[k]->bBus && m_vGroups[k]->nBus == pBus->nBus) usage.hubs++;
+    m_vUsage.push_back(usage);
+  }
+
+  if (m_nError < 0) return m_nError;
+  if (nFailed > 0)
+    return setError(ERROR_TRANSFER, "%u of %u devices failed", nFailed,
+                    (unsigned int) m_vDevices.size());
+  return ERROR_NONE;
+}
+
+/* bytes and busy time per bus of the last flash() */
+const std::vector<SBususage>& CScheduler::getBususage() {
+  return m_vUsage;
+}
@@ -0,0 +1,82 @@
+/*
+  cscheduler.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Flashes every attached bootloader from one thread. Devices behind one hub
+  share its upstream link and all hubs of a bus share the bus, so the
+  scheduler groups the devices by hub and by bus and lets only a few write
+  requests per group be in flight. Slots are handed out in turn per batch:
+  while one device programs its pages the next one gets the bus.
+
+  The interface compiles as C++11, the coroutines stay in cscheduler.cpp
+  (C++20).
+*/
+
+#ifndef _H_CSCHEDULER_
+#define _H_CSCHEDULER_
+
+#include <string>
+#include <vector>
+
+#include "libusb.h"
+#include "cflashjob.h"
+#include "cerror.h"
+
+#define SCHEDULER_HUBLIMIT 2   /* write requests in flight per hub */
+#define SCHEDULER_BUSLIMIT 4   /* write requests in flight per bus */
+
+class CAsyncbootloader;
+template <typename T> class CTask;
+
+/* one bus after a flash run */
+struct SBususage {
+  unsigned int bus;
+  unsigned int devices;
+  unsigned int hubs;
+  unsigned long bytes;          /* page data written */
+  unsigned long long busy;      /* us with a write in flight */
+  unsigned long long elapsed;   /* us from the first to the last write */
+};
+
+class CScheduler : public CErrorstate {
+ public:
+  CScheduler();
+  ~CScheduler();
+  void setLimits(unsigned int nHublimit, unsigned int nBuslimit);
+  void setWriteoptions(unsigned int nBatchlimit, bool bCompress, bool bCopy,
+                       unsigned int nRetries);
+  int addDevice(libusb_device_handle* handle);
+  unsigned int openAll();
+  unsigned int getDevicecount();
+  const std::string& getDevicepath(unsigned int nDevice);
+  int getDeviceresult(unsigned int nDevice);
+  const char* getDevicemessage(unsigned int nDevice);
+  int flash(CFlashjob* pJob);
+  const std::vector<SBususage>& getBususage();
+
+ protected:
+  struct SGroup;
+  struct SDevice;
+  class CSlotawaiter;
+
+  CTask<int> readInfo(SDevice* pDevice);
+  CTask<int> writeBatch(SDevice* pDevice, CPage** pages, unsigned int nCount);
+  CTask<int> copyRun(SDevice* pDevice, unsigned int nAddress, unsigned int nSource,
+                     unsigned int nCount);
+  CTask<int> flashDevice(SDevice* pDevice, CFlashpatch* pFlashpatch);
+  SGroup* getGroup(const std::string& key, unsigned int nLimit);
+  static void release(SGroup* pGroup, unsigned int nBytes);
+  static unsigned long long getMicroseconds();
+  void applyWriteoptions(CAsyncbootloader* pBootloader);
+
+  unsigned int m_nHublimit;
+  unsigned int m_nBuslimit;
+  unsigned int m_nBatchlimit;
+  bool m_bCompress;
+  bool m_bCopy;
+  unsigned int m_nRetries;
+  std::vector<SDevice*> m_vDevices;
+  std::vector<SGroup*> m_vGroups;
+  std::vector<SBususage> m_vUsage;
+};
+
+#endif
@@ -0,0 +1,298 @@
+/*
+  csharedimage.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Image store in POSIX shared memory for concurrently running flash tools:
+  the first process parses the image into a read only page table, later
+  processes attach and use the pages in place.
+
+  The segment is named after a hash of the image key without the source
+  file state. The full key (including size, mtime and inode of the files)
+  is stored in the header; an attacher finding a different key marks the
+  segment invalid and unlinks it, processes still attached keep their
+  mapping. The last process to detach does the same, so the segment only
+  lives while tools use it. Whoever marks a segment invalid unlinks it, the
+  flag is set once, so a name is never unlinked under a successor.
+
+  A creator that cannot parse the image publishes an invalid header, so
+  waiting processes fail at once. A process that dies while attached
+  leaves its reference behind and the segment stays in /dev/shm until its
+  source files change or it is removed by hand (rm /dev/shm/avrusbboot-*);
+  running tools keep their mapping. The same goes for a creator that dies
+  before sizing the segment: others parse locally after SHAREDIMAGE_WAIT.
+  Waiters never unlink by name, only whoever invalidates a segment does.
+  Segment layout:
+    header (one page, mapped read/write for the reference count)
+    page table: one SEntry per page, in image order
+    page data: nPagecount * nPagesize bytes
+    coverage bitmaps: nPagecount * nCoveragewords words
+*/
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "csharedimage.h"
+
+#define SHAREDIMAGE_MAGIC      0x41555349  /* "AUSI" */
+#define SHAREDIMAGE_HEADERSIZE 4096
+
+struct CSharedimage::SHeader {
+  unsigned int nMagic;
+  int nReady;
+  int nInvalid;
+  int nRefcount;
+  unsigned int nPagesize;
+  unsigned int nPagecount;
+  unsigned int nCoveragewords;
+  unsigned int nReserved;
+  char szKey[SHAREDIMAGE_HEADERSIZE - 32];
+};
+
+struct CSharedimage::SEntry {
+  unsigned int nAddress;
+};
+
+CSharedimage::CSharedimage() {
+  m_pHeader = NULL;
+  m_pData = NULL;
+  m_nDatasize = 0;
+  m_pFlashmem = NULL;
+}
+
+CSharedimage::~CSharedimage() {
+  detach();
+}
+
+unsigned int CSharedimage::getRefcount() {
+  return m_pHeader ? __atomic_load_n(&m_pHeader->nRefcount, __ATOMIC_ACQUIRE) : 0;
+}
+
+static void sleepMilliseconds(unsigned int ms) {
+  usleep(ms * 1000);
+}
+
+/* mark the segment invalid, true for the one caller that did it */
+static bool invalidate(int* pInvalid) {
+  int nExpected = 0;
+  return __atomic_compare_exchange_n(pInvalid, &nExpected, 1, false,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* map header read/write and the page table and data read only */
+bool CSharedimage::map(int fd, size_t nSize) {
+  void* pHeader = mmap(NULL, SHAREDIMAGE_HEADERSIZE, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  if (pHeader == MAP_FAILED) return false;
+  m_pHeader = (SHeader*) pHeader;
+
+  m_nDatasize = nSize - SHAREDIMAGE_HEADERSIZE;
+  if (m_nDatasize > 0) {
+    void* pData = mmap(NULL, m_nDatasize, PROT_READ, MAP_SHARED, fd,
+        SHAREDIMAGE_HEADERSIZE);
+    if (pData == MAP_FAILED) {
+      munmap(m_pHeader, SHAREDIMAGE_HEADERSIZE);
+      m_pHeader = NULL;
+      return false;
+    }
+    m_pData = (unsigned char*) pData;
+  }
+  return true;
+}
+
+/* creator that cannot publish the image: a header marked invalid lets
+   waiting processes give up at once. The creator is the one to invalidate
+   the new segment, so it also unlinks it. */
+void CSharedimage::fail(int fd, const char* name) {
+  if (ftruncate(fd, SHAREDIMAGE_HEADERSIZE) == 0) {
+    void* pHeader = mmap(NULL, SHAREDIMAGE_HEADERSIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (pHeader != MAP_FAILED) {
+      ((SHeader*) pHeader)->nMagic = SHAREDIMAGE_MAGIC;
+      invalidate(&((SHeader*) pHeader)->nInvalid);
+      __atomic_store_n(&((SHeader*) pHeader)->nReady, 1, __ATOMIC_RELEASE);
+      munmap(pHeader, SHAREDIMAGE_HEADERSIZE);
+    }
+  }
+  shm_unlink(name);
+  close(fd);
+}
+
+/* first process: parse the image and publish it. 1 success, 0 if the
+   segment exists already or cannot be created, -1 if parsing failed. */
+int CSharedimage::create(const char* name, CFlashjob* pJob, unsigned int pagesize,
+    const std::string& key) {
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) return 0;
+
+  CFlashmem* pFlashmem = pJob->loadImage(pagesize);
+  if (pFlashmem == NULL) {
+    fail(fd, name);
+    return -1;
+  }
+  unsigned int nPagecount = pFlashmem->getPagecount();
+  unsigned int nCoveragewords = PAGE_COVERAGEWORDS(pagesize);
+  size_t nTablesize = nPagecount * sizeof(SEntry);
+  size_t nDatasize = (size_t) nPagecount * pagesize;
+  size_t nSize = SHAREDIMAGE_HEADERSIZE + nTablesize + nDatasize
+      + (size_t) nPagecount * nCoveragewords * sizeof(unsigned int);
+
+  void* pSegment = MAP_FAILED;
+  if (ftruncate(fd, nSize) == 0)
+    pSegment = mmap(NULL, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pSegment == MAP_FAILED) {
+    fprintf(stderr, "Cannot create shared image %s: %s\n", name, strerror(errno));
+    fail(fd, name);
+    delete pFlashmem;
+    return 0;
+  }
+
+  SHeader* pHeader = (SHeader*) pSegment;
+  SEntry* pEntries = (SEntry*) ((unsigned char*) pSegment + SHAREDIMAGE_HEADERSIZE);
+  unsigned char* pData = (unsigned char*) pEntries + nTablesize;
+  unsigned int* pCoverage = (unsigned int*) (pData + nDatasize);
+
+  unsigned int n = 0;
+  for (CPage* pPage = pFlashmem->getFirstpage(); pPage != NULL; pPage = pPage->getNext(), n++) {
+    pEntries[n].nAddress = pPage->getPageaddress();
+    memcpy(pData + (size_t) n * pagesize, pPage->getData(), pagesize);
+    memcpy(pCoverage + (size_t) n * nCoveragewords, pPage->getCoverage(),
+        nCoveragewords * sizeof(unsigned int));
+  }
+  delete pFlashmem;
+
+  pHeader->nMagic = SHAREDIMAGE_MAGIC;
+  pHeader->nInvalid = 0;
+  pHeader->nRefcount = 0;
+  pHeader->nPagesize = pagesize;
+  pHeader->nPagecount = nPagecount;
+  pHeader->nCoveragewords = nCoveragewords;
+  strcpy(pHeader->szKey, key.c_str());
+  __atomic_store_n(&pHeader->nReady, 1, __ATOMIC_RELEASE);
+  munmap(pSegment, nSize);
+
+  close(fd);
+  return 1;
+}
+
+/* attach to a published segment: 1 success, 0 no segment, -1 stale or
+   failed, -2 if its creator never sized it (it died; the name stays until
+   removed by hand, it may belong to a successor by now) */
+int CSharedimage::open(const char* name, const std::string& key) {
+  int fd = shm_open(name, O_RDWR, 0600);
+  if (fd < 0) return 0;
+
+  /* the creator may still be parsing */
+  struct stat st;
+  unsigned int nWaited = 0;
+  while (fstat(fd, &st) == 0 && st.st_size < SHAREDIMAGE_HEADERSIZE
+      && nWaited < SHAREDIMAGE_WAIT) {
+    sleepMilliseconds(10);
+    nWaited += 10;
+  }
+  if (st.st_size < SHAREDIMAGE_HEADERSIZE || !map(fd, st.st_size)) {
+    close(fd);
+    return -2;
+  }
+  close(fd);
+
+  while (!__atomic_load_n(&m_pHeader->nReady, __ATOMIC_ACQUIRE) && nWaited < SHAREDIMAGE_WAIT) {
+    sleepMilliseconds(10);
+    nWaited += 10;
+  }
+
+  SHeader* pHeader = m_pHeader;
+  bool bValid = __atomic_load_n(&pHeader->nReady, __ATOMIC_ACQUIRE)
+      && !__atomic_load_n(&pHeader->nInvalid, __ATOMIC_ACQUIRE)
+      && pHeader->nMagic == SHAREDIMAGE_MAGIC
+      && key == pHeader->szKey;
+  if (!bValid) {
+    /* source changed or creator died: nobody may attach any more, the
+       memory goes away when the last process detaches */
+    if (invalidate(&pHeader->nInvalid))
+      shm_unlink(name);
+    detach();
+    return -1;
+  }
+
+  /* the last user may have left between the check and the increment */
+  __atomic_add_fetch(&pHeader->nRefcount, 1, __ATOMIC_ACQ_REL);
+  if (__atomic_load_n(&pHeader->nInvalid, __ATOMIC_ACQUIRE)) {
+    __atomic_sub_fetch(&pHeader->nRefcount, 1, __ATOMIC_ACQ_REL);
+    detach();
+    return -1;
+  }
+  m_sName = name;
+
+  m_pFlashmem = new CFlashmem(pHeader->nPagesize);
+  SEntry* pEntries = (SEntry*) m_pData;
+  unsigned char* pData = m_pData + pHeader->nPagecount * sizeof(SEntry);
+  unsigned int* pCoverage = (unsigned int*) (pData + (size_t) pHeader->nPagecount * pHeader->nPagesize);
+  for (unsigned int n = 0; n < pHeader->nPagecount; n++) {
+    m_pFlashmem->insertPageview(pEntries[n].nAddress, pData + (size_t) n * pHeader->nPagesize,
+        pCoverage + (size_t) n * pHeader->nCoveragewords);
+  }
+  return 1;
+}
+
+/* 64 bit FNV-1a */
+static unsigned long long hashKey(const std::string& key) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (size_t n = 0; n < key.size(); n++) {
+    hash ^= (unsigned char) key[n];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/* image of the job for the given page size, shared with other processes.
+   The returned image is read only and valid until this object is destroyed.
+   NULL if the image cannot be parsed, the error is kept in pJob. */
+CFlashmem* CSharedimage::attach(CFlashjob* pJob, unsigned int pagesize) {
+  detach();
+
+  std::string key = pJob->getImagekey(pagesize);
+  if (key.size() < sizeof(((SHeader*) 0)->szKey)) {
+    char name[64];
+    snprintf(name, sizeof(name), "/avrusbboot-%016llx",
+        hashKey(pJob->getImagekey(pagesize, false)));
+
+    for (int nAttempt = 0; nAttempt < 3; nAttempt++) {
+      int nOpened = open(name, key);
+      if (nOpened > 0) return m_pFlashmem;
+      if (nOpened < -1) break;
+      int nCreated = create(name, pJob, pagesize, key);
+      if (nCreated < 0) return NULL;
+      if (nCreated > 0 && open(name, key) > 0) return m_pFlashmem;
+    }
+  }
+
+  fprintf(stderr, "Warning: shared image not available, parsing locally\n");
+  m_pFlashmem = pJob->loadImage(pagesize);
+  return m_pFlashmem;
+}
+
+void CSharedimage::detach() {
+  delete m_pFlashmem;
+  m_pFlashmem = NULL;
+
+  /* the last user removes the segment. An invalid segment was unlinked
+     when it was invalidated, unlinking by name again could hit its
+     successor */
+  if (m_pHeader != NULL && !m_sName.empty()
+      && __atomic_sub_fetch(&m_pHeader->nRefcount, 1, __ATOMIC_ACQ_REL) == 0
+      && invalidate(&m_pHeader->nInvalid))
+    shm_unlink(m_sName.c_str());
+  m_sName.clear();
+
+  if (m_pData != NULL) munmap(m_pData, m_nDatasize);
+  if (m_pHeader != NULL) munmap(m_pHeader, SHAREDIMAGE_HEADERSIZE);
+  m_pData = NULL;
+  m_pHeader = NULL;
+  m_nDatasize = 0;
+}
+
+#endif
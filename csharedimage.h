@@ -0,0 +1,44 @@
+/*
+  csharedimage.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Image store in POSIX shared memory for concurrently running flash tools:
+  the first process parses the image into a read only page table, later
+  processes attach and use the pages in place.
+*/
+
+#ifndef _H_CSHAREDIMAGE_
+#define _H_CSHAREDIMAGE_
+
+#include <string>
+
+#include "cflashjob.h"
+
+/* how long to wait for another process to finish parsing (ms) */
+#define SHAREDIMAGE_WAIT 30000
+
+class CSharedimage {
+ public:
+  CSharedimage();
+  ~CSharedimage();
+  CFlashmem* attach(CFlashjob* pJob, unsigned int pagesize);
+  unsigned int getRefcount();
+  void detach();
+
+ protected:
+  struct SHeader;
+  struct SEntry;
+
+  int create(const char* name, CFlashjob* pJob, unsigned int pagesize,
+             const std::string& key);
+  int open(const char* name, const std::string& key);
+  bool map(int fd, size_t nSize);
+  void fail(int fd, const char* name);
+
+  SHeader* m_pHeader;
+  unsigned char* m_pData;
+  size_t m_nDatasize;
+  std::string m_sName;
+  CFlashmem* m_pFlashmem;
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*
+  cstation.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Production station loop: waits for a bootloader to appear, flashes it,
+  optionally verifies it, starts the application and waits for the next
+  board. libusb and the parsed image are kept for the whole session; every
+  unit is logged with its cycle time, the units per hour and the failure
+  rate so far.
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#endif
+#include <stdio.h>
+
+#include "cstation.h"
+
+CStation::CStation(CFlasher* pFlasher) {
+  m_pFlasher = pFlasher;
+  m_bVerify = false;
+  m_nUnits = 0;
+  m_nFailures = 0;
+  m_nStart = 0;
+  m_nLastseen = 0;
+  libusb_init(NULL);
+}
+
+CStation::~CStation() {
+  m_pFlasher->close();
+  libusb_exit(NULL);
+}
+
+void CStation::setVerify(bool bVerify) {
+  m_bVerify = bVerify;
+}
+
+/* only boards at this bus and port path or with this serial number */
+void CStation::setSelector(const std::string& selector) {
+  m_sSelector = selector;
+}
+
+unsigned int CStation::getUnits() {
+  return m_nUnits;
+}
+
+unsigned int CStation::getFailures() {
+  return m_nFailures;
+}
+
+unsigned long long CStation::getMilliseconds() {
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+#endif
+}
+
+void CStation::sleep(unsigned int nMilliseconds) {
+#ifdef _WIN32
+  Sleep(nMilliseconds);
+#else
+  usleep(nMilliseconds * 1000);
+#endif
+}
+
+/* Scan the bus until a bootloader shows up and open it. The board of the
+   last unit is not taken again before its port has been empty for
+   STATION_SETTLETIME, so a board that stays in (or falls back to) the
+   bootloader is not flashed twice; the application starting does not
+   count as leaving. Devices whose strings show they are no bootloader
+   (or not the selected one) are opened once and then skipped until they
+   leave the bus, i.e. until their path is empty or has a new address.
+   One that could not be opened or asked is tried again next scan. */
+libusb_device_handle* CStation::waitDevice(std::string& path) {
+  for (;;) {
+    libusb_device** devList;
+    libusb_device_handle* handle = NULL;
+    bool bLastpresent = false;
+    std::map<std::string, uint8_t> rejected;
+
+    ssize_t size = libusb_get_device_list(NULL, &devList);
+    for (ssize_t n = 0; n < size; n++) {
+      struct libusb_device_descriptor descriptor;
+      if (libusb_get_device_descriptor(devList[n], &descriptor) < 0
+          || descriptor.idVendor != USBDEV_SHARED_VENDOR
+          || descriptor.idProduct != USBDEV_SHARED_PRODUCT)
+        continue;
+      std::string devpath = CBootloader::getPath(devList[n]);
+      uint8_t nAddress = libusb_get_device_address(devList[n]);
+      if (devpath == m_sLastpath) {
+        bLastpresent = true;
+        continue;
+      }
+      std::map<std::string, uint8_t>::iterator it = m_mRejected.find(devpath);
+      if (it != m_mRejected.end() && it->second == nAddress) {
+        rejected[devpath] = nAddress;
+        continue;
+      }
+      if (handle != NULL) continue;
+      bool bMismatch;
+      handle = CBootloader::openDevice(devList[n], m_sSelector, &bMismatch);
+      if (handle != NULL)
+        path = devpath;
+      else if (bMismatch)
+        rejected[devpath] = nAddress;
+    }
+    if (size >= 0)
+      libusb_free_device_list(devList, 1);
+    m_mRejected.swap(rejected);
+
+    unsigned long long nNow = getMilliseconds();
+    if (bLastpresent)
+      m_nLastseen = nNow;
+    else if (nNow - m_nLastseen > STATION_SETTLETIME)
+      m_sLastpath.clear();
+    if (handle != NULL) return handle;
+    sleep(STATION_POLLINTERVAL);
+  }
+}
+
+int CStation::flashUnit(CFlashjob* pJob, libusb_device_handle* handle) {
+  if (m_pFlasher->open(handle) < 0 || m_pFlasher->flash(pJob, NULL, NULL) < 0
+      || (m_bVerify && m_pFlasher->verify() < 0) || m_pFlasher->startApplication() < 0) {
+    m_pFlasher->close();
+    return setError(m_pFlasher->getError(), "%s", m_pFlasher->getErrormessage());
+  }
+  m_pFlasher->close();
+  return ERROR_NONE;
+}
+
+/* flash nUnits boards (0: until the process is stopped). A failed board
+   is counted and the station goes on; errors of the image itself end the
+   session, every further board would fail the same way. */
+int CStation::run(CFlashjob* pJob, unsigned int nUnits) {
+  clearError();
+  if (!pJob->hasInputs())
+    return setError(ERROR_ARGUMENT, "No input file!");
+
+  while (nUnits == 0 || m_nUnits < nUnits) {
+    fprintf(stdout, "Waiting for unit %u...\n", m_nUnits + 1);
+    fflush(stdout);
+
+    std::string path;
+    libusb_device_handle* handle = waitDevice(path);
+    unsigned long long nBegin = getMilliseconds();
+    if (m_nStart == 0) m_nStart = nBegin;
+
+    int nResult = flashUnit(pJob, handle);
+    unsigned long long nEnd = getMilliseconds();
+    m_sLastpath = path;
+    m_nLastseen = nEnd;
+    m_nUnits++;
+    if (nResult < 0) m_nFailures++;
+
+    /* the first unit counts from its own start, later ones from the
+       first: units per hour include the handling between boards */
+    unsigned long long nElapsed = nEnd - m_nStart;
+    unsigned long long nRate = nElapsed > 0 ? m_nUnits * 3600000ULL / nElapsed : 0;
+    fprintf(stdout, "Unit %u at %s: %s%s, cycle %llu.%03llu s, %llu units/h, "
+        "%u failed (%u%%)\n", m_nUnits, path.c_str(), nResult < 0 ? "FAILED " : "OK",
+        nResult < 0 ? m_szError : "", (nEnd - nBegin) / 1000, (nEnd - nBegin) % 1000,
+        nRate, m_nFailures, m_nFailures * 100 / m_nUnits);
+    fflush(stdout);
+
+    if (nResult == ERROR_FILE || nResult == ERROR_FORMAT || nResult == ERROR_OVERLAP
+        || nResult == ERROR_MEMORY)
+      return m_nError;
+  }
+  clearError();
+  return ERROR_NONE;
+}
@@ -0,0 +1,53 @@
+/*
+  cstation.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Production station loop: waits for a bootloader to appear, flashes it,
+  optionally verifies it, starts the application and waits for the next
+  board. libusb and the parsed image are kept for the whole session; every
+  unit is logged with its cycle time, the units per hour and the failure
+  rate so far.
+*/
+
+#ifndef _H_CSTATION_
+#define _H_CSTATION_
+
+#include <map>
+#include <string>
+
+#include "libusb.h"
+#include "cflasher.h"
+#include "cflashjob.h"
+#include "cerror.h"
+
+#define STATION_POLLINTERVAL 100   /* ms between scans of the bus */
+#define STATION_SETTLETIME  2000   /* ms the last board's port must stay empty,
+                                      longer than a re-enumeration */
+
+class CStation : public CErrorstate {
+ public:
+  CStation(CFlasher* pFlasher);
+  ~CStation();
+  void setVerify(bool bVerify);
+  void setSelector(const std::string& selector);
+  int run(CFlashjob* pJob, unsigned int nUnits);
+  unsigned int getUnits();
+  unsigned int getFailures();
+
+ protected:
+  libusb_device_handle* waitDevice(std::string& path);
+  int flashUnit(CFlashjob* pJob, libusb_device_handle* handle);
+  static unsigned long long getMilliseconds();
+  static void sleep(unsigned int nMilliseconds);
+
+  CFlasher* m_pFlasher;
+  bool m_bVerify;
+  std::string m_sSelector;
+  std::string m_sLastpath;   /* board of the last unit, until it is unplugged */
+  unsigned long long m_nLastseen;   /* ms, last scan that found it */
+  std::map<std::string, uint8_t> m_mRejected;   /* path to address, see waitDevice */
+  unsigned int m_nUnits;
+  unsigned int m_nFailures;
+  unsigned long long m_nStart;
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*
+  ctask.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Coroutine task for the asynchronous bootloader API (C++20). A task is
+  started lazily: either by co_await from another task, which resumes the
+  awaiting task when this one finishes, or by start() from the event loop.
+*/
+
+#ifndef _H_CTASK_
+#define _H_CTASK_
+
+#include <coroutine>
+#include <exception>
+
+template <typename T>
+class CTask {
+ public:
+  struct promise_type {
+    T m_value;
+    std::coroutine_handle<> m_continuation;
+
+    CTask get_return_object() {
+      return CTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    /* hand control back to the awaiting task, if any */
+    struct SFinalawaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        std::coroutine_handle<> continuation = h.promise().m_continuation;
+        return continuation ? continuation : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    SFinalawaiter final_suspend() noexcept { return {}; }
+
+    void return_value(T value) { m_value = value; }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  CTask() {}
+  explicit CTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+  CTask(CTask&& other) : m_handle(other.m_handle) { other.m_handle = {}; }
+  CTask& operator=(CTask&& other) {
+    if (this != &other) {
+      if (m_handle) m_handle.destroy();
+      m_handle = other.m_handle;
+      other.m_handle = {};
+    }
+    return *this;
+  }
+  CTask(const CTask&) = delete;
+  CTask& operator=(const CTask&) = delete;
+  ~CTask() {
+    if (m_handle) m_handle.destroy();
+  }
+
+  /* run a top level task up to its first suspension */
+  void start() { m_handle.resume(); }
+  bool isDone() { return !m_handle || m_handle.done(); }
+  T getResult() { return m_handle.promise().m_value; }
+
+  /* co_await support */
+  bool await_ready() { return isDone(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+    m_handle.promise().m_continuation = caller;
+    return m_handle;
+  }
+  T await_resume() { return m_handle.promise().m_value; }
+
+ protected:
+  std::coroutine_handle<promise_type> m_handle;
+};
+
+#endif
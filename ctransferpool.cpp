@@ -0,0 +1,164 @@
+/*
+  ctransferpool.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Preallocated libusb transfers with setup+payload buffers, reused for
+  every request so the steady state write path allocates nothing. Buffers
+  come from libusb_dev_mem_alloc (DMA-able, no copy in the kernel) where
+  libusb and the platform support it.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctransferpool.h"
+
+/* libusb_dev_mem_alloc is available from libusb 1.0.21 */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define TRANSFERPOOL_DEVMEM
+#endif
+
+CTransferpool::CTransferpool(libusb_device_handle* handle, unsigned int nSlots,
+    unsigned int nPayload) {
+  m_pHandle = handle;
+  m_nAllocations = 0;
+  m_nAcquires = 0;
+
+  m_vSlots.reserve(nSlots);
+  for (unsigned int n = 0; n < nSlots; n++) {
+    SSlot* pSlot = createSlot(nPayload);
+    if (pSlot == NULL) break;
+    m_vSlots.push_back(pSlot);
+  }
+}
+
+CTransferpool::~CTransferpool() {
+  for (size_t n = 0; n < m_vSlots.size(); n++) {
+    /* libusb may still write to an abandoned transfer, leak it */
+    if (m_vSlots[n]->bAbandoned) continue;
+    freeBuffer(m_vSlots[n]);
+    libusb_free_transfer(m_vSlots[n]->pTransfer);
+    delete m_vSlots[n];
+  }
+}
+
+bool CTransferpool::allocBuffer(SSlot* pSlot, unsigned int nPayload) {
+  size_t nSize = LIBUSB_CONTROL_SETUP_SIZE + nPayload;
+
+  pSlot->pBuffer = NULL;
+  pSlot->bDevicemem = false;
+#ifdef TRANSFERPOOL_DEVMEM
+  if (m_pHandle != NULL)
+    pSlot->pBuffer = libusb_dev_mem_alloc(m_pHandle, nSize);
+  pSlot->bDevicemem = pSlot->pBuffer != NULL;
+#endif
+  if (pSlot->pBuffer == NULL)
+    pSlot->pBuffer = (unsigned char*) malloc(nSize);
+  pSlot->nCapacity = nPayload;
+  m_nAllocations++;
+  return pSlot->pBuffer != NULL;
+}
+
+void CTransferpool::freeBuffer(SSlot* pSlot) {
+#ifdef TRANSFERPOOL_DEVMEM
+  if (pSlot->bDevicemem) {
+    libusb_dev_mem_free(m_pHandle, pSlot->pBuffer,
+        LIBUSB_CONTROL_SETUP_SIZE + pSlot->nCapacity);
+    pSlot->pBuffer = NULL;
+    return;
+  }
+#endif
+  free(pSlot->pBuffer);
+  pSlot->pBuffer = NULL;
+}
+
+CTransferpool::SSlot* CTransferpool::createSlot(unsigned int nPayload) {
+  SSlot* pSlot = new SSlot;
+  m_nAllocations += 2;
+  pSlot->bBusy = false;
+  pSlot->bAbandoned = false;
+  pSlot->nDone = 0;
+  pSlot->nCompleted = 0;
+  if ((pSlot->pTransfer = libusb_alloc_transfer(0)) == NULL) {
+    delete pSlot;
+    return NULL;
+  }
+  if (!allocBuffer(pSlot, nPayload)) {
+    libusb_free_transfer(pSlot->pTransfer);
+    delete pSlot;
+    return NULL;
+  }
+  return pSlot;
+}
+
+/* a free slot with room for nPayload bytes, NULL if out of memory. The
+   pool only grows when more transfers are in flight than slots exist or a
+   payload exceeds the buffers. */
+CTransferpool::SSlot* CTransferpool::acquire(unsigned int nPayload) {
+  m_nAcquires++;
+
+  SSlot* pSlot = NULL;
+  for (size_t n = 0; n < m_vSlots.size() && pSlot == NULL; n++) {
+    if (!m_vSlots[n]->bBusy) pSlot = m_vSlots[n];
+  }
+
+  if (pSlot == NULL) {
+    if ((pSlot = createSlot(nPayload)) == NULL) return NULL;
+    m_vSlots.push_back(pSlot);
+  } else if (pSlot->nCapacity < nPayload) {
+    freeBuffer(pSlot);
+    if (!allocBuffer(pSlot, nPayload)) return NULL;
+  }
+
+  pSlot->bBusy = true;
+  return pSlot;
+}
+
+void CTransferpool::release(SSlot* pSlot) {
+  if (!pSlot->bAbandoned) pSlot->bBusy = false;
+}
+
+/* the transfer of the slot could not be completed or cancelled (event
+   handling failed): the slot stays busy for good and is never freed,
+   release() leaves it alone */
+void CTransferpool::abandon(SSlot* pSlot) {
+  pSlot->bAbandoned = true;
+  pSlot->bBusy = true;
+}
+
+/* the device was opened again: buffers in device memory of the old handle
+   move to the heap (contents kept, slots may be in use), new buffers come
+   from the new handle. Call before closing the old handle. */
+void CTransferpool::setHandle(libusb_device_handle* handle) {
+#ifdef TRANSFERPOOL_DEVMEM
+  for (size_t n = 0; n < m_vSlots.size(); n++) {
+    SSlot* pSlot = m_vSlots[n];
+    if (!pSlot->bDevicemem || pSlot->bAbandoned) continue;
+    size_t nSize = LIBUSB_CONTROL_SETUP_SIZE + pSlot->nCapacity;
+    unsigned char* pBuffer = (unsigned char*) malloc(nSize);
+    if (pBuffer == NULL) continue;
+    memcpy(pBuffer, pSlot->pBuffer, nSize);
+    libusb_dev_mem_free(m_pHandle, pSlot->pBuffer, nSize);
+    pSlot->pBuffer = pBuffer;
+    pSlot->bDevicemem = false;
+    m_nAllocations++;
+  }
+#endif
+  m_pHandle = handle;
+}
+
+/* allocations since construction; constant in the steady state */
+unsigned long CTransferpool::getAllocations() {
+  return m_nAllocations;
+}
+
+unsigned long CTransferpool::getAcquires() {
+  return m_nAcquires;
+}
+
+/* buffers in device memory (0 where libusb_dev_mem_alloc is unavailable) */
+unsigned int CTransferpool::getDevicemembuffers() {
+  unsigned int nCount = 0;
+  for (size_t n = 0; n < m_vSlots.size(); n++)
+    nCount += m_vSlots[n]->bDevicemem;
+  return nCount;
+}
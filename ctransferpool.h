@@ -0,0 +1,60 @@
+/*
+  ctransferpool.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Preallocated libusb transfers with setup+payload buffers, reused for
+  every request so the steady state write path allocates nothing. Buffers
+  come from libusb_dev_mem_alloc (DMA-able, no copy in the kernel) where
+  libusb and the platform support it.
+*/
+
+#ifndef _H_CTRANSFERPOOL_
+#define _H_CTRANSFERPOOL_
+
+#include <vector>
+
+#include "libusb.h"
+
+/* transfers allocated up front */
+#define TRANSFERPOOL_SLOTS 2
+/* initial payload capacity of every buffer: one page of the ATmega and
+   ATtiny parts. XMEGA pages (512 bytes), batches and bulk runs grow a
+   slot on its first use, later requests reuse it */
+#define TRANSFERPOOL_PAYLOAD 256
+
+class CTransferpool {
+ public:
+  struct SSlot {
+    libusb_transfer* pTransfer;
+    unsigned char* pBuffer;       /* setup packet followed by the payload */
+    unsigned int nCapacity;       /* payload bytes */
+    bool bDevicemem;
+    bool bBusy;
+    bool bAbandoned;              /* libusb may still own the transfer */
+    int nDone;                    /* set by the completion callback */
+    unsigned long long nCompleted; /* us, stamped by the callback */
+  };
+
+  CTransferpool(libusb_device_handle* handle, unsigned int nSlots = TRANSFERPOOL_SLOTS,
+                unsigned int nPayload = TRANSFERPOOL_PAYLOAD);
+  ~CTransferpool();
+  SSlot* acquire(unsigned int nPayload);
+  void release(SSlot* pSlot);
+  void abandon(SSlot* pSlot);
+  void setHandle(libusb_device_handle* handle);
+  unsigned long getAllocations();
+  unsigned long getAcquires();
+  unsigned int getDevicemembuffers();
+
+ protected:
+  SSlot* createSlot(unsigned int nPayload);
+  bool allocBuffer(SSlot* pSlot, unsigned int nPayload);
+  void freeBuffer(SSlot* pSlot);
+
+  libusb_device_handle* m_pHandle;   /* NULL for an emulated device */
+  std::vector<SSlot*> m_vSlots;
+  /* transfers, buffers and slots allocated since construction */
+  unsigned long m_nAllocations;
+  unsigned long m_nAcquires;
+};
+
+#endif
@@ -12,34 +12,273 @@
 #include <assert.h>
 #include <string.h>
 
-#include "cflashmem.h"
-#include "cbootloader.h"
+#include "avrusbboot.h"
+#ifndef _WIN32
+#include "cdaemon.h"
+#endif
+
+static void usage() {
+  fprintf(stderr, "usage: avrusbboot [options] filename...\n");
+  CFlashjob::usage();
+  fprintf(stderr, "  -B pages        write at most this many pages per request (1: single pages)\n");
+  fprintf(stderr, "  -C              send page data on the control pipe even if there is a bulk endpoint\n");
+  fprintf(stderr, "  -Z              send pages uncoded even if the bootloader decodes compressed writes\n");
+  fprintf(stderr, "  -D              write duplicate pages instead of copying them on the device\n");
+  fprintf(stderr, "  -U path|serial  flash the bootloader at this bus and port path (1-2.3)\n");
+  fprintf(stderr, "                  or with this serial number (with -l: every such board)\n");
+  fprintf(stderr, "  -M              flash every attached bootloader at once\n");
+  fprintf(stderr, "                  (not with -E, -U, -l, -V, -n, -J or -R)\n");
+  fprintf(stderr, "  -L hub[,bus]    with -M: write requests in flight per hub and per bus (default 2,4)\n");
+  fprintf(stderr, "  -l              station loop: flash, verify (-V) and start every board\n");
+  fprintf(stderr, "                  plugged in, log cycle time, units/h and failures (not with -E)\n");
+  fprintf(stderr, "  -n units        with -l: stop after this many boards (default: never)\n");
+  fprintf(stderr, "  -V              with -l: verify every board before starting it\n");
+  fprintf(stderr, "  -t retries      repeat failed requests this often, with backoff (default 3)\n");
+  fprintf(stderr, "  -E spec         flash an emulated bootloader and report the modelled time;\n");
+  fprintf(stderr, "                  spec: protocol=1 (0: no device info),pagesize=64,\n");
+  fprintf(stderr, "                  flash=0x20000,boot=0 (bootloader start),batch=16 (0: none),\n");
+  fprintf(stderr, "                  compress=0 (1: decode compressed writes),\n");
+  fprintf(stderr, "                  copy=0 (1: copy pages on the device),\n");
+  fprintf(stderr, "                  partial=0 (1: pad pages sent without their 0xff tail),\n");
+  fprintf(stderr, "                  crc=0,read=0 (1: pages can be verified),\n");
+  fprintf(stderr, "                  stall=,timeout=,short=,unplug= (fault every n-th write),\n");
+  fprintf(stderr, "                  reenum=200000 (microseconds an unplugged board is away),\n");
+  fprintf(stderr, "                  bulk=0 (1: bulk endpoint),maxpacket=8,\n");
+  fprintf(stderr, "                  transfer=,packet=,bulkpacket=,program= (microseconds)\n");
+#ifndef _WIN32
+  fprintf(stderr, "  -d socket       run as daemon, taking flash jobs on a Unix socket\n");
+  fprintf(stderr, "  -j socket       hand the job to a running daemon\n");
+#endif
+  exit(1);
+}
+
+/* -M: all bootloaders at once, paced per hub and bus */
+static int flashAll(CFlashjob& job, unsigned int hublimit, unsigned int buslimit,
+    unsigned int batchlimit, bool compress, bool copy, unsigned int retries) {
+  CScheduler scheduler;
+  scheduler.setLimits(hublimit, buslimit);
+  scheduler.setWriteoptions(batchlimit, compress, copy, retries);
+  if (scheduler.openAll() == 0) {
+    fprintf(stderr, "Error: no bootloader found\n");
+    return 1;
+  }
+  printf("Bootloaders: %u\n", scheduler.getDevicecount());
+
+  int result = scheduler.flash(&job);
+  for (unsigned int n = 0; n < scheduler.getDevicecount(); n++)
+    printf("%s: %s\n", scheduler.getDevicepath(n).c_str(),
+        scheduler.getDeviceresult(n) < 0 ? scheduler.getDevicemessage(n) : "OK");
+
+  const std::vector<SBususage>& usage = scheduler.getBususage();
+  for (size_t n = 0; n < usage.size(); n++) {
+    printf("Bus %u: %u devices on %u hubs, %lu bytes in %llu ms, busy %llu%%",
+        usage[n].bus, usage[n].devices, usage[n].hubs, usage[n].bytes,
+        usage[n].elapsed / 1000, usage[n].elapsed > 0 ? usage[n].busy * 100 / usage[n].elapsed : 0);
+    if (usage[n].elapsed > 0)
+      printf(", %llu bytes/s", usage[n].bytes * 1000000ULL / usage[n].elapsed);
+    printf("\n");
+  }
+
+  if (result < 0) {
+    fprintf(stderr, "Error: %s\n", scheduler.getErrormessage());
+    return 1;
+  }
+  return 0;
+}
+
+static void progress(void* pUser, unsigned int nPage, unsigned int nPages, CPage* pPage) {
+  printf("Write page at adresse: 0x%x\n", pPage->getPageaddress());
+}
 
 int main(int argc, char **argv) {
 
-  if (argc < 2) {
-    fprintf(stderr, "usage: avrusbboot filename.hex\n");
-    exit(1);
+  CFlashjob job;
+  char* daemonsocket = NULL;
+  CEmulator emulator;
+  bool emulate = false;
+  unsigned int batchlimit = USBBOOT_MAXBATCH;
+  bool bulk = true;
+  bool compress = true;
+  bool copy = true;
+  unsigned int retries = USBBOOT_RETRIES;
+  std::string selector;
+  bool all = false;
+  unsigned int hublimit = 0, buslimit = 0;
+  bool station = false;
+  bool verify = false;
+  unsigned int units = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+      if (!emulator.parseSpec(argv[++i])) usage();
+      emulate = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+      batchlimit = strtoul(argv[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(argv[i], "-C") == 0) {
+      bulk = false;
+      continue;
+    }
+    if (strcmp(argv[i], "-U") == 0 && i + 1 < argc) {
+      selector = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "-M") == 0) {
+      all = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+      char* end;
+      hublimit = strtoul(argv[++i], &end, 0);
+      if (*end == ',') buslimit = strtoul(end + 1, NULL, 0);
+      continue;
+    }
+    if (strcmp(argv[i], "-l") == 0) {
+      station = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      units = strtoul(argv[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(argv[i], "-V") == 0) {
+      verify = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      retries = strtoul(argv[++i], NULL, 0);
+      continue;
+    }
+    if (strcmp(argv[i], "-D") == 0) {
+      copy = false;
+      continue;
+    }
+    if (strcmp(argv[i], "-Z") == 0) {
+      compress = false;
+      continue;
+    }
+#ifndef _WIN32
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      daemonsocket = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      /* everything after the socket is the job */
+      return CDaemon::runClient(argv[i + 1], argc - i - 2, argv + i + 2);
+    }
+#endif
+    if (!job.parseOption(argc, argv, i)) usage();
+  }
+
+#ifndef _WIN32
+  if (daemonsocket != NULL) {
+    CDaemon daemon(daemonsocket);
+    if (daemon.run() < 0) {
+      fprintf(stderr, "Error: %s\n", daemon.getErrormessage());
+      return 1;
+    }
+    return 0;
   }
+#endif
+
+  if (!job.hasInputs()) usage();
+  /* -M opens every device itself and has no verify step or journal */
+  if (all && (emulate || !selector.empty() || station || verify || units > 0
+      || !job.getJournal().empty() || job.isResume()))
+    usage();
+  /* the station loop waits for real boards; -V and -n only steer it */
+  if (station ? emulate : verify || units > 0)
+    usage();
+  if (all)
+    return flashAll(job, hublimit, buslimit, batchlimit, compress, copy, retries);
 
   printf("initializing bootloader...\n");
-  CBootloader *bootloader = new CBootloader();
+  CFlasher flasher;
+  /* parse while libusb searches the device */
+  flasher.preload(&job);
+  flasher.setBatchlimit(batchlimit);
+  flasher.setBulkenabled(bulk);
+  flasher.setCompressenabled(compress);
+  flasher.setCopyenabled(copy);
+  flasher.setRetries(retries, USBBOOT_RETRYDELAY);
+  if (station) {
+    CStation loop(&flasher);
+    loop.setVerify(verify);
+    loop.setSelector(selector);
+    int result = loop.run(&job, units);
+    printf("Units: %u, failed: %u\n", loop.getUnits(), loop.getFailures());
+    if (result < 0) {
+      fprintf(stderr, "Error: %s\n", loop.getErrormessage());
+      return 1;
+    }
+    return loop.getFailures() > 0 ? 1 : 0;
+  }
+  if ((emulate ? flasher.open(&emulator) : flasher.open(selector)) < 0) {
+    fprintf(stderr, "Error: %s\n", flasher.getErrormessage());
+    return 1;
+  }
   fprintf(stderr, "bootloader initialized\n");
 
-  unsigned int pagesize = bootloader->getPagesize();
-  
-  printf("Pagesize: %d\n", pagesize);
+  printf("Pagesize: %d\n", flasher.getPagesize());
+  const SBootinfo* info = flasher.getInfo();
+  if (info == NULL) {
+    fprintf(stderr, "Error: %s\n", flasher.getErrormessage());
+    return 1;
+  }
+  if (info->version > 0) {
+    printf("Protocol: %d, flash: %d bytes, bootloader at 0x%x, features:%s%s%s%s%s%s%s%s\n",
+        info->version, info->flashsize, info->bootstart,
+        info->features & USBBOOT_FEATURE_BATCH ? " batch" : "",
+        info->features & USBBOOT_FEATURE_CRC ? " crc" : "",
+        info->features & USBBOOT_FEATURE_ERASE ? " erase" : "",
+        info->features & USBBOOT_FEATURE_READ ? " read" : "",
+        info->features & USBBOOT_FEATURE_COMPRESS ? " compress" : "",
+        info->features & USBBOOT_FEATURE_BULK ? " bulk" : "",
+        info->features & USBBOOT_FEATURE_COPY ? " copy" : "",
+        info->features & USBBOOT_FEATURE_PARTIAL ? " partial" : "");
+  }
+  if (flasher.getBatchsize() > 1)
+    printf("Pages per request: %d%s\n", flasher.getBatchsize(),
+        flasher.isBulk() ? " (bulk)" : "");
 
-  CFlashmem * flashmem = new CFlashmem(pagesize);
+  if (flasher.flash(&job, progress, NULL) < 0) {
+    fprintf(stderr, "Error: %s\n", flasher.getErrormessage());
+    return 1;
+  }
+  if (flasher.getSharedusers() > 0)
+    printf("Shared image users: %d\n", flasher.getSharedusers());
+  if (flasher.getPatchedpages() > 0)
+    printf("Patched pages: %d\n", flasher.getPatchedpages());
 
-  flashmem->readFromIHEX(argv[1]);
+  if (flasher.getRetries() > 0)
+    printf("Retries: %lu, recovered requests: %lu, reopened: %lu\n",
+        flasher.getRetries(), flasher.getRecoveries(), flasher.getReopens());
+  if (flasher.getWritelatency(50) > 0)
+    printf("Write latency: %lu us per page, 99%% within %lu us\n",
+        flasher.getWritelatency(50), flasher.getWritelatency(99));
+  if (flasher.getResumedpages() > 0)
+    printf("Resumed: %u pages were written before\n", flasher.getResumedpages());
+  if (flasher.getCopiedpages() > 0)
+    printf("Deduplicated: %lu pages copied on the device, %lu bytes saved\n",
+        flasher.getCopiedpages(), flasher.getCopysaving());
+  if (flasher.getSentbytes() < flasher.getPagebytes())
+    printf("Sent: %lu of %lu page bytes\n", flasher.getSentbytes(),
+        flasher.getPagebytes());
 
-  CPage* pPage = flashmem->getFirstpage();
-  while (pPage != NULL) {
-    printf("Write page at adresse: %d\n", pPage->getPageaddress());
-    bootloader->writePage(pPage);
-    pPage = pPage->getNext();
-  } 
+  if (emulate) {
+    printf("Emulated: %lu transfers, %lu pages, %lu bytes, %llu.%03llu ms\n",
+        emulator.getTransfers(), emulator.getPagewrites(), emulator.getBytes(),
+        emulator.getTime() / 1000, emulator.getTime() % 1000);
+    if (emulator.getFaults() > 0)
+      printf("Injected faults: %lu, reconnects: %lu\n", emulator.getFaults(),
+          emulator.getReconnects());
+    if (emulator.getTime() > 0)
+      printf("Throughput: %llu bytes/s\n",
+          flasher.getPagebytes() * 1000000ULL / emulator.getTime());
+  }
 
   return 0;
 }
@@ -0,0 +1,168 @@
+/*
+  bench.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Benchmarks on fixed, generated data, no device needed:
+  page inserts and iteration for the specialised (power of two) page sizes
+  against the generic fallback, the erased tail scan, page compression,
+  and the modelled flash time of the write protocols on the emulator.
+*/
+
+#include <algorithm>
+#include <string.h>
+
+#include "avrusbboot.h"
+#include "ccompressor.h"
+#include "check.h"
+
+#define BENCH_IMAGESIZE (4 * 1024 * 1024)
+#define BENCH_ROUNDS 5   /* the fastest round counts */
+
+/* byte by byte inserts and walks over all pages of a sparse 4 MB image;
+   96 and 384 byte pages take the generic path */
+static void benchPages(unsigned int nPagesize) {
+  double nInsert = 1e9, nPageinsert = 1e9, nIterate = 1e9;
+  unsigned long nSum = 0;
+
+  for (unsigned int nRound = 0; nRound < BENCH_ROUNDS; nRound++) {
+    double nStart = getSeconds();
+    CFlashmem flashmem(nPagesize);
+    for (unsigned int n = 0; n < BENCH_IMAGESIZE; n++)
+      flashmem.insertData(n, (unsigned char) (n * 13));
+    nInsert = std::min(nInsert, getSeconds() - nStart);
+
+    CFlashpatch flashpatch(&flashmem);
+    nStart = getSeconds();
+    for (CPage* pPage = flashpatch.getFirstpage(); pPage != NULL;
+         pPage = flashpatch.getNextpage(pPage))
+      nSum += pPage->getData()[0];
+    nIterate = std::min(nIterate, (getSeconds() - nStart) / flashmem.getPagecount());
+
+    CPage page(nPagesize, nPagesize);
+    nStart = getSeconds();
+    for (unsigned int nPage = 0; nPage < BENCH_IMAGESIZE / nPagesize; nPage++) {
+      for (unsigned int n = nPagesize; n < 2 * nPagesize; n++)
+        page.insert(n, (unsigned char) n);
+    }
+    nPageinsert = std::min(nPageinsert, getSeconds() - nStart);
+  }
+
+  printf("pages %3u: insertData %5.1f ns/byte, CPage::insert %5.2f ns/byte, "
+         "iterate %5.1f ns/page\n", nPagesize, nInsert * 1e9 / BENCH_IMAGESIZE,
+         nPageinsert * 1e9 / BENCH_IMAGESIZE, nIterate * 1e9);
+  if (nSum == 1) printf("\n");   /* keeps the walk */
+}
+
+/* the scan getDatalength() replaced, out of line like the member */
+static unsigned int __attribute__((noinline, noipa)) scanBytes(const unsigned char* pData,
+    unsigned int nLength) {
+  while (nLength > 0 && pData[nLength - 1] == 0xff) nLength--;
+  return nLength;
+}
+
+/* CPage::getDatalength() against a byte loop on 512 byte pages with
+   tails of every length */
+static void benchDatalength() {
+  CPage page(0, 512);
+  unsigned char* pData = page.getData();
+  double nScan = 1e9, nBytewise = 1e9;
+  unsigned long nSum = 0;
+
+  for (unsigned int nRound = 0; nRound < BENCH_ROUNDS; nRound++) {
+    double nStart = getSeconds();
+    for (unsigned int nLength = 1; nLength <= 512; nLength++) {
+      memset(pData, 0xff, 512);
+      pData[nLength - 1] = 0;
+      for (unsigned int nRepeat = 0; nRepeat < 64; nRepeat++)
+        nSum += page.getDatalength();
+    }
+    nScan = std::min(nScan, getSeconds() - nStart);
+
+    nStart = getSeconds();
+    for (unsigned int nLength = 1; nLength <= 512; nLength++) {
+      memset(pData, 0xff, 512);
+      pData[nLength - 1] = 0;
+      for (unsigned int nRepeat = 0; nRepeat < 64; nRepeat++)
+        nSum += scanBytes(pData, 512);
+    }
+    nBytewise = std::min(nBytewise, getSeconds() - nStart);
+  }
+  printf("getDatalength: %5.1f ns/page, byte loop %5.1f ns/page%s\n",
+         nScan * 1e9 / (512 * 64), nBytewise * 1e9 / (512 * 64), nSum == 1 ? " " : "");
+}
+
+/* 32 kB of firmware like data in 128 byte pages */
+static CFlashmem* makeFirmware() {
+  CFlashmem* pFlashmem = new CFlashmem(128);
+  for (unsigned int n = 0; n < 0x8000; n++)
+    pFlashmem->insertData(n, (unsigned char) (n % 96 < 40 ? 0 : n * 7 + n / 256));
+  return pFlashmem;
+}
+
+/* CCompressor on the firmware pages: host throughput and coded size */
+static void benchCompress() {
+  CFlashmem* pFlashmem = makeFirmware();
+  unsigned char out[COMPRESS_BOUND(128)];
+  unsigned long nCoded = 0;
+  double nBest = 1e9;
+
+  for (unsigned int nRound = 0; nRound < BENCH_ROUNDS; nRound++) {
+    nCoded = 0;
+    double nStart = getSeconds();
+    for (unsigned int nRepeat = 0; nRepeat < 32; nRepeat++) {
+      for (CPage* pPage = pFlashmem->getFirstpage(); pPage != NULL; pPage = pPage->getNext())
+        nCoded += CCompressor::compressPage(pPage->getData(), 128, out);
+    }
+    nBest = std::min(nBest, getSeconds() - nStart);
+  }
+  printf("compressPage: %5.1f MB/s, 32 kB coded to %lu bytes\n",
+         32 * 0x8000 / nBest / 1e6, nCoded / 32);
+  delete pFlashmem;
+}
+
+/* one flash of the firmware: time on the device as the emulator models
+   it, requests and host CPU time. Fails if the flash is not the image. */
+static bool benchProtocol(const char* spec) {
+  CFlashmem* pFlashmem = makeFirmware();
+  CFlashpatch flashpatch(pFlashmem);
+  CEmulator emulator;
+  emulator.parseSpec(spec);
+  CBootloader bootloader(&emulator);
+  emulator.resetStatistics();
+
+  double nStart = getSeconds();
+  int nResult = CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL);
+  double nHost = getSeconds() - nStart;
+  bool bSame = nResult == ERROR_NONE;
+  for (CPage* pPage = pFlashmem->getFirstpage(); pPage != NULL && bSame; pPage = pPage->getNext())
+    bSame = memcmp(emulator.getFlash() + pPage->getPageaddress(), pPage->getData(), 128) == 0;
+
+  printf("%-32s %7.1f ms modelled, %4lu requests, %6lu bytes, host %5.2f ms%s\n", spec,
+         emulator.getTime() / 1000.0, emulator.getTransfers(), emulator.getBytes(),
+         nHost * 1000, bSame ? "" : " FLASH DIFFERS");
+  delete pFlashmem;
+  return bSame;
+}
+
+int main() {
+  unsigned int sizes[] = { 64, 96, 128, 384, 512 };
+  for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    benchPages(sizes[n]);
+
+  benchDatalength();
+  benchCompress();
+
+  /* single page writes against batches, up to the longest batch of 128
+     byte pages in one control transfer, then compressed batches */
+  const char* specs[] = {
+    "pagesize=128,batch=0",
+    "pagesize=128,batch=4",
+    "pagesize=128,batch=16",
+    "pagesize=128,batch=31",
+    "pagesize=128,batch=16,compress=1",
+    "pagesize=128,batch=31,compress=1",
+  };
+  bool bSame = true;
+  for (unsigned int n = 0; n < sizeof(specs) / sizeof(specs[0]); n++)
+    bSame = benchProtocol(specs[n]) && bSame;
+  return bSame ? 0 : 1;
+}
@@ -0,0 +1,39 @@
+/*
+  check.h - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Minimal checks for the test programs in tests/: CHECK() reports a failed
+  condition with its line and counts it, checkResult() is the exit code.
+  The tests run on the host against CEmulator, no device is needed.
+*/
+
+#ifndef _H_CHECK_
+#define _H_CHECK_
+
+#include <stdio.h>
+#include <time.h>
+
+static unsigned int g_nChecks = 0;
+static unsigned int g_nFailures = 0;
+
+#define CHECK(condition) \
+  do { \
+    g_nChecks++; \
+    if (!(condition)) { \
+      g_nFailures++; \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+    } \
+  } while (0)
+
+static inline int checkResult(const char* name) {
+  printf("%s: %u checks, %u failed\n", name, g_nChecks, g_nFailures);
+  return g_nFailures == 0 ? 0 : 1;
+}
+
+/* wall clock for the benchmarks */
+static inline double getSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+  tcompress.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Page compression: fixed and pseudo random pages are coded by CCompressor,
+  sent to the emulated bootloader in one WRITE_COMPRESSED request each and
+  must come out of its decoder unchanged.
+*/
+
+#include <string.h>
+
+#include "avrusbboot.h"
+#include "ccompressor.h"
+#include "check.h"
+
+#define PATTERNS 8
+
+/* fixed seed, the pages are the same on every run */
+static unsigned int g_nSeed = 12345;
+
+static unsigned char nextRandom() {
+  g_nSeed = g_nSeed * 1103515245 + 12345;
+  return (unsigned char) (g_nSeed >> 16);
+}
+
+static void makePage(unsigned char* pPage, unsigned int nPagesize, unsigned int nPattern) {
+  for (unsigned int n = 0; n < nPagesize; n++) {
+    switch (nPattern) {
+    case 0: pPage[n] = 0xff; break;                              /* erased */
+    case 1: pPage[n] = nextRandom(); break;                      /* incompressible */
+    case 2: pPage[n] = (unsigned char) (n % 3); break;           /* short period */
+    case 3: pPage[n] = (unsigned char) (n / 67); break;          /* runs of 67 */
+    case 4: pPage[n] = n % 5 < 2 ? 0x0c : nextRandom(); break;   /* like AVR code */
+    case 5: pPage[n] = n < nPagesize / 2 ? nextRandom() : pPage[n - nPagesize / 2]; break;
+    case 6: pPage[n] = n % 2 ? 0x94 : nextRandom() & 0x0f; break;
+    default: pPage[n] = n % 200 < 130 ? (unsigned char) n : 0x00; break;
+    }
+  }
+}
+
+/* code one page, let the emulator decode it into its flash at nAddress */
+static bool sendPage(CEmulator* pEmulator, unsigned int nAddress,
+    const unsigned char* pPage, unsigned int nPagesize, unsigned int* pCoded) {
+  unsigned char payload[USBBOOT_BATCHHEADER + COMPRESS_BOUND(512)];
+  unsigned int nLength = CCompressor::compressPage(pPage, nPagesize,
+      payload + USBBOOT_BATCHHEADER);
+  *pCoded = nLength;
+  if (nLength > COMPRESS_BOUND(nPagesize)) return false;
+
+  payload[0] = 1;
+  payload[1] = 0;
+  nLength += USBBOOT_BATCHHEADER;
+  return pEmulator->controlTransfer(USBBOOT_REQUEST_OUT, USBBOOT_FUNC_WRITE_COMPRESSED,
+      nAddress & 0xffff, nAddress >> 16, payload, nLength) == (int) nLength
+      && memcmp(pEmulator->getFlash() + nAddress, pPage, nPagesize) == 0;
+}
+
+static void checkPagesize(unsigned int nPagesize) {
+  char spec[64];
+  snprintf(spec, sizeof(spec), "pagesize=%u,compress=1,flash=0x40000", nPagesize);
+  CEmulator emulator;
+  CHECK(emulator.parseSpec(spec));
+
+  unsigned char page[512];
+  unsigned int nCoded;
+  for (unsigned int nRound = 0; nRound < 16; nRound++) {
+    for (unsigned int nPattern = 0; nPattern < PATTERNS; nPattern++) {
+      makePage(page, nPagesize, nPattern);
+      unsigned int nAddress = (nRound * PATTERNS + nPattern) * nPagesize;
+      CHECK(sendPage(&emulator, nAddress, page, nPagesize, &nCoded));
+      if (nPattern == 0 || nPattern == 2 || nPattern == 3)
+        CHECK(nCoded < nPagesize / 4);
+    }
+  }
+
+  /* pages mixed from the patterns in chunks of 1 to 80 bytes, so tokens
+     start and end at every offset */
+  for (unsigned int nRound = 0; nRound < 200; nRound++) {
+    unsigned char source[PATTERNS][512];
+    for (unsigned int nPattern = 0; nPattern < PATTERNS; nPattern++)
+      makePage(source[nPattern], nPagesize, nPattern);
+    for (unsigned int n = 0; n < nPagesize;) {
+      unsigned int nChunk = 1 + nextRandom() % 80;
+      unsigned int nPattern = nextRandom() % PATTERNS;
+      for (; nChunk > 0 && n < nPagesize; nChunk--, n++) page[n] = source[nPattern][n];
+    }
+    CHECK(sendPage(&emulator, (nRound % 256) * nPagesize, page, nPagesize, &nCoded));
+  }
+}
+
+int main() {
+  unsigned int sizes[] = { 32, 64, 128, 256, 512 };
+  for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    checkPagesize(sizes[n]);
+  return checkResult("tcompress");
+}
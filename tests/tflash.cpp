@@ -0,0 +1,206 @@
+/*
+  tflash.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Flashes fixed, generated images into emulated bootloaders of every
+  protocol variant and compares the emulated flash with the image; pages
+  with an erased tail go out without it. Pages beyond 64 kB are refused
+  by legacy bootloaders. Injected faults are retried until the flash is
+  right, only an unplugged device is reopened.
+*/
+
+#include <string.h>
+
+#include "avrusbboot.h"
+#include "check.h"
+
+/* 24 kB of page data at 0x1000 with runs of repeated bytes and pages
+   that repeat an earlier one, and a short tail */
+static CFlashmem* makeImage(unsigned int nPagesize) {
+  CFlashmem* pFlashmem = new CFlashmem(nPagesize);
+  for (unsigned int n = 0; n < 0x6000; n++) {
+    unsigned int nOffset = n % 0x800 < 0x400 ? n : n % 0x400;
+    unsigned char b = nOffset % 96 < 40 ? 0x00 : (unsigned char) (nOffset * 7 + nOffset / 256);
+    pFlashmem->insertData(0x1000 + n, b);
+  }
+  for (unsigned int n = 0; n < 5; n++)
+    pFlashmem->insertData(0x7000 + n, (unsigned char) n);
+  return pFlashmem;
+}
+
+/* the emulated flash holds the image and 0xff elsewhere */
+static bool compareFlash(CEmulator* pEmulator, CFlashmem* pFlashmem) {
+  std::vector<unsigned char> expected(pEmulator->getFlashsize(), 0xff);
+  for (CPage* pPage = pFlashmem->getFirstpage(); pPage != NULL; pPage = pPage->getNext())
+    memcpy(&expected[pPage->getPageaddress()], pPage->getData(), pPage->getPagesize());
+  return memcmp(&expected[0], pEmulator->getFlash(), expected.size()) == 0;
+}
+
+/* flash the image twice: both runs reach the same flash and the second
+   one allocates no transfers or buffers */
+static void checkFlash(const char* spec) {
+  unsigned int nFailures = g_nFailures;
+  CEmulator emulator;
+  CHECK(emulator.parseSpec(spec));
+  CBootloader bootloader(&emulator);
+  CHECK(bootloader.isOpen());
+  CFlashmem* pFlashmem = makeImage(bootloader.getPagesize());
+  CFlashpatch flashpatch(pFlashmem);
+
+  int nResult = CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL);
+  CHECK(nResult == ERROR_NONE);
+  CHECK(compareFlash(&emulator, pFlashmem));
+  unsigned long nAllocations = bootloader.getTransferpool()->getAllocations();
+
+  nResult = CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL);
+  CHECK(nResult == ERROR_NONE);
+  CHECK(compareFlash(&emulator, pFlashmem));
+  CHECK(bootloader.getTransferpool()->getAllocations() == nAllocations);
+  CHECK(bootloader.getRetries() == 0);
+  if (g_nFailures > nFailures) printf("  with %s\n", spec);
+  delete pFlashmem;
+}
+
+/* 64 pages of 128 bytes, page n with n * 2 + 1 data bytes before its
+   0xff tail; single page and batched writes send only the data bytes */
+static void checkPartial(const char* spec, unsigned int nHeaders) {
+  CEmulator emulator;
+  CHECK(emulator.parseSpec(spec));
+  CBootloader bootloader(&emulator);
+  CHECK(bootloader.getInfo() != NULL);
+  CFlashmem flashmem(128);
+  unsigned long nDatabytes = 0;
+  for (unsigned int nPage = 0; nPage < 64; nPage++) {
+    for (unsigned int n = 0; n <= nPage * 2; n++)
+      flashmem.insertData(0x2000 + nPage * 128 + n, n == nPage * 2 ? 0x00 : 0xff);
+    nDatabytes += nPage * 2 + 1;
+  }
+  CFlashpatch flashpatch(&flashmem);
+
+  emulator.resetStatistics();
+  CHECK(CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL) == ERROR_NONE);
+  CHECK(compareFlash(&emulator, &flashmem));
+  CHECK(bootloader.getPagebytes() == 64 * 128);
+  if (nHeaders == 0)
+    CHECK(emulator.getBytes() == nDatabytes);
+  else
+    CHECK(emulator.getBytes() < 64 * 128 + nHeaders);
+  CHECK(emulator.getBytes() == bootloader.getSentbytes() + nHeaders);
+}
+
+static void writeRecord(FILE* f, unsigned int nType, unsigned int nAddress,
+    const unsigned char* pData, unsigned int nLength) {
+  unsigned char sum = nLength + (nAddress >> 8) + nAddress + nType;
+  fprintf(f, ":%02X%04X%02X", nLength, nAddress & 0xffff, nType);
+  for (unsigned int n = 0; n < nLength; n++) {
+    fprintf(f, "%02X", pData[n]);
+    sum += pData[n];
+  }
+  fprintf(f, "%02X\n", (unsigned char) -sum);
+}
+
+/* IHEX with a type 04 record: a page at 0x0000 and one at 0x10000. A
+   legacy bootloader drops wIndex and would write the second page over
+   the first, so the job is refused before any write */
+static void checkExtended(const char* spec, bool bLegacy) {
+  char filename[] = "textended.hex";
+  unsigned char low[16], high[16], segment[2] = { 0x00, 0x01 };
+  memset(low, 0x11, sizeof(low));
+  memset(high, 0xa5, sizeof(high));
+  FILE* f = fopen(filename, "w");
+  writeRecord(f, 0, 0x0000, low, sizeof(low));
+  writeRecord(f, 4, 0x0000, segment, sizeof(segment));
+  writeRecord(f, 0, 0x0000, high, sizeof(high));
+  fprintf(f, ":00000001FF\n");
+  fclose(f);
+
+  CEmulator emulator;
+  CHECK(emulator.parseSpec(spec));
+  CBootloader bootloader(&emulator);
+  CFlashmem flashmem(bootloader.getPagesize());
+  CHECK(flashmem.readFromIHEX(filename) == ERROR_NONE);
+  CHECK(flashmem.getPagecount() == 2);
+  CFlashpatch flashpatch(&flashmem);
+
+  int nResult = CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL);
+  if (bLegacy) {
+    CHECK(nResult == ERROR_RANGE);
+    CHECK(emulator.getPagewrites() == 0);
+    CHECK(bootloader.writePage(flashmem.getPageToAddress(0x10000)) == ERROR_RANGE);
+    CHECK(emulator.getFlash()[0] == 0xff);
+  } else {
+    CHECK(nResult == ERROR_NONE);
+    CHECK(compareFlash(&emulator, &flashmem));
+  }
+  remove(filename);
+}
+
+/* every n-th data request fails: the job still writes the image, with
+   retries, and reopens the device only when it was unplugged */
+static void checkFaults(const char* spec, bool bUnplug) {
+  unsigned int nFailures = g_nFailures;
+  CEmulator emulator;
+  CHECK(emulator.parseSpec(spec));
+  CBootloader bootloader(&emulator);
+  CFlashmem* pFlashmem = makeImage(bootloader.getPagesize());
+  CFlashpatch flashpatch(pFlashmem);
+
+  int nResult = CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL);
+  CHECK(nResult == ERROR_NONE);
+  CHECK(compareFlash(&emulator, pFlashmem));
+  CHECK(bootloader.getRetries() > 0);
+  CHECK(emulator.getFaults() > 0);
+  if (bUnplug)
+    CHECK(bootloader.getReopens() > 0);
+  else
+    CHECK(bootloader.getReopens() == 0);
+  if (g_nFailures > nFailures) printf("  with %s\n", spec);
+  delete pFlashmem;
+}
+
+/* a device that takes longer than USBBOOT_REOPENTIME to come back fails
+   the job instead of being waited for */
+static void checkLost() {
+  CEmulator emulator;
+  CHECK(emulator.parseSpec("pagesize=128,batch=0,unplug=20,reenum=3000000"));
+  CBootloader bootloader(&emulator);
+  CFlashmem* pFlashmem = makeImage(bootloader.getPagesize());
+  CFlashpatch flashpatch(pFlashmem);
+
+  CHECK(CFlashjob::flash(&bootloader, &flashpatch, NULL, NULL) != ERROR_NONE);
+  CHECK(bootloader.getReopens() > 0);
+  CHECK(emulator.getReconnects() == 0);
+  delete pFlashmem;
+}
+
+int main() {
+  const char* specs[] = {
+    "protocol=0,batch=0",
+    "batch=0",
+    "pagesize=128,batch=16",
+    "pagesize=256,batch=8,copy=1",
+    "pagesize=128,batch=16,compress=1",
+    "pagesize=128,batch=16,compress=1,copy=1,partial=1",
+    "pagesize=64,batch=16,bulk=1",
+    "pagesize=512,batch=4,compress=1,bulk=1,flash=0x40000",
+    /* batches longer than a control transfer takes */
+    "pagesize=128,batch=32",
+    "pagesize=128,batch=32,compress=1,partial=1",
+    "pagesize=512,batch=255,flash=0x40000",
+  };
+  for (unsigned int n = 0; n < sizeof(specs) / sizeof(specs[0]); n++)
+    checkFlash(specs[n]);
+  checkPartial("pagesize=128,batch=0,partial=1", 0);
+  checkPartial("pagesize=128,batch=4,partial=1", 16 * USBBOOT_BATCHHEADER);
+  checkExtended("protocol=0,batch=0", true);
+  checkExtended("protocol=0,batch=16", true);
+  checkExtended("batch=16", false);
+  checkFaults("pagesize=128,batch=0,stall=7", false);
+  checkFaults("pagesize=128,batch=0,timeout=9", false);
+  checkFaults("pagesize=128,batch=0,short=5", false);
+  checkFaults("pagesize=128,batch=0,unplug=11", true);
+  checkFaults("pagesize=128,batch=4,stall=5,short=7", false);
+  checkFaults("pagesize=64,batch=16,bulk=1,stall=3", false);
+  checkFaults("pagesize=64,batch=16,bulk=1,unplug=3", true);
+  checkLost();
+  return checkResult("tflash");
+}
@@ -0,0 +1,71 @@
+/*
+  tloader.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Hex decoding and the IHEX loader, also with two images parsed at the
+  same time as CFlasher::preload() does. A record with a wrong checksum
+  is a format error.
+*/
+
+#include <thread>
+
+#include "avrusbboot.h"
+#include "check.h"
+
+static void writeHex(const char* filename, unsigned int nBytes) {
+  FILE* f = fopen(filename, "w");
+  for (unsigned int nAddress = 0; nAddress < nBytes; nAddress += 16) {
+    unsigned char sum = 16 + (nAddress >> 8) + (nAddress & 0xff);
+    fprintf(f, ":10%04X00", nAddress);
+    for (unsigned int n = 0; n < 16; n++) {
+      unsigned char b = (unsigned char) ((nAddress + n) * 31);
+      fprintf(f, "%02X", b);
+      sum += b;
+    }
+    fprintf(f, "%02X\n", (unsigned char) -sum);
+  }
+  fprintf(f, ":00000001FF\n");
+  fclose(f);
+}
+
+static void parse(char* filename, int* pResult) {
+  CFlashmem flashmem(128);
+  *pResult = flashmem.readFromIHEX(filename);
+  CPage* pPage = flashmem.getPageToAddress(0x1234);
+  if (*pResult == ERROR_NONE && (pPage == NULL
+      || pPage->getData()[0x34] != (unsigned char) (0x1234 * 31)))
+    *pResult = ERROR_FORMAT;
+}
+
+int main() {
+  unsigned char buffer[4];
+  CHECK(decodeHex("00aF7fFF", buffer, 4) == 0);
+  CHECK(buffer[0] == 0x00 && buffer[1] == 0xaf && buffer[2] == 0x7f && buffer[3] == 0xff);
+  CHECK(decodeHex("0g", buffer, 1) != 0);
+  CHECK(decodeHex(" 1", buffer, 1) != 0);
+
+  char filename[] = "tloader.hex";
+  writeHex(filename, 0x8000);
+  for (int nRound = 0; nRound < 20; nRound++) {
+    int nResult1 = -1, nResult2 = -1;
+    std::thread parser(parse, filename, &nResult1);
+    parse(filename, &nResult2);
+    parser.join();
+    CHECK(nResult1 == ERROR_NONE);
+    CHECK(nResult2 == ERROR_NONE);
+  }
+  remove(filename);
+
+  /* the record's checksum is 0x0c */
+  for (unsigned int nChecksum = 0x0c; nChecksum <= 0x0d; nChecksum++) {
+    FILE* f = fopen(filename, "w");
+    fprintf(f, ":0412340011223344%02X\n", nChecksum);
+    fprintf(f, ":00000001FF\n");
+    fclose(f);
+    CFlashmem flashmem(128);
+    int nResult = flashmem.readFromIHEX(filename);
+    CHECK(nResult == (nChecksum == 0x0c ? ERROR_NONE : ERROR_FORMAT));
+    CHECK(flashmem.getPagecount() == (nChecksum == 0x0c ? 1u : 0u));
+    remove(filename);
+  }
+  return checkResult("tloader");
+}
@@ -0,0 +1,79 @@
+/*
+  tpage.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  CPage and CFlashmem: page addresses, offsets and inserts for power of two
+  page sizes (masks and shifts) and for the generic fallback, and the data
+  length before the erased tail of a page.
+*/
+
+#include "avrusbboot.h"
+#include "check.h"
+
+static void testPageaddress(unsigned int nPagesize) {
+  CPage page(5 * nPagesize + 3, nPagesize);
+  CHECK(page.getPageaddress() == 5 * nPagesize);
+
+  page.insert(5 * nPagesize + 7, 0x42);
+  CHECK(page.getData()[7] == 0x42);
+  CHECK(page.isCovered(7));
+  CHECK(!page.isCovered(6));
+  CHECK(page.countCovered(0, nPagesize) == 1);
+}
+
+/* the same bytes end up in the same pages for every page size and backend */
+static void testInsert(unsigned int nPagesize, unsigned int nFlashsize) {
+  CFlashmem* pFlashmem = nFlashsize > 0 ? new CFlashmem(nPagesize, nFlashsize)
+                                        : new CFlashmem(nPagesize);
+  unsigned char data[1000];
+  for (unsigned int n = 0; n < sizeof(data); n++) data[n] = n * 7;
+
+  CHECK(pFlashmem->insertBlock(100, data, sizeof(data)) == ERROR_NONE);
+  CHECK(pFlashmem->insertData(3000, 0x5a) == ERROR_NONE);
+
+  unsigned int nPages = 0;
+  for (CPage* pPage = pFlashmem->getFirstpage(); pPage != NULL; pPage = pPage->getNext())
+    nPages++;
+  unsigned int nExpected = (1099 / nPagesize - 100 / nPagesize + 1)
+      + (3000 / nPagesize > 1099 / nPagesize ? 1 : 0);
+  CHECK(nPages == nExpected);
+  CHECK(pFlashmem->getPagecount() == nExpected);
+
+  for (unsigned int n = 0; n < sizeof(data); n++) {
+    CPage* pPage = pFlashmem->getPageToAddress(100 + n);
+    CHECK(pPage != NULL);
+    if (pPage == NULL) break;
+    if (pPage->getData()[(100 + n) - pPage->getPageaddress()] != data[n]) {
+      CHECK(false);
+      break;
+    }
+  }
+  CPage* pPage = pFlashmem->getPageToAddress(3000);
+  CHECK(pPage != NULL && pPage->getData()[3000 - pPage->getPageaddress()] == 0x5a);
+  CHECK(pFlashmem->getPageToAddress(5000) == NULL);
+  delete pFlashmem;
+}
+
+/* every tail length, with 0xff bytes also inside the data */
+static void testDatalength(unsigned int nPagesize) {
+  CPage page(0, nPagesize);
+  unsigned char* pData = page.getData();
+  for (unsigned int nLength = 0; nLength <= nPagesize; nLength++) {
+    for (unsigned int n = 0; n < nPagesize; n++)
+      pData[n] = n >= nLength ? 0xff : n % 3 == 0 ? 0xff : (unsigned char) (n * 13);
+    if (nLength > 0) pData[nLength - 1] = (nLength & 0xff) == 0xff ? 0xfe : (unsigned char) nLength;
+    CHECK(page.getDatalength() == nLength);
+  }
+}
+
+int main() {
+  unsigned int sizes[] = { 32, 64, 96, 128, 256, 384, 512 };
+  for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+    testPageaddress(sizes[n]);
+    testInsert(sizes[n], 0);
+    testInsert(sizes[n], 0x2000);
+    testDatalength(sizes[n]);
+  }
+  testDatalength(4);
+  testDatalength(36);
+  return checkResult("tpage");
+}
@@ -0,0 +1,97 @@
+/*
+  tshared.cpp - part of flashtool for AVRUSBBoot, an USB bootloader for Atmel AVR controllers
+
+  Shared image store: two users of one segment see the same pages, the
+  segment leaves /dev/shm with the last user, a changed source file gets
+  a fresh segment and a broken one none.
+*/
+
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "avrusbboot.h"
+#include "csharedimage.h"
+#include "check.h"
+
+static void writeHex(const char* filename, unsigned char nFill) {
+  FILE* f = fopen(filename, "w");
+  for (unsigned int nAddress = 0; nAddress < 0x400; nAddress += 16) {
+    unsigned char sum = 16 + (nAddress >> 8) + (nAddress & 0xff);
+    fprintf(f, ":10%04X00", nAddress);
+    for (unsigned int n = 0; n < 16; n++) {
+      fprintf(f, "%02X", nFill);
+      sum += nFill;
+    }
+    fprintf(f, "%02X\n", (unsigned char) -sum);
+  }
+  fprintf(f, ":00000001FF\n");
+  fclose(f);
+}
+
+/* segments of the store currently in /dev/shm */
+static unsigned int countSegments() {
+  unsigned int nCount = 0;
+  DIR* dir = opendir("/dev/shm");
+  if (dir == NULL) return 0;
+  while (struct dirent* entry = readdir(dir))
+    if (strncmp(entry->d_name, "avrusbboot-", 11) == 0) nCount++;
+  closedir(dir);
+  return nCount;
+}
+
+int main() {
+  char filename[] = "tshared.hex";
+  char shared[] = "-S";
+  char* argv[] = { shared, filename };
+  writeHex(filename, 0x5a);
+
+  CFlashjob job;
+  for (int i = 0; i < 2; i++) CHECK(job.parseOption(2, argv, i));
+  unsigned int nBefore = countSegments();
+
+  CSharedimage* pFirst = new CSharedimage();
+  CSharedimage* pSecond = new CSharedimage();
+  CFlashmem* pFlashmem1 = pFirst->attach(&job, 64);
+  CFlashmem* pFlashmem2 = pSecond->attach(&job, 64);
+  CHECK(pFlashmem1 != NULL && pFlashmem2 != NULL);
+  CHECK(pFirst->getRefcount() == 2);
+  CHECK(countSegments() == nBefore + 1);
+  CHECK(pFlashmem2->getPagecount() == 16);
+  CHECK(pFlashmem2->getPageToAddress(0x3ff)->getData()[63] == 0x5a);
+
+  pFirst->detach();
+  CHECK(pSecond->getRefcount() == 1);
+  CHECK(countSegments() == nBefore + 1);
+  pSecond->detach();
+  CHECK(countSegments() == nBefore);
+
+  /* a changed file invalidates the segment of the running user */
+  CFlashmem* pOld = pFirst->attach(&job, 64);
+  sleep(1);
+  writeHex(filename, 0xa5);
+  CFlashmem* pNew = pSecond->attach(&job, 64);
+  CHECK(pOld != NULL && pNew != NULL);
+  CHECK(pOld->getFirstpage()->getData()[0] == 0x5a);
+  CHECK(pNew->getFirstpage()->getData()[0] == 0xa5);
+  CHECK(countSegments() == nBefore + 1);
+  delete pFirst;
+  CHECK(countSegments() == nBefore + 1);
+  delete pSecond;
+  CHECK(countSegments() == nBefore);
+
+  /* an image that does not parse leaves no segment behind and fails at
+     once, not after SHAREDIMAGE_WAIT */
+  FILE* f = fopen(filename, "w");
+  fprintf(f, ":10000000zz\n");
+  fclose(f);
+  CFlashjob badjob;
+  for (int i = 0; i < 2; i++) CHECK(badjob.parseOption(2, argv, i));
+  CSharedimage broken;
+  CHECK(broken.attach(&badjob, 64) == NULL);
+  CHECK(badjob.getError() == ERROR_FORMAT);
+  CHECK(countSegments() == nBefore);
+
+  remove(filename);
+  return checkResult("tshared");
+}